@@ -0,0 +1,1294 @@
+// benchmarks for the queues in reversible_queue.h, with the List from example.cc as a baseline
+// build: g++ -std=c++17 -O2 -pthread bench.cc -o bench          (-std=c++20 adds the coroutine scenario)
+// run:   ./bench [--list] [--scenario name,...] [--threads n] [--producers n] [--consumers n] [--size n]
+//                [--seconds s] [--seed n] [--dir path] [--json] [--trace path]
+// every run reports each operation's count, throughput and p50/p99/p999 latency in nanoseconds, plus whatever
+// figures the scenario measures itself. With --json the runs come out as one JSON array, to diff across commits
+// built with -DRQ_PROFILE_LOCKS it also prints the lock profile of the whole run to stderr, and --trace path writes
+// the acquisitions as Chrome trace JSON
+// timed scenarios run for --seconds; memory figures count the heap bytes live through operator new
+
+#include "reversible_queue.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <csignal>
+#include <sys/wait.h>
+#endif
+
+// the baseline, its standard headers are already in so only its own code lands in the namespace
+namespace example {
+#include "example.cc"
+}
+
+
+// every allocation made through the global operator new, and the heap bytes live, for the per item figures
+// the replacements stay out of line so the compiler does not pair inlined new expressions with free
+static std::atomic<std::uint64_t> allocations(0);
+static std::atomic<std::int64_t> liveBytes(0);
+
+static std::size_t Usable(void* p) {
+#if defined(__GLIBC__)
+    return malloc_usable_size(p);
+#else
+    return p ? 1 : 0;
+#endif
+}
+
+__attribute__((noinline)) void* operator new(std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) {
+        liveBytes.fetch_add(std::int64_t(Usable(p)), std::memory_order_relaxed);
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    if (!p) return;
+    liveBytes.fetch_sub(std::int64_t(Usable(p)), std::memory_order_relaxed);
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, std::size_t) noexcept {
+    operator delete(p);
+}
+
+// the column blocks are over aligned
+__attribute__((noinline)) void* operator new(std::size_t size, std::align_val_t align) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    const std::size_t alignment(std::max(sizeof(void*), std::size_t(align)));
+    void* p(nullptr);
+    if (posix_memalign(&p, alignment, size ? size : 1) != 0) throw std::bad_alloc();
+    liveBytes.fetch_add(std::int64_t(Usable(p)), std::memory_order_relaxed);
+    return p;
+}
+
+__attribute__((noinline)) void operator delete(void* p, std::align_val_t) noexcept {
+    operator delete(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, std::size_t, std::align_val_t) noexcept {
+    operator delete(p);
+}
+
+using Clock = std::chrono::steady_clock;
+
+static double Seconds(Clock::duration d) {
+    return std::chrono::duration<double>(d).count();
+}
+
+static std::uint64_t Nanoseconds(Clock::duration d) {
+    return std::uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+}
+
+// heap bytes currently allocated through operator new, only counted with glibc
+static std::int64_t Live() {
+    return liveBytes.load(std::memory_order_relaxed);
+}
+
+struct Params {
+    std::size_t threads = 2;
+    std::size_t producers = 0;
+    std::size_t consumers = 0;
+    std::size_t size = 100000;
+    double seconds = 0.5;
+    std::uint64_t seed = 1;
+    std::string dir = "/tmp";
+
+    std::size_t Producers() const { return producers ? producers : threads; }
+    std::size_t Consumers() const { return consumers ? consumers : threads; }
+};
+
+// latencies of one operation on one thread, a uniform sample once there are too many to keep them all
+class Samples {
+public:
+    void Add(std::uint64_t ns) {
+        count++;
+        if (kept.size() < keep) {
+            kept.push_back(ns);
+            return;
+        }
+        const std::uint64_t i(std::uniform_int_distribution<std::uint64_t>(0, count - 1)(rng));
+        if (i < keep) kept[i] = ns;
+    }
+
+    // runs fn and records how long it took
+    template<class Fn>
+    void Time(Fn&& fn) {
+        const Clock::time_point start(Clock::now());
+        fn();
+        Add(Nanoseconds(Clock::now() - start));
+    }
+
+    std::uint64_t count = 0;
+    std::vector<std::uint64_t> kept;
+
+private:
+    static const std::size_t keep = 1 << 16;
+
+    std::mt19937_64 rng;
+};
+
+// samples for each named operation on each thread, so threads never share one
+class Recorder {
+public:
+    Recorder(std::size_t threads, std::vector<std::string> ops)
+        : names(std::move(ops)), samples(threads, std::vector<Samples>(names.size())) {}
+
+    Samples& At(std::size_t thread, std::size_t op) {
+        return samples[thread][op];
+    }
+
+    std::uint64_t Count(std::size_t thread) const {
+        std::uint64_t count(0);
+        for (const Samples& op : samples[thread]) count += op.count;
+        return count;
+    }
+
+    std::size_t Threads() const {
+        return samples.size();
+    }
+
+    std::vector<std::string> names;
+    std::vector<std::vector<Samples>> samples;
+};
+
+struct OpResult {
+    std::string name;
+    std::uint64_t count;
+    double perSecond;
+    std::uint64_t p50;
+    std::uint64_t p99;
+    std::uint64_t p999;
+};
+
+struct RunResult {
+    std::string scenario;
+    std::string variant;
+    std::size_t threads;
+    std::size_t size;
+    std::vector<OpResult> ops;
+    std::vector<std::pair<std::string, double>> metrics;
+
+    void Metric(const std::string& name, double value) {
+        metrics.emplace_back(name, value);
+    }
+
+    // folds every thread's samples of each operation together
+    void Ops(const Recorder& recorder, double seconds) {
+        for (std::size_t op = 0; op < recorder.names.size(); op++) {
+            std::vector<std::uint64_t> all;
+            std::uint64_t count(0);
+            for (const std::vector<Samples>& thread : recorder.samples) {
+                all.insert(all.end(), thread[op].kept.begin(), thread[op].kept.end());
+                count += thread[op].count;
+            }
+            if (count == 0) continue;
+            std::sort(all.begin(), all.end());
+            auto at = [&all](double p) { return all[std::min(all.size() - 1, std::size_t(p * all.size()))]; };
+            ops.push_back(OpResult{recorder.names[op], count, count / seconds, at(0.5), at(0.99), at(0.999)});
+        }
+    }
+
+    // how evenly the threads got their operations done, the least over the most
+    void Fairness(const Recorder& recorder) {
+        std::uint64_t least(~std::uint64_t(0)), most(0);
+        for (std::size_t t = 0; t < recorder.Threads(); t++) {
+            least = std::min(least, recorder.Count(t));
+            most = std::max(most, recorder.Count(t));
+        }
+        if (most) Metric("fairness", double(least) / double(most));
+    }
+
+    void Stats(const QueueStats& stats, std::uint64_t operations) {
+        if (!operations) return;
+        Metric("retries_per_op", double(stats.retries) / double(operations));
+        Metric("trylock_failures_per_op", double(stats.tryLockFailures) / double(operations));
+    }
+};
+
+static std::vector<RunResult> results;
+
+static RunResult& NewRun(const std::string& scenario, const std::string& variant, const Params& params,
+                         std::size_t threads) {
+    results.push_back(RunResult{scenario, variant, threads, params.size, {}, {}});
+    return results.back();
+}
+
+// runs body(thread, stop) on n threads together until seconds have passed, returns how long they ran
+template<class Body>
+static double RunFor(std::size_t n, double seconds, Body body) {
+    std::atomic<bool> stop(false);
+    std::atomic<std::size_t> ready(0);
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < n; i++) {
+        threads.emplace_back([&, i] {
+            ready.fetch_add(1);
+            while (ready.load() < n) std::this_thread::yield();
+            body(i, stop);
+        });
+    }
+    while (ready.load() < n) std::this_thread::yield();
+    const Clock::time_point start(Clock::now());
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop.store(true);
+    for (std::thread& thread : threads) thread.join();
+    return Seconds(Clock::now() - start);
+}
+
+static std::string Word(std::mt19937_64& rng) {
+    std::uniform_int_distribution<int> letter(0, 25), length(3, 7);
+    std::string word;
+    for (int i = length(rng); i > 0; i--) word += char('a' + letter(rng));
+    return word;
+}
+
+using Entry = std::tuple<int, std::string>;
+using EntryQueue = ReversibleQueue<Entry, PooledNodes, OrderIndex, ExponentialBackoff, Versioned>;
+
+template<class Queue>
+static void Fill(Queue& queue, std::size_t n) {
+    std::vector<long> items(n);
+    for (std::size_t i = 0; i < n; i++) items[i] = long(i);
+    queue.PushBack(items.begin(), items.end());
+}
+
+static void FillEntries(EntryQueue& queue, std::size_t n, std::mt19937_64& rng) {
+    std::vector<Entry> items;
+    items.reserve(n);
+    for (std::size_t i = 0; i < n; i++) items.emplace_back(int(rng() % 256), Word(rng));
+    queue.PushBack(items.begin(), items.end());
+}
+
+// erases the observed item, the back one has to be popped instead, returns false if the observer lost its item
+template<class Queue>
+static bool EraseObserved(Queue& queue) {
+    try {
+        queue.Erase();
+    } catch (const std::domain_error&) {
+        queue.ClearObserver();
+        try {
+            queue.PopBack();
+        } catch (const std::logic_error&) {
+            return false;
+        }
+    } catch (const std::logic_error&) {
+        queue.ClearObserver();
+        return false;
+    }
+    return true;
+}
+
+// the three threads of 4f14_jh2044.cc's main, each scaled to --threads of them, without sleeps or printing
+// erasers put back what they take so the queue keeps its size
+static void Roles(const Params& params) {
+    EntryQueue queue;
+    std::mt19937_64 rng(params.seed);
+    FillEntries(queue, params.size, rng);
+    const std::size_t n(params.threads);
+    Recorder recorder(3 * n, {"reverse", "reduce", "print", "erase", "push"});
+    std::atomic<std::uint64_t> printed(0);
+    const double seconds(RunFor(3 * n, params.seconds, [&](std::size_t thread, std::atomic<bool>& stop) {
+        std::mt19937_64 local(params.seed + thread);
+        while (!stop.load(std::memory_order_relaxed)) {
+            if (thread < n) {
+                recorder.At(thread, 0).Time([&] { queue.reverse(); });
+                recorder.At(thread, 1).Time([&] {
+                    queue.TransformReduce(0L, std::plus<long>(), [](const Entry& e) { return long(std::get<0>(e)); });
+                });
+            } else if (thread < 2 * n) {
+                recorder.At(thread, 2).Time([&] {
+                    const EntryQueue::View view(queue.Snapshot());
+                    std::size_t characters(0);
+                    for (const Entry& entry : view) characters += std::get<1>(entry).size();
+                    printed.fetch_add(characters, std::memory_order_relaxed);
+                });
+            } else {
+                queue.InitObserver();
+                const std::size_t length(queue.Size());
+                if (length == 0) continue;
+                recorder.At(thread, 3).Time([&] {
+                    try {
+                        queue.GoTo(std::uniform_int_distribution<std::size_t>(0, length - 1)(local));
+                    } catch (const std::domain_error&) {
+                        return;
+                    }
+                    EraseObserved(queue);
+                });
+                Entry entry(int(local() % 256), Word(local));
+                recorder.At(thread, 4).Time([&] { queue.PushBack(std::move(entry)); });
+            }
+        }
+        queue.ReleaseObserver();
+    }));
+    RunResult& run(NewRun("roles", "node-indexed-versioned", params, 3 * n));
+    run.Ops(recorder, seconds);
+    run.Stats(queue.Stats(), queue.Stats().erases + queue.Stats().pushes + queue.Stats().reversals);
+}
+
+// producers pushing at the back and consumers popping from the front of a prefilled queue
+template<class Queue>
+static void PushPopRun(const Params& params, const std::string& variant, std::size_t batch) {
+    Queue queue;
+    Fill(queue, params.size);
+    const std::size_t producers(params.Producers()), consumers(params.Consumers());
+    Recorder recorder(producers + consumers, {"push", "pop"});
+    std::atomic<std::uint64_t> empty(0);
+    const std::uint64_t allocated(allocations.load());
+    const double seconds(RunFor(producers + consumers, params.seconds, [&](std::size_t thread, std::atomic<bool>& stop) {
+        std::vector<long> items(batch, long(thread));
+        std::vector<long> out(batch);
+        while (!stop.load(std::memory_order_relaxed)) {
+            if (thread < producers) {
+                recorder.At(thread, 0).Time([&] {
+                    if (batch == 1) queue.PushBack(long(thread));
+                    else queue.PushBack(items.begin(), items.end());
+                });
+            } else {
+                recorder.At(thread, 1).Time([&] {
+                    if (batch == 1) {
+                        if (!queue.TryPopFront()) empty.fetch_add(1, std::memory_order_relaxed);
+                    } else if (queue.PopFront(batch, out.begin()) == 0) {
+                        empty.fetch_add(1, std::memory_order_relaxed);
+                    }
+                });
+            }
+        }
+    }));
+    RunResult& run(NewRun(batch == 1 ? "pushpop" : "batch", variant, params, producers + consumers));
+    run.Ops(recorder, seconds);
+    std::uint64_t operations(0);
+    for (std::size_t t = 0; t < recorder.Threads(); t++) operations += recorder.Count(t);
+    if (batch > 1) {
+        run.Metric("batch", double(batch));
+        run.Metric("items_per_second", double(operations * batch) / seconds);
+    }
+    run.Metric("empty_pops", double(empty.load()));
+    run.Metric("allocations_per_op", double(allocations.load() - allocated) / double(std::max<std::uint64_t>(1, operations)));
+    run.Fairness(recorder);
+    run.Stats(queue.Stats(), operations);
+}
+
+// the ring only has room for so much, so producers may find it full
+template<std::size_t Capacity>
+static void PushPopBounded(const Params& params) {
+    auto queue(std::make_unique<BoundedReversibleQueue<long, Capacity>>());
+    for (std::size_t i = 0; i < std::min(params.size, Capacity / 2); i++) queue->TryPushBack(long(i));
+    const std::size_t producers(params.Producers()), consumers(params.Consumers());
+    Recorder recorder(producers + consumers, {"push", "pop"});
+    std::atomic<std::uint64_t> full(0), empty(0);
+    const double seconds(RunFor(producers + consumers, params.seconds, [&](std::size_t thread, std::atomic<bool>& stop) {
+        while (!stop.load(std::memory_order_relaxed)) {
+            if (thread < producers) {
+                recorder.At(thread, 0).Time([&] {
+                    if (!queue->TryPushBack(long(thread))) full.fetch_add(1, std::memory_order_relaxed);
+                });
+            } else {
+                recorder.At(thread, 1).Time([&] {
+                    if (!queue->TryPopFront()) empty.fetch_add(1, std::memory_order_relaxed);
+                });
+            }
+        }
+    }));
+    RunResult& run(NewRun("pushpop", "bounded-ring", params, producers + consumers));
+    run.Ops(recorder, seconds);
+    run.Metric("capacity", double(Capacity));
+    run.Metric("full_pushes", double(full.load()));
+    run.Metric("empty_pops", double(empty.load()));
+    run.Fairness(recorder);
+}
+
+// the baseline cannot be shared between threads, so one thread appends and takes from the head in turn
+static void PushPopList(const Params& params) {
+    example::List<std::string> list;
+    for (std::size_t i = 0; i < params.size; i++) list.append("item");
+    Recorder recorder(1, {"push", "pop"});
+    const double seconds(RunFor(1, params.seconds, [&](std::size_t, std::atomic<bool>& stop) {
+        while (!stop.load(std::memory_order_relaxed)) {
+            recorder.At(0, 0).Time([&] { list.append("item"); });
+            recorder.At(0, 1).Time([&] {
+                list.goToHead();
+                list.removeNode();
+                list.clearPosition();
+            });
+        }
+    }));
+    RunResult& run(NewRun("pushpop", "example-list", params, 1));
+    run.Ops(recorder, seconds);
+}
+
+static void PushPop(const Params& params) {
+    PushPopRun<ReversibleQueue<long>>(params, "node-pooled", 1);
+    PushPopRun<ReversibleQueue<long, HeapNodes>>(params, "node-heap", 1);
+    PushPopRun<UnrolledReversibleQueue<long>>(params, "unrolled", 1);
+    PushPopBounded<(1 << 16)>(params);
+    PushPopList(params);
+}
+
+// the same traffic moved in batches through the range push and the counted pop
+static void Batch(const Params& params) {
+    for (std::size_t batch : {8, 64, 512}) {
+        PushPopRun<ReversibleQueue<long>>(params, "node-pooled", batch);
+        PushPopRun<UnrolledReversibleQueue<long>>(params, "unrolled", batch);
+    }
+}
+
+// walkers going over the whole queue while one thread pushes at the back and pops at the front
+// walk is one whole traversal, step one observer move
+template<class Queue, class Walk>
+static void TraverseRun(const Params& params, const std::string& variant, Walk walk) {
+    Queue queue;
+    Fill(queue, params.size);
+    const std::size_t walkers(params.threads);
+    Recorder recorder(walkers + 1, {"walk", "push", "pop"});
+    std::atomic<std::uint64_t> visited(0);
+    const double seconds(RunFor(walkers + 1, params.seconds, [&](std::size_t thread, std::atomic<bool>& stop) {
+        while (!stop.load(std::memory_order_relaxed)) {
+            if (thread == walkers) {
+                recorder.At(thread, 1).Time([&] { queue.PushBack(long(thread)); });
+                recorder.At(thread, 2).Time([&] { queue.TryPopFront(); });
+                continue;
+            }
+            std::size_t count(0);
+            recorder.At(thread, 0).Time([&] { count = walk(queue); });
+            visited.fetch_add(count, std::memory_order_relaxed);
+        }
+        queue.ReleaseObserver();
+    }));
+    RunResult& run(NewRun("traverse", variant, params, walkers + 1));
+    run.Ops(recorder, seconds);
+    run.Metric("items_visited_per_second", double(visited.load()) / seconds);
+}
+
+template<class Queue>
+static std::size_t WalkUnlocked(Queue& queue) {
+    std::size_t count(0);
+    long sum(0);
+    queue.ForEachFromBack([&](const long& item) {
+        sum += item;
+        count++;
+    });
+    return count + (sum < 0);
+}
+
+// GoToBack then MoveForward to the front, holding one lock at a time
+template<class Queue>
+static std::size_t WalkObserver(Queue& queue) {
+    std::size_t count(0);
+    try {
+        queue.GoToBack();
+        while (true) {
+            count++;
+            queue.MoveForward();
+        }
+    } catch (const std::logic_error&) {
+        // domain_error at the front, or the walk lost its item
+    }
+    queue.ClearObserver();
+    return count;
+}
+
+static void TraverseList(const Params& params) {
+    example::List<std::string> list;
+    for (std::size_t i = 0; i < params.size; i++) list.append("item");
+    Recorder recorder(1, {"walk"});
+    std::uint64_t visited(0);
+    const double seconds(RunFor(1, params.seconds, [&](std::size_t, std::atomic<bool>& stop) {
+        while (!stop.load(std::memory_order_relaxed)) {
+            recorder.At(0, 0).Time([&] {
+                for (std::string item(list.goToHead()); !item.empty(); item = list.moveForward()) visited++;
+                list.clearPosition();
+            });
+        }
+    }));
+    RunResult& run(NewRun("traverse", "example-list", params, 1));
+    run.Ops(recorder, seconds);
+    run.Metric("items_visited_per_second", double(visited) / seconds);
+}
+
+static void Traverse(const Params& params) {
+    TraverseRun<ReversibleQueue<long>>(params, "node-unlocked", WalkUnlocked<ReversibleQueue<long>>);
+    TraverseRun<ReversibleQueue<long>>(params, "node-observer", WalkObserver<ReversibleQueue<long>>);
+    using Versioned = ReversibleQueue<long, PooledNodes, NoIndex, ExponentialBackoff, ::Versioned>;
+    TraverseRun<Versioned>(params, "node-snapshot", [](Versioned& queue) {
+        const Versioned::View view(queue.Snapshot());
+        std::size_t count(0);
+        long sum(0);
+        for (const long& item : view) {
+            sum += item;
+            count++;
+        }
+        return count + (sum < 0);
+    });
+    TraverseRun<UnrolledReversibleQueue<long>>(params, "unrolled-unlocked", WalkUnlocked<UnrolledReversibleQueue<long>>);
+    TraverseRun<UnrolledReversibleQueue<long>>(params, "unrolled-observer", WalkObserver<UnrolledReversibleQueue<long>>);
+    TraverseList(params);
+}
+
+// erasers picking a random position, going there and erasing, then pushing a replacement at the back
+template<class Queue>
+static void EraseRun(const Params& params, const std::string& variant) {
+    Queue queue;
+    Fill(queue, params.size);
+    Recorder recorder(params.threads, {"seek", "erase", "push"});
+    std::atomic<std::uint64_t> lost(0);
+    const double seconds(RunFor(params.threads, params.seconds, [&](std::size_t thread, std::atomic<bool>& stop) {
+        std::mt19937_64 rng(params.seed + thread);
+        queue.InitObserver();
+        while (!stop.load(std::memory_order_relaxed)) {
+            const std::size_t length(queue.Size());
+            if (length == 0) continue;
+            bool found(true);
+            recorder.At(thread, 0).Time([&] {
+                try {
+                    queue.GoTo(std::uniform_int_distribution<std::size_t>(0, length - 1)(rng));
+                } catch (const std::domain_error&) {
+                    found = false;
+                }
+            });
+            if (!found) continue;
+            recorder.At(thread, 1).Time([&] {
+                if (!EraseObserved(queue)) lost.fetch_add(1, std::memory_order_relaxed);
+            });
+            recorder.At(thread, 2).Time([&] { queue.PushBack(long(thread)); });
+        }
+        queue.ReleaseObserver();
+    }));
+    RunResult& run(NewRun("erase", variant, params, params.threads));
+    run.Ops(recorder, seconds);
+    run.Metric("lost_observers", double(lost.load()));
+    run.Fairness(recorder);
+}
+
+static void EraseList(const Params& params) {
+    example::List<std::string> list;
+    for (std::size_t i = 0; i < params.size; i++) list.append("item");
+    Recorder recorder(1, {"seek", "erase", "push"});
+    std::mt19937_64 rng(params.seed);
+    const double seconds(RunFor(1, params.seconds, [&](std::size_t, std::atomic<bool>& stop) {
+        while (!stop.load(std::memory_order_relaxed)) {
+            const int k(std::uniform_int_distribution<int>(0, list.getSize() - 1)(rng));
+            recorder.At(0, 0).Time([&] {
+                list.goToHead();
+                for (int i = 0; i < k; i++) list.moveForward();
+            });
+            recorder.At(0, 1).Time([&] {
+                list.removeNode();
+                list.clearPosition();
+            });
+            recorder.At(0, 2).Time([&] { list.append("item"); });
+        }
+    }));
+    RunResult& run(NewRun("erase", "example-list", params, 1));
+    run.Ops(recorder, seconds);
+}
+
+static void Erase(const Params& params) {
+    EraseRun<ReversibleQueue<long>>(params, "node");
+    EraseRun<ReversibleQueue<long, PooledNodes, OrderIndex>>(params, "node-indexed");
+    EraseRun<UnrolledReversibleQueue<long>>(params, "unrolled");
+    EraseList(params);
+}
+
+// walkers going both ways, erasers and a reverser on a small queue, so locks are fought over
+// run once per contention policy
+template<class Contention>
+static void ContentionRun(const Params& params, const std::string& variant) {
+    using Queue = ReversibleQueue<long, PooledNodes, OrderIndex, Contention>;
+    Queue queue;
+    const std::size_t size(std::min<std::size_t>(params.size, 1000));
+    Fill(queue, size);
+    const std::size_t n(params.threads);
+    Recorder recorder(2 * n + 1, {"step", "erase", "push", "reverse"});
+    std::atomic<std::uint64_t> lost(0);
+    const double seconds(RunFor(2 * n + 1, params.seconds, [&](std::size_t thread, std::atomic<bool>& stop) {
+        std::mt19937_64 rng(params.seed + thread);
+        queue.InitObserver();
+        while (!stop.load(std::memory_order_relaxed)) {
+            if (thread == 2 * n) {
+                recorder.At(thread, 3).Time([&] { queue.reverse(); });
+                std::this_thread::yield();
+            } else if (thread < n) {
+                // walkers, half of them forwards
+                const bool forwards(thread % 2 == 0);
+                try {
+                    forwards ? queue.GoToBack() : queue.GoToFront();
+                    while (!stop.load(std::memory_order_relaxed)) {
+                        recorder.At(thread, 0).Time([&] { forwards ? queue.MoveForward() : queue.MoveBackward(); });
+                    }
+                } catch (const std::domain_error&) {
+                } catch (const std::logic_error&) {
+                    lost.fetch_add(1, std::memory_order_relaxed);
+                }
+                queue.ClearObserver();
+            } else {
+                const std::size_t length(queue.Size());
+                if (length == 0) continue;
+                try {
+                    queue.GoTo(std::uniform_int_distribution<std::size_t>(0, length - 1)(rng));
+                } catch (const std::domain_error&) {
+                    continue;
+                }
+                recorder.At(thread, 1).Time([&] {
+                    if (!EraseObserved(queue)) lost.fetch_add(1, std::memory_order_relaxed);
+                });
+                recorder.At(thread, 2).Time([&] { queue.PushFront(long(thread)); });
+            }
+        }
+        queue.ReleaseObserver();
+    }));
+    RunResult& run(NewRun("contention", variant, params, 2 * n + 1));
+    run.Ops(recorder, seconds);
+    std::uint64_t operations(0);
+    for (std::size_t t = 0; t < recorder.Threads(); t++) operations += recorder.Count(t);
+    run.Metric("lost_observers", double(lost.load()));
+    run.Fairness(recorder);
+    run.Stats(queue.Stats(), operations);
+}
+
+static void Contention(const Params& params) {
+    ContentionRun<ImmediateRetry>(params, "immediate");
+    ContentionRun<ExponentialBackoff>(params, "exponential");
+    ContentionRun<YieldBackoff>(params, "yield");
+    ContentionRun<HandoffBackoff>(params, "handoff");
+}
+
+// TransformReduce and ParallelForEach over the whole queue on pools of one thread up to --threads
+static void Reduce(const Params& params) {
+    ReversibleQueue<long> queue;
+    Fill(queue, params.size);
+    double single(0);
+    for (std::size_t threads = 1; threads <= params.threads; threads *= 2) {
+        ThreadPool pool(threads);
+        Recorder recorder(1, {"reduce", "for_each"});
+        std::atomic<long> sink(0);
+        const double seconds(RunFor(1, params.seconds, [&](std::size_t, std::atomic<bool>& stop) {
+            while (!stop.load(std::memory_order_relaxed)) {
+                recorder.At(0, 0).Time([&] {
+                    sink += queue.TransformReduce(0L, std::plus<long>(), [](long item) { return item * 3; }, pool);
+                });
+                recorder.At(0, 1).Time([&] {
+                    queue.ParallelForEach([&sink](long item) {
+                        if (item < 0) sink.fetch_add(item, std::memory_order_relaxed);
+                    }, pool);
+                });
+            }
+        }));
+        RunResult& run(NewRun("reduce", "pool-" + std::to_string(threads), params, threads));
+        run.Ops(recorder, seconds);
+        const double perSecond(run.ops.empty() ? 0 : run.ops[0].perSecond);
+        if (threads == 1) single = perSecond;
+        if (single > 0) run.Metric("speedup", perSecond / single);
+    }
+}
+
+// how long a snapshot takes to open, and how much memory open snapshots keep alive while writers carry on
+static void Snapshot(const Params& params) {
+    using Queue = ReversibleQueue<long, PooledNodes, NoIndex, ExponentialBackoff, Versioned>;
+    Queue queue;
+    Fill(queue, params.size);
+    const std::size_t writers(params.threads);
+    Recorder recorder(writers + 1, {"snapshot", "iterate", "push", "pop"});
+    const std::int64_t baseline(Live());
+    std::int64_t peak(baseline);
+    const std::size_t held(16);
+    const double seconds(RunFor(writers + 1, params.seconds, [&](std::size_t thread, std::atomic<bool>& stop) {
+        if (thread < writers) {
+            while (!stop.load(std::memory_order_relaxed)) {
+                recorder.At(thread, 2).Time([&] { queue.PushBack(long(thread)); });
+                recorder.At(thread, 3).Time([&] { queue.TryPopFront(); });
+            }
+            return;
+        }
+        // keeps the last few snapshots open so the writers have history to keep
+        std::vector<Queue::View> views;
+        while (!stop.load(std::memory_order_relaxed)) {
+            recorder.At(thread, 0).Time([&] { views.push_back(queue.Snapshot()); });
+            if (views.size() > held) views.erase(views.begin());
+            recorder.At(thread, 1).Time([&] {
+                long sum(0);
+                for (const long& item : views.back()) sum += item;
+                if (sum < 0) std::abort();
+            });
+            peak = std::max(peak, Live());
+        }
+    }));
+    RunResult& run(NewRun("snapshot", "node-versioned", params, writers + 1));
+    run.Ops(recorder, seconds);
+    run.Metric("open_snapshots", double(held));
+    run.Metric("peak_extra_bytes_per_open_snapshot", double(peak - baseline) / double(held));
+}
+
+// summing one field of every item: the column scan against the scalar loop QueueReverser used
+static void Columns(const Params& params) {
+    using Item = std::tuple<int, double, std::string>;
+    using Columned = UnrolledReversibleQueue<Item, 64, HeapNodes, ExponentialBackoff, ColumnsOf<0, 1>>;
+    using Plain = UnrolledReversibleQueue<Item, 64, HeapNodes>;
+    std::vector<Item> items;
+    items.reserve(params.size);
+    for (std::size_t i = 0; i < params.size; i++) items.emplace_back(int(i % 1000), double(i % 977), "item");
+
+    std::int64_t before(Live());
+    Plain plain;
+    plain.PushBack(items.begin(), items.end());
+    const double plainBytes(double(Live() - before) / double(params.size));
+    before = Live();
+    Columned columned;
+    columned.PushBack(items.begin(), items.end());
+    const double columnedBytes(double(Live() - before) / double(params.size));
+    ReversibleQueue<Item> nodes;
+    nodes.PushBack(items.begin(), items.end());
+
+    Recorder recorder(1, {"scalar_node", "scalar_unrolled", "column_int", "column_double", "column_count_if"});
+    std::atomic<long> sink(0);
+    const double seconds(RunFor(1, params.seconds, [&](std::size_t, std::atomic<bool>& stop) {
+        while (!stop.load(std::memory_order_relaxed)) {
+            recorder.At(0, 0).Time([&] {
+                long sum(0);
+                nodes.ForEachFromBack([&sum](const Item& item) { sum += std::get<0>(item); });
+                sink += sum;
+            });
+            recorder.At(0, 1).Time([&] {
+                long sum(0);
+                plain.ForEachFromBack([&sum](const Item& item) { sum += std::get<0>(item); });
+                sink += sum;
+            });
+            recorder.At(0, 2).Time([&] { sink += long(columned.Column<0>().Sum()); });
+            recorder.At(0, 3).Time([&] { sink += long(columned.Column<1>().Sum()); });
+            recorder.At(0, 4).Time([&] { sink += long(columned.Column<0>().CountIf([](int v) { return v < 500; })); });
+        }
+    }));
+    RunResult& run(NewRun("columns", "unrolled-64", params, 1));
+    run.Ops(recorder, seconds);
+    for (const OpResult& op : run.ops) {
+        run.Metric(op.name + "_ns_per_item", double(op.p50) / double(std::max<std::size_t>(1, params.size)));
+    }
+    run.Metric("bytes_per_item_plain", plainBytes);
+    run.Metric("bytes_per_item_columned", columnedBytes);
+}
+
+// bytes of memory and allocations per item held, for each engine, filled up to at most limit items
+template<class Queue>
+static void MemoryRun(const Params& params, const std::string& variant,
+                      std::size_t limit = std::numeric_limits<std::size_t>::max()) {
+    const std::size_t n(std::min(params.size, limit));
+    const std::int64_t before(Live());
+    const std::uint64_t allocated(allocations.load());
+    {
+        auto queue(std::make_unique<Queue>());
+        const Clock::time_point start(Clock::now());
+        for (std::size_t i = 0; i < n; i++) queue->PushBack(long(i));
+        const double seconds(Seconds(Clock::now() - start));
+        RunResult& run(NewRun("memory", variant, params, 1));
+        run.Metric("items", double(n));
+        run.Metric("push_per_second", double(n) / seconds);
+        run.Metric("bytes", double(Live() - before));
+        run.Metric("bytes_per_item", double(Live() - before) / double(n));
+        run.Metric("allocations_per_item", double(allocations.load() - allocated) / double(n));
+    }
+}
+
+static void Memory(const Params& params) {
+    MemoryRun<ReversibleQueue<long>>(params, "node-pooled");
+    MemoryRun<ReversibleQueue<long, HeapNodes>>(params, "node-heap");
+    MemoryRun<ReversibleQueue<long, PooledNodes, OrderIndex>>(params, "node-indexed");
+    MemoryRun<UnrolledReversibleQueue<long>>(params, "unrolled");
+    // the ring holds its whole capacity from the start, so its bytes per item only fall as it fills
+    MemoryRun<BoundedReversibleQueue<long, (1 << 20)>>(params, "bounded-ring-1M", 1 << 20);
+    {
+        const std::int64_t before(Live());
+        const std::uint64_t allocated(allocations.load());
+        example::List<std::string> list;
+        for (std::size_t i = 0; i < params.size; i++) list.append("item");
+        RunResult& run(NewRun("memory", "example-list", params, 1));
+        run.Metric("bytes", double(Live() - before));
+        run.Metric("bytes_per_item", double(Live() - before) / double(params.size));
+        run.Metric("allocations_per_item", double(allocations.load() - allocated) / double(params.size));
+    }
+}
+
+// counts what happens to an item on its way in
+struct Counted {
+    static std::atomic<std::uint64_t> copies;
+    static std::atomic<std::uint64_t> moves;
+
+    explicit Counted(long v = 0) : value(v) {}
+    Counted(const Counted& other) : value(other.value) { copies++; }
+    Counted(Counted&& other) noexcept : value(other.value) { moves++; }
+    Counted& operator=(const Counted& other) { value = other.value; copies++; return *this; }
+    Counted& operator=(Counted&& other) noexcept { value = other.value; moves++; return *this; }
+
+    long value;
+};
+
+std::atomic<std::uint64_t> Counted::copies(0);
+std::atomic<std::uint64_t> Counted::moves(0);
+
+// copies and moves per item for each way of adding one, and of taking it out again
+static void Copies(const Params& params) {
+    ReversibleQueue<Counted> queue;
+    const std::size_t n(std::min<std::size_t>(params.size, 100000));
+    auto measure = [&](const std::string& variant, auto add) {
+        Counted::copies = 0;
+        Counted::moves = 0;
+        for (std::size_t i = 0; i < n; i++) add(long(i));
+        RunResult& run(NewRun("copies", variant, params, 1));
+        run.Metric("copies_per_item", double(Counted::copies.load()) / double(n));
+        run.Metric("moves_per_item", double(Counted::moves.load()) / double(n));
+    };
+    measure("push-const-ref", [&](long v) { const Counted item(v); queue.PushBack(item); });
+    measure("push-rvalue", [&](long v) { queue.PushBack(Counted(v)); });
+    measure("emplace", [&](long v) { queue.EmplaceBack(v); });
+    measure("cursor-emplace", [&](long v) { queue.Front().Emplace(v); });
+    measure("try-pop", [&](long) { queue.TryPopFront(); });
+}
+
+// how soon a waiting consumer has an item after it was pushed
+template<class Queue>
+static void WakeupRun(const Params& params, const std::string& variant) {
+    Queue queue;
+    Recorder recorder(1, {"wakeup"});
+    std::atomic<bool> done(false);
+    std::thread consumer([&] {
+        while (std::optional<long> pushed = queue.WaitPopFront()) {
+            recorder.At(0, 0).Add(std::uint64_t(Clock::now().time_since_epoch().count() - *pushed));
+        }
+        done = true;
+    });
+    const Clock::time_point start(Clock::now());
+    while (Seconds(Clock::now() - start) < params.seconds) {
+        queue.PushBack(long(Clock::now().time_since_epoch().count()));
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    queue.Close();
+    consumer.join();
+    RunResult& run(NewRun("wakeup", variant, params, 2));
+    run.Ops(recorder, Seconds(Clock::now() - start));
+}
+
+static void Wakeup(const Params& params) {
+    static_assert(std::is_same<Clock::duration, std::chrono::nanoseconds>::value, "wakeups are stamped in ns");
+    WakeupRun<ReversibleQueue<long>>(params, "node");
+    WakeupRun<UnrolledReversibleQueue<long>>(params, "unrolled");
+    WakeupRun<BoundedReversibleQueue<long, 1024>>(params, "bounded-ring");
+}
+
+// reverse while producers and consumers keep both ends busy
+template<class Queue>
+static void ReverseRun(const Params& params, const std::string& variant) {
+    auto queue(std::make_unique<Queue>());
+    for (std::size_t i = 0; i < std::min<std::size_t>(params.size, 1000); i++) queue->TryPushBack(long(i));
+    const std::size_t n(params.threads);
+    Recorder recorder(2 * n + 1, {"reverse", "push", "pop"});
+    const double seconds(RunFor(2 * n + 1, params.seconds, [&](std::size_t thread, std::atomic<bool>& stop) {
+        while (!stop.load(std::memory_order_relaxed)) {
+            if (thread == 2 * n) {
+                recorder.At(thread, 0).Time([&] { queue->reverse(); });
+            } else if (thread < n) {
+                recorder.At(thread, 1).Time([&] { queue->TryPushBack(long(thread)); });
+            } else {
+                recorder.At(thread, 2).Time([&] { queue->TryPopFront(); });
+            }
+        }
+    }));
+    RunResult& run(NewRun("reverse", variant, params, 2 * n + 1));
+    run.Ops(recorder, seconds);
+}
+
+// the node engines never fill up, so trying to push always pushes
+template<class Queue>
+struct Unbounded : Queue {
+    bool TryPushBack(long item) {
+        Queue::PushBack(item);
+        return true;
+    }
+};
+
+static void Reverse(const Params& params) {
+    ReverseRun<Unbounded<ReversibleQueue<long>>>(params, "node");
+    ReverseRun<Unbounded<UnrolledReversibleQueue<long>>>(params, "unrolled");
+    ReverseRun<BoundedReversibleQueue<long, (1 << 16)>>(params, "bounded-ring");
+}
+
+// dump and load through the binary format
+template<class Queue, class Make>
+static void SerializeRun(const Params& params, const std::string& variant, Make make) {
+    Queue queue;
+    std::vector<typename std::decay<decltype(make(0))>::type> items;
+    items.reserve(params.size);
+    for (std::size_t i = 0; i < params.size; i++) items.push_back(make(i));
+    queue.PushBack(items.begin(), items.end());
+    std::vector<unsigned char> bytes;
+    Recorder recorder(1, {"dump", "load"});
+    const Clock::time_point start(Clock::now());
+    for (int round = 0; round < 3; round++) {
+        bytes.clear();
+        recorder.At(0, 0).Time([&] { queue.Serialize(bytes); });
+        Queue loaded;
+        recorder.At(0, 1).Time([&] { loaded.Deserialize(bytes); });
+        if (loaded.Size() != queue.Size()) throw std::logic_error("loaded queue differs");
+    }
+    RunResult& run(NewRun("serialize", variant, params, 1));
+    run.Ops(recorder, Seconds(Clock::now() - start));
+    run.Metric("bytes", double(bytes.size()));
+    for (const OpResult& op : run.ops) run.Metric(op.name + "_gb_per_second", double(bytes.size()) / double(op.p50));
+}
+
+static void Serialize(const Params& params) {
+    SerializeRun<ReversibleQueue<long, HeapNodes>>(params, "node-long", [](std::size_t i) { return long(i); });
+    SerializeRun<ReversibleQueue<Entry, HeapNodes>>(params, "node-entry", [](std::size_t i) {
+        return Entry(int(i % 256), std::string(3 + i % 5, 'a'));
+    });
+}
+
+// cutting the queue in half and joining it back up, against moving the same items across one pop and push at a time
+// with opposite set every other queue split off is turned round first, so rejoining has to mirror it
+template<class Queue>
+static void SpliceRun(const Params& params, const std::string& variant, bool opposite) {
+    Queue queue;
+    Fill(queue, params.size);
+    const std::size_t half(params.size / 2);
+    Recorder recorder(1, {"split", "splice", "copy"});
+    const Clock::time_point start(Clock::now());
+    for (int round = 0; round < 20; round++) {
+        typename Queue::Cursor cursor(queue.SeekFromBack(half));
+        std::unique_ptr<Queue> back;
+        recorder.At(0, 0).Time([&] { back.reset(new Queue(queue.SplitAt(cursor))); });
+        cursor.Release();
+        if (opposite && round % 2) back->reverse();
+        recorder.At(0, 1).Time([&] { queue.SpliceBack(std::move(*back)); });
+        if (queue.Size() != params.size) throw std::logic_error("spliced queue lost items");
+    }
+    for (int round = 0; round < 3; round++) {
+        Queue moved;
+        recorder.At(0, 2).Time([&] {
+            long item;
+            for (std::size_t i = 0; i < half && queue.TryPopBack(item); i++) moved.PushFront(item);
+            while (moved.TryPopFront(item)) queue.PushBack(item);
+        });
+    }
+    RunResult& run(NewRun("splice", variant, params, 1));
+    run.Ops(recorder, Seconds(Clock::now() - start));
+}
+
+static void Splice(const Params& params) {
+    SpliceRun<ReversibleQueue<long>>(params, "node", false);
+    SpliceRun<ReversibleQueue<long>>(params, "node-opposite", true);
+    SpliceRun<ReversibleQueue<long, PooledNodes, OrderIndex>>(params, "node-indexed", false);
+    SpliceRun<ReversibleQueue<long, PooledNodes, OrderIndex, ExponentialBackoff, Versioned>>(
+            params, "node-indexed-versioned", false);
+}
+
+// each thread pushing then popping one item, or with stealing half only push and half only pop
+template<class Queue>
+static void ScalingRun(const Params& params, const std::string& variant, std::size_t threads, bool stealing,
+                       Queue& queue) {
+    Recorder recorder(threads, {"push", "pop"});
+    std::atomic<std::uint64_t> empty(0);
+    const double seconds(RunFor(threads, params.seconds, [&](std::size_t thread, std::atomic<bool>& stop) {
+        const bool pushes(!stealing || thread % 2 == 0), pops(!stealing || thread % 2 == 1 || threads == 1);
+        while (!stop.load(std::memory_order_relaxed)) {
+            if (pushes) recorder.At(thread, 0).Time([&] { queue.PushFront(long(thread)); });
+            if (pops) {
+                recorder.At(thread, 1).Time([&] {
+                    if (!queue.TryPopFront()) empty.fetch_add(1, std::memory_order_relaxed);
+                });
+            }
+        }
+    }));
+    RunResult& run(NewRun(stealing ? "scaling-stealing" : "scaling", variant, params, threads));
+    run.Ops(recorder, seconds);
+    std::uint64_t operations(0);
+    for (std::size_t t = 0; t < threads; t++) operations += recorder.Count(t);
+    run.Metric("ops_per_second", double(operations) / seconds);
+    run.Metric("empty_pops", double(empty.load()));
+    run.Fairness(recorder);
+}
+
+// ops/sec from 1 to 64 threads, one shared queue against a queue with a shard per thread
+static void Scaling(const Params& params) {
+    for (bool stealing : {false, true}) {
+        for (std::size_t threads = 1; threads <= 64; threads *= 2) {
+            {
+                ReversibleQueue<long> queue;
+                ScalingRun(params, "single", threads, stealing, queue);
+            }
+            {
+                ShardedReversibleQueue<long> queue(threads);
+                ScalingRun(params, "sharded", threads, stealing, queue);
+                results.back().Metric("steals", double(queue.Steals()));
+            }
+        }
+    }
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+// reopening a mapped queue with a journal tail left behind, and reopening after killing a writer mid-write
+static void Restart(const Params& params) {
+    const std::string path(params.dir + "/bench-" + std::to_string(getpid()) + ".queue");
+    auto remove = [&path] {
+        std::remove(path.c_str());
+        std::remove((path + ".journal").c_str());
+    };
+    remove();
+    {
+        MappedReversibleQueue<long> queue(path);
+        for (std::size_t i = 0; i < params.size; i++) queue.PushBack(long(i));
+    }
+    Recorder recorder(1, {"reopen", "reopen_after_kill"});
+    for (int round = 0; round < 5; round++) {
+        // leave a tail of a thousand operations in the journal by exiting without closing
+        const pid_t child(fork());
+        if (child == 0) {
+            MappedReversibleQueue<long> queue(path);
+            for (int i = 0; i < 500; i++) {
+                queue.PushFront(long(i));
+                queue.TryPopFront();
+            }
+            std::_Exit(0);
+        }
+        waitpid(child, nullptr, 0);
+        recorder.At(0, 0).Time([&] {
+            MappedReversibleQueue<long> queue(path);
+            if (queue.Size() != params.size) throw std::logic_error("mapped queue lost items");
+        });
+    }
+    remove();
+
+    // a writer pushing and popping in a known pattern, killed at a random moment
+    std::mt19937_64 rng(params.seed);
+    std::size_t failures(0);
+    const int trials(10);
+    for (int trial = 0; trial < trials; trial++) {
+        remove();
+        const pid_t child(fork());
+        if (child == 0) {
+            MappedReversibleQueue<long> queue(path, std::size_t(1) << 16);
+            for (long i = 0;; i++) {
+                queue.PushBack(i);
+                if (i % 3 == 2) queue.TryPopFront();
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20 + rng() % 200));
+        kill(child, SIGKILL);
+        waitpid(child, nullptr, 0);
+        recorder.At(0, 1).Time([&] {
+            MappedReversibleQueue<long> queue(path);
+            std::vector<long> items;
+            queue.ForEachFromBack([&items](const long& item) { items.push_back(item); });
+            bool consistent(items.size() == queue.Size());
+            for (std::size_t i = 1; i < items.size(); i++) consistent = consistent && items[i] == items[i - 1] - 1;
+            if (!consistent) failures++;
+        });
+    }
+    remove();
+    RunResult& run(NewRun("restart", "mapped", params, 1));
+    run.Ops(recorder, 1);
+    run.Metric("crash_trials", double(trials));
+    run.Metric("crash_failures", double(failures));
+}
+#endif
+
+#if defined(__cpp_impl_coroutine)
+// fire and forget coroutine for the consumers
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// a hundred thousand coroutines each waiting for one item on a small pool
+static void Coroutines(const Params& params) {
+    const std::size_t consumers(100000);
+    ReversibleQueue<long> queue;
+    ThreadPool pool(params.threads);
+    Recorder recorder(1, {"wakeup"});
+    std::mutex recorderMutex;
+    std::atomic<std::size_t> done(0);
+    auto consume = [&]() -> Detached {
+        const std::optional<long> pushed(co_await queue.AsyncPopFront(pool));
+        const std::uint64_t ns(std::uint64_t(Clock::now().time_since_epoch().count() - *pushed));
+        {
+            std::lock_guard<std::mutex> lock(recorderMutex);
+            recorder.At(0, 0).Add(ns);
+        }
+        done.fetch_add(1);
+    };
+    for (std::size_t i = 0; i < consumers; i++) consume();
+    const Clock::time_point start(Clock::now());
+    for (std::size_t i = 0; i < consumers; i++) queue.PushBack(long(Clock::now().time_since_epoch().count()));
+    while (done.load() < consumers) std::this_thread::yield();
+    const double seconds(Seconds(Clock::now() - start));
+    RunResult& run(NewRun("coroutines", "node-pool-" + std::to_string(params.threads), params, params.threads));
+    run.Ops(recorder, seconds);
+    run.Metric("consumers", double(consumers));
+}
+#endif
+
+struct Scenario {
+    const char* name;
+    const char* description;
+    void (*run)(const Params&);
+};
+
+static const Scenario scenarios[] = {
+    {"roles", "reverser, printer and eraser threads from main() scaled to --threads each", Roles},
+    {"pushpop", "--producers pushing and --consumers popping, every engine and the baseline", PushPop},
+    {"batch", "pushpop moving items in batches through range pushes and counted pops", Batch},
+    {"traverse", "--threads walkers over the queue while one thread pushes and pops", Traverse},
+    {"erase", "--threads erasers at random positions, each erase replaced by a push", Erase},
+    {"contention", "walkers both ways, erasers and a reverser on a small queue, per contention policy", Contention},
+    {"reduce", "TransformReduce and ParallelForEach on pools of 1 up to --threads threads", Reduce},
+    {"snapshot", "snapshot open and iterate latency, memory held by open snapshots", Snapshot},
+    {"columns", "column scans against the scalar loop, memory per item", Columns},
+    {"memory", "bytes and allocations per item held, every engine and the baseline", Memory},
+    {"copies", "copies and moves per item for each way in and out", Copies},
+    {"wakeup", "push to waiting consumer latency", Wakeup},
+    {"reverse", "reverse latency with both ends busy", Reverse},
+    {"serialize", "dump and load throughput of the binary format", Serialize},
+    {"splice", "splitting at a cursor and splicing back against moving the items one by one", Splice},
+    {"scaling", "1 to 64 threads on one queue against a sharded queue, with and without stealing", Scaling},
+#if defined(__unix__) || defined(__APPLE__)
+    {"restart", "mapped queue reopen time with a journal tail, and consistency after a kill", Restart},
+#endif
+#if defined(__cpp_impl_coroutine)
+    {"coroutines", "100000 coroutine consumers on a pool of --threads", Coroutines},
+#endif
+};
+
+static std::string Escaped(const std::string& text) {
+    std::string escaped;
+    for (char c : text) {
+        if (c == '"' || c == '\\') escaped += '\\';
+        escaped += c;
+    }
+    return escaped;
+}
+
+static void PrintJson(std::ostream& out) {
+    out << "[\n";
+    for (std::size_t r = 0; r < results.size(); r++) {
+        const RunResult& run(results[r]);
+        out << "  {\"scenario\": \"" << Escaped(run.scenario) << "\", \"variant\": \"" << Escaped(run.variant)
+            << "\", \"threads\": " << run.threads << ", \"size\": " << run.size << ",\n   \"ops\": [";
+        for (std::size_t o = 0; o < run.ops.size(); o++) {
+            const OpResult& op(run.ops[o]);
+            out << (o ? ", " : "") << "{\"name\": \"" << Escaped(op.name) << "\", \"count\": " << op.count
+                << ", \"per_second\": " << op.perSecond << ", \"p50_ns\": " << op.p50 << ", \"p99_ns\": " << op.p99
+                << ", \"p999_ns\": " << op.p999 << "}";
+        }
+        out << "],\n   \"metrics\": {";
+        for (std::size_t m = 0; m < run.metrics.size(); m++) {
+            out << (m ? ", " : "") << "\"" << Escaped(run.metrics[m].first) << "\": " << run.metrics[m].second;
+        }
+        out << "}}" << (r + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "]\n";
+}
+
+static void PrintTable(std::ostream& out) {
+    for (const RunResult& run : results) {
+        out << run.scenario << "/" << run.variant << "  threads " << run.threads << "  size " << run.size << "\n";
+        for (const OpResult& op : run.ops) {
+            out << "    " << std::left << std::setw(18) << op.name << std::right << std::setw(12) << op.count
+                << std::setw(14) << std::fixed << std::setprecision(0) << op.perSecond << "/s" << "  p50 "
+                << std::setw(9) << op.p50 << "  p99 " << std::setw(9) << op.p99 << "  p999 " << std::setw(10)
+                << op.p999 << " ns\n";
+        }
+        for (const std::pair<std::string, double>& metric : run.metrics) {
+            out << "    " << std::left << std::setw(36) << metric.first << std::right << std::defaultfloat
+                << std::setprecision(6) << metric.second << "\n";
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    Params params;
+    params.threads = std::max(2u, std::thread::hardware_concurrency());
+    std::vector<std::string> chosen;
+    bool json(false);
+    std::string trace;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg(argv[i]);
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) throw std::invalid_argument(arg + " needs a value");
+            return argv[++i];
+        };
+        if (arg == "--json") json = true;
+        else if (arg == "--threads") params.threads = std::stoul(value());
+        else if (arg == "--producers") params.producers = std::stoul(value());
+        else if (arg == "--consumers") params.consumers = std::stoul(value());
+        else if (arg == "--size") params.size = std::stoul(value());
+        else if (arg == "--seconds") params.seconds = std::stod(value());
+        else if (arg == "--seed") params.seed = std::stoull(value());
+        else if (arg == "--dir") params.dir = value();
+        else if (arg == "--trace") trace = value();
+        else if (arg == "--scenario") {
+            std::stringstream names(value());
+            for (std::string name; std::getline(names, name, ',');) chosen.push_back(name);
+        } else if (arg == "--list") {
+            for (const Scenario& scenario : scenarios) std::cout << scenario.name << "  " << scenario.description << "\n";
+            return 0;
+        } else {
+            std::cerr << "unknown argument " << arg << "\n";
+            return 2;
+        }
+    }
+    if (params.threads == 0 || params.size == 0) {
+        std::cerr << "--threads and --size must be positive\n";
+        return 2;
+    }
+
+    for (const std::string& name : chosen) {
+        if (std::none_of(std::begin(scenarios), std::end(scenarios),
+                         [&name](const Scenario& scenario) { return name == scenario.name; })) {
+            std::cerr << "unknown scenario " << name << "\n";
+            return 2;
+        }
+    }
+#if defined(RQ_PROFILE_LOCKS)
+    if (!trace.empty()) LockProfile::StartTrace();
+#else
+    if (!trace.empty()) {
+        std::cerr << "--trace needs a build with -DRQ_PROFILE_LOCKS\n";
+        return 2;
+    }
+#endif
+    for (const Scenario& scenario : scenarios) {
+        if (!chosen.empty() && std::find(chosen.begin(), chosen.end(), scenario.name) == chosen.end()) continue;
+        if (!json) std::cerr << "running " << scenario.name << "\n";
+        scenario.run(params);
+    }
+    json ? PrintJson(std::cout) : PrintTable(std::cout);
+#if defined(RQ_PROFILE_LOCKS)
+    LockProfile::StopTrace();
+    LockProfile::Print(std::cerr);
+    if (!trace.empty()) {
+        std::ofstream out(trace);
+        LockProfile::WriteTrace(out);
+    }
+#endif
+}
@@ -0,0 +1,6031 @@
+#ifndef REVERSIBLE_QUEUE_H
+#define REVERSIBLE_QUEUE_H
+
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <list>
+#include <deque>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <optional>
+#include <condition_variable>
+#include <functional>
+#include <iterator>
+#include <cstddef>
+#include <array>
+#include <cstring>
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#endif
+#if defined(__GNUC__) && defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <cerrno>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(RQ_PROFILE_LOCKS)
+#include <iomanip>
+#include <map>
+#endif
+
+
+// LOCK PROFILING
+// built with -DRQ_PROFILE_LOCKS, every end, node and block lock the queues take is timed: how long the thread waited
+// for it and how long it was held, filed under the queue operation that took it (RQ_LOCK_SITE at the top of each
+// public operation) and the role of the lock. Failed try_locks are counted as well, they are where the hand over
+// hand walks spin. Each thread records into its own log-linear histograms, LockProfile::Report() merges them.
+// Between StartTrace() and StopTrace() every acquisition is also kept for WriteTrace(), which writes Chrome trace
+// JSON for chrome://tracing or ui.perfetto.dev
+// without the macro QueueMutex is plain std::mutex and the macros expand to nothing
+
+#if defined(RQ_PROFILE_LOCKS)
+class LockProfile {
+    struct Entry;
+    struct ThreadLog;
+
+public:
+    // 8 buckets per power of two, so a bucket is within an eighth of any value in it
+    static const std::size_t buckets = 496;
+
+    struct Timing {
+        std::uint64_t p50;
+        std::uint64_t p99;
+        std::uint64_t p999;
+        std::uint64_t max;
+        std::uint64_t total;
+    };
+
+    // everything one operation did with one role of lock, times in nanoseconds
+    struct SiteReport {
+        std::string site;
+        std::string role;
+        std::uint64_t acquisitions;
+        std::uint64_t failedTryLocks;
+        Timing wait;
+        Timing hold;
+    };
+
+    // opens a site for the locks this thread takes until it goes out of scope
+    // an operation called from inside another keeps the outer one's site
+    class Site {
+    public:
+        explicit Site(const char* name) : opened(!CurrentSite()) {
+            if (opened) CurrentSite() = name;
+        }
+
+        Site(const Site&) = delete;
+        Site& operator=(const Site&) = delete;
+
+        ~Site() {
+            if (opened) CurrentSite() = nullptr;
+        }
+
+    private:
+        const bool opened;
+    };
+
+    // a std::mutex timing itself, the queue decides its role
+    class Mutex {
+    public:
+        void Role(const char* name) {
+            role = name;
+        }
+
+        void lock() {
+            Entry& site(Local().Find(CurrentSite(), role));
+            if (m.try_lock()) {
+                Acquired(site, 0, Now());
+                return;
+            }
+            const std::uint64_t start(Now());
+            m.lock();
+            const std::uint64_t now(Now());
+            Acquired(site, now - start, now);
+        }
+
+        bool try_lock() {
+            Entry& site(Local().Find(CurrentSite(), role));
+            if (!m.try_lock()) {
+                site.failedTryLocks.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            Acquired(site, 0, Now());
+            return true;
+        }
+
+        void unlock() {
+            const std::uint64_t held(Now() - acquiredAt);
+            holder->hold.Add(held);
+            if (tracing.load(std::memory_order_relaxed)) holderLog->Trace(Event{holder, acquiredAt - waited, waited, held});
+            m.unlock();
+        }
+
+    private:
+        void Acquired(Entry& site, std::uint64_t wait, std::uint64_t now) {
+            site.wait.Add(wait);
+            holder = &site;
+            holderLog = &Local();
+            acquiredAt = now;
+            waited = wait;
+        }
+
+        std::mutex m;
+        const char* role = "node";
+        // the holder's, only touched while holding m
+        Entry* holder = nullptr;
+        ThreadLog* holderLog = nullptr;
+        std::uint64_t acquiredAt = 0;
+        std::uint64_t waited = 0;
+    };
+
+    static void StartTrace() {
+        tracing.store(true);
+    }
+
+    static void StopTrace() {
+        tracing.store(false);
+    }
+
+    // every site and role seen so far, the threads that recorded them merged
+    static std::vector<SiteReport> Report() {
+        struct Merged {
+            std::uint64_t failedTryLocks = 0;
+            Counts wait = Counts();
+            Counts hold = Counts();
+        };
+        std::map<std::pair<std::string, std::string>, Merged> merged;
+        std::lock_guard<std::mutex> registryLock(Registry().m);
+        for (const std::shared_ptr<ThreadLog>& log : Registry().logs) {
+            std::lock_guard<std::mutex> logLock(log->m);
+            for (const Entry& entry : log->entries) {
+                Merged& into(merged[std::make_pair(std::string(entry.site), std::string(entry.role))]);
+                into.failedTryLocks += entry.failedTryLocks.load(std::memory_order_relaxed);
+                entry.wait.AddTo(into.wait);
+                entry.hold.AddTo(into.hold);
+            }
+        }
+        std::vector<SiteReport> reports;
+        for (const auto& site : merged) {
+            reports.push_back(SiteReport{site.first.first, site.first.second, Histogram::Count(site.second.wait),
+                                         site.second.failedTryLocks, Histogram::Summary(site.second.wait),
+                                         Histogram::Summary(site.second.hold)});
+        }
+        // the sites costing the most waiting first
+        std::sort(reports.begin(), reports.end(),
+                  [](const SiteReport& a, const SiteReport& b) { return a.wait.total > b.wait.total; });
+        return reports;
+    }
+
+    static void Print(std::ostream& out) {
+        out << "site/role  acquisitions  failed try_locks  wait p50/p99/p999/max/total ns  hold p50/p99/p999/max/total ns\n";
+        for (const SiteReport& report : Report()) {
+            out << report.site << "/" << report.role << "  " << report.acquisitions << "  " << report.failedTryLocks;
+            for (const Timing& timing : {report.wait, report.hold}) {
+                out << "  " << timing.p50 << "/" << timing.p99 << "/" << timing.p999 << "/" << timing.max << "/"
+                    << timing.total;
+            }
+            out << "\n";
+        }
+    }
+
+    // writes what was traced as Chrome trace JSON, a wait slice then a hold slice per acquisition
+    // call it once the traced threads are done, events still being recorded may be left out
+    static void WriteTrace(std::ostream& out) {
+        std::lock_guard<std::mutex> registryLock(Registry().m);
+        std::uint64_t origin(~std::uint64_t(0));
+        for (const std::shared_ptr<ThreadLog>& log : Registry().logs) {
+            std::lock_guard<std::mutex> logLock(log->m);
+            for (const Event& event : log->events) origin = std::min(origin, event.start);
+        }
+        auto slice = [&out, origin](bool& first, const char* name, const char* category, std::uint64_t start,
+                                    std::uint64_t duration, std::size_t thread) {
+            out << (first ? "\n" : ",\n") << "{\"name\":\"" << name << "\",\"cat\":\"" << category
+                << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << thread << ",\"ts\":" << (start - origin) / 1000 << "."
+                << std::setw(3) << std::setfill('0') << (start - origin) % 1000 << ",\"dur\":" << duration / 1000
+                << "." << std::setw(3) << (duration % 1000) << std::setfill(' ') << "}";
+            first = false;
+        };
+        out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+        bool first(true);
+        for (std::size_t thread = 0; thread < Registry().logs.size(); thread++) {
+            ThreadLog& log(*Registry().logs[thread]);
+            std::lock_guard<std::mutex> logLock(log.m);
+            for (const Event& event : log.events) {
+                if (event.wait) slice(first, event.entry->site, "wait", event.start, event.wait, thread);
+                slice(first, event.entry->site, event.entry->role, event.start + event.wait, event.hold, thread);
+            }
+        }
+        out << "\n]}\n";
+    }
+
+    // forgets everything recorded so far, best called while no queue is in use
+    static void Reset() {
+        std::lock_guard<std::mutex> registryLock(Registry().m);
+        for (const std::shared_ptr<ThreadLog>& log : Registry().logs) {
+            std::lock_guard<std::mutex> logLock(log->m);
+            for (Entry& entry : log->entries) {
+                entry.failedTryLocks.store(0, std::memory_order_relaxed);
+                entry.wait.Clear();
+                entry.hold.Clear();
+            }
+            log->events.clear();
+        }
+    }
+
+private:
+    using Counts = std::array<std::uint64_t, buckets>;
+
+    class Histogram {
+    public:
+        void Add(std::uint64_t ns) {
+            counts[Bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+            total.fetch_add(ns, std::memory_order_relaxed);
+        }
+
+        void AddTo(Counts& into) const {
+            for (std::size_t i = 0; i < buckets; i++) into[i] += counts[i].load(std::memory_order_relaxed);
+        }
+
+        void Clear() {
+            for (std::atomic<std::uint64_t>& count : counts) count.store(0, std::memory_order_relaxed);
+            total.store(0, std::memory_order_relaxed);
+        }
+
+        static std::uint64_t Count(const Counts& counts) {
+            std::uint64_t count(0);
+            for (std::uint64_t c : counts) count += c;
+            return count;
+        }
+
+        // the totals are kept exactly, the percentiles as the lowest value of their bucket
+        static Timing Summary(const Counts& counts) {
+            const std::uint64_t count(Count(counts));
+            Timing timing{Percentile(counts, count, 0.5), Percentile(counts, count, 0.99),
+                          Percentile(counts, count, 0.999), 0, 0};
+            for (std::size_t i = 0; i < buckets; i++) {
+                if (counts[i]) timing.max = Lowest(i);
+                // the middle of each bucket, good enough to rank the sites
+                timing.total += counts[i] * (Lowest(i) + (i + 1 < buckets ? (Lowest(i + 1) - Lowest(i)) / 2 : 0));
+            }
+            return timing;
+        }
+
+    private:
+        static std::size_t Bucket(std::uint64_t ns) {
+            if (ns < 8) return std::size_t(ns);
+            const int exponent(63 - __builtin_clzll(ns));
+            return std::size_t(exponent - 2) * 8 + std::size_t((ns >> (exponent - 3)) & 7);
+        }
+
+        static std::uint64_t Lowest(std::size_t bucket) {
+            if (bucket < 8) return bucket;
+            return (8 + bucket % 8) << (bucket / 8 - 1);
+        }
+
+        static std::uint64_t Percentile(const Counts& counts, std::uint64_t count, double p) {
+            const std::uint64_t rank(std::uint64_t(p * double(count)));
+            std::uint64_t seen(0);
+            for (std::size_t i = 0; i < buckets; i++) {
+                seen += counts[i];
+                if (seen > rank) return Lowest(i);
+            }
+            return 0;
+        }
+
+        std::array<std::atomic<std::uint64_t>, buckets> counts = {};
+        std::atomic<std::uint64_t> total{0};
+    };
+
+    struct Entry {
+        Entry(const char* _site, const char* _role) : site(_site), role(_role) {}
+
+        const char* site;
+        const char* role;
+        Histogram wait;
+        Histogram hold;
+        std::atomic<std::uint64_t> failedTryLocks{0};
+    };
+
+    struct Event {
+        const Entry* entry;
+        std::uint64_t start;
+        std::uint64_t wait;
+        std::uint64_t hold;
+    };
+
+    // one thread's entries and trace, kept after the thread exits so its figures still count
+    struct ThreadLog {
+        // only the owning thread adds entries, but under m so reports can walk them meanwhile
+        Entry& Find(const char* site, const char* role) {
+            if (!site) site = "unlabelled";
+            for (Entry& entry : entries) {
+                if (entry.site == site && entry.role == role) return entry;
+            }
+            std::lock_guard<std::mutex> logLock(m);
+            entries.emplace_back(site, role);
+            return entries.back();
+        }
+
+        void Trace(const Event& event) {
+            std::lock_guard<std::mutex> logLock(m);
+            if (events.size() < maxEvents) events.push_back(event);
+        }
+
+        // a million acquisitions per thread, about 32MiB
+        static const std::size_t maxEvents = std::size_t(1) << 20;
+
+        std::mutex m;
+        std::deque<Entry> entries;
+        std::vector<Event> events;
+    };
+
+    struct Logs {
+        std::mutex m;
+        std::vector<std::shared_ptr<ThreadLog>> logs;
+    };
+
+    static Logs& Registry() {
+        static Logs registry;
+        return registry;
+    }
+
+    static ThreadLog& Local() {
+        thread_local const std::shared_ptr<ThreadLog> log([] {
+            std::shared_ptr<ThreadLog> fresh(std::make_shared<ThreadLog>());
+            std::lock_guard<std::mutex> registryLock(Registry().m);
+            Registry().logs.push_back(fresh);
+            return fresh;
+        }());
+        return *log;
+    }
+
+    // locks taken outside any labelled operation, destructors and the like, are filed under "unlabelled"
+    static const char*& CurrentSite() {
+        thread_local const char* site(nullptr);
+        return site;
+    }
+
+    static std::uint64_t Now() {
+        return std::uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    static inline std::atomic<bool> tracing{false};
+};
+
+using QueueMutex = LockProfile::Mutex;
+#define RQ_LOCK_SITE() const LockProfile::Site lockSite(__func__)
+#define RQ_LOCK_ROLE(mutex, name) (mutex).Role(name)
+#else
+using QueueMutex = std::mutex;
+#define RQ_LOCK_SITE() static_cast<void>(0)
+#define RQ_LOCK_ROLE(mutex, name) static_cast<void>(0)
+#endif
+
+
+// Hook carries whatever the queue's position index and versioning keep per node
+template<class T, class Hook>
+class Node : public Hook {
+public:
+    // constructs the data in place from args
+    template<class... Args>
+    explicit Node(std::in_place_t, Args&&... args)
+        : refs(1), data(std::forward<Args>(args)...), right(nullptr), left(nullptr) {}
+
+    Node(const Node&) = delete;
+    Node& operator=(const Node&) = delete;
+
+    QueueMutex m;
+
+    // one reference for being linked into a queue plus one per cursor observing the node
+    // nodes are only ever returned to their pool once both are gone
+    std::atomic<unsigned> refs;
+
+    // the queue owns the traverse order, so every accessor is resolved against the caller's direction
+    // true: right = infront; false: left = infront
+    // links are only written under the node lock but may be read without it by optimistic readers
+    void SetInfront(Node* f, bool direction) {
+        (direction ? right : left).store(f, std::memory_order_release);
+    }
+    void SetBehind(Node* b, bool direction) {
+        (direction ? left : right).store(b, std::memory_order_release);
+    }
+
+    Node* GetInfront(bool direction) const {
+        return (direction ? right : left).load(std::memory_order_acquire);
+    }
+    Node* GetBehind(bool direction) const {
+        return (direction ? left : right).load(std::memory_order_acquire);
+    }
+
+    // only ever moved from once the node has been unlinked from its queue
+    T data;
+
+    // mirrors the node so what was on its right is on its left
+    void SwapSides() {
+        Node* const oldRight(right.load(std::memory_order_relaxed));
+        right.store(left.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        left.store(oldRight, std::memory_order_relaxed);
+    }
+
+private:
+    // pointers to neighbour on either physical side
+    std::atomic<Node*> right;
+    std::atomic<Node*> left;
+};
+
+// NODE POOLS
+// policies deciding where a queue's nodes come from, each provides
+//     template<class N, class... Args> static N* Create(Args&&...)
+//     template<class N> static void Destroy(N*)
+
+// every node straight from the system allocator
+struct HeapNodes {
+    template<class N, class... Args>
+    static N* Create(Args&&... args) {
+        return new N(std::forward<Args>(args)...);
+    }
+
+    template<class N>
+    static void Destroy(N* node) {
+        delete node;
+    }
+};
+
+// nodes are carved out of slabs and recycled through per-thread free lists, so steady-state pushes and pops never
+// reach the system allocator. Threads that free more than they create (consumers) hand surplus batches to a shared
+// depot which threads that create more than they free (producers) draw from before carving a new slab.
+// slabs are kept for the life of the program
+class PooledNodes {
+public:
+    template<class N, class... Args>
+    static N* Create(Args&&... args) {
+        FreeList<N>& local(LocalFreeList<N>());
+        if (!local.head) local.Refill();
+        FreeNode* slot(local.Pop());
+        try {
+            return new (slot) N(std::forward<Args>(args)...);
+        }
+        catch (...) {
+            local.Push(slot);
+            throw;
+        }
+    }
+
+    template<class N>
+    static void Destroy(N* node) {
+        node->~N();
+        FreeList<N>& local(LocalFreeList<N>());
+        local.Push(new (node) FreeNode());
+        if (local.count >= 2 * batchSize) local.Spill();
+    }
+
+private:
+    static const std::size_t batchSize = 64;
+
+    struct FreeNode {
+        FreeNode* next = nullptr;
+    };
+
+    // a chain of free nodes
+    struct Batch {
+        FreeNode* head;
+        std::size_t count;
+    };
+
+    template<class N>
+    struct Depot {
+        std::mutex m;
+        std::vector<Batch> batches;
+    };
+
+    template<class N>
+    static Depot<N>& SharedDepot() {
+        static Depot<N> depot;
+        return depot;
+    }
+
+    template<class N>
+    struct FreeList {
+        FreeNode* head = nullptr;
+        std::size_t count = 0;
+
+        FreeList() = default;
+        FreeList(const FreeList&) = delete;
+        FreeList& operator=(const FreeList&) = delete;
+
+        // a finishing thread gives everything it holds back to the depot
+        ~FreeList() {
+            if (head) Deposit(Batch{head, count});
+        }
+
+        FreeNode* Pop() {
+            FreeNode* node(head);
+            head = node->next;
+            count--;
+            return node;
+        }
+
+        void Push(FreeNode* node) {
+            node->next = head;
+            head = node;
+            count++;
+        }
+
+        // takes a batch from the depot or failing that carves a fresh slab
+        void Refill() {
+            {
+                Depot<N>& depot(SharedDepot<N>());
+                std::lock_guard<std::mutex> depotLock(depot.m);
+                if (!depot.batches.empty()) {
+                    head = depot.batches.back().head;
+                    count = depot.batches.back().count;
+                    depot.batches.pop_back();
+                    return;
+                }
+            }
+            // slots must fit a node or a free list link and keep nodes aligned
+            const std::size_t stride(((std::max(sizeof(N), sizeof(FreeNode)) + alignof(N) - 1) / alignof(N)) * alignof(N));
+            char* slab(static_cast<char*>(::operator new(stride * batchSize)));
+            for (std::size_t i = 0; i < batchSize; i++) {
+                Push(new (slab + i * stride) FreeNode());
+            }
+        }
+
+        // moves one batch worth of nodes to the depot
+        void Spill() {
+            Batch batch{head, batchSize};
+            FreeNode* last(head);
+            for (std::size_t i = 1; i < batchSize; i++) last = last->next;
+            head = last->next;
+            last->next = nullptr;
+            count -= batchSize;
+            Deposit(batch);
+        }
+
+        static void Deposit(Batch batch) {
+            Depot<N>& depot(SharedDepot<N>());
+            std::lock_guard<std::mutex> depotLock(depot.m);
+            depot.batches.push_back(batch);
+        }
+    };
+
+    template<class N>
+    static FreeList<N>& LocalFreeList() {
+        thread_local FreeList<N> freeList;
+        return freeList;
+    }
+};
+
+// hands out one observer slot per thread from a fixed table
+// claiming a slot is a single CAS and later lookups hit a thread-local cache, so neither takes a lock. A thread
+// that finishes without Release hands its slots back as it exits, releasing whatever its observers still held, so
+// the table only runs out with more than Slots threads observing at once and a new thread given a finished
+// thread's id starts afresh
+template<class Observer, std::size_t Slots = 128>
+class ObserverTable {
+public:
+    ObserverTable() : id(NextId()), table(new Table) {}
+
+    ObserverTable(const ObserverTable&) = delete;
+    ObserverTable& operator=(const ObserverTable&) = delete;
+
+    // returns the calling thread's observer, claiming a free slot on first use
+    Observer& Local() {
+        Slot* slot(Find());
+        if (!slot) slot = Claim();
+        return slot->observer;
+    }
+
+    // hands the calling thread's slot back to the table
+    void Release() {
+        Slot* slot(Find());
+        if (!slot) return;
+        CacheEntry& cached(Cache()[id % cacheEntries]);
+        if (cached.table == id) cached = CacheEntry();
+        Held().Forget(slot);
+        Free(*slot);
+    }
+
+private:
+    // padded so that threads only ever write to their own cache line
+    struct alignas(64) Slot {
+        std::atomic<std::thread::id> owner;
+        Observer observer;
+    };
+
+    struct Table {
+        Slot slots[Slots];
+    };
+
+    // last slot this thread used per table, direct-mapped by table id
+    struct CacheEntry {
+        std::uint64_t table = 0;
+        std::size_t slot = 0;
+    };
+    static const std::size_t cacheEntries = 8;
+
+    // the slots a thread holds across every table, freed when the thread exits
+    // tables are only referenced weakly, a slot of a table destroyed first is left alone
+    class Holdings {
+    public:
+        Holdings() = default;
+        Holdings(const Holdings&) = delete;
+        Holdings& operator=(const Holdings&) = delete;
+
+        ~Holdings() {
+            for (Holding& holding : held) {
+                if (const std::shared_ptr<Table> table = holding.table.lock()) Free(*holding.slot);
+            }
+        }
+
+        void Add(const std::shared_ptr<Table>& table, Slot* slot) {
+            // tables gone since are dropped on the way
+            held.erase(std::remove_if(held.begin(), held.end(), [](const Holding& holding) {
+                return holding.table.expired();
+            }), held.end());
+            held.push_back(Holding{table, slot});
+        }
+
+        void Forget(const Slot* slot) {
+            held.erase(std::remove_if(held.begin(), held.end(), [slot](const Holding& holding) {
+                return holding.slot == slot;
+            }), held.end());
+        }
+
+    private:
+        struct Holding {
+            std::weak_ptr<Table> table;
+            Slot* slot;
+        };
+
+        std::vector<Holding> held;
+    };
+
+    static CacheEntry* Cache() {
+        thread_local CacheEntry cache[cacheEntries];
+        return cache;
+    }
+
+    static Holdings& Held() {
+        thread_local Holdings holdings;
+        return holdings;
+    }
+
+    static std::uint64_t NextId() {
+        static std::atomic<std::uint64_t> nextId(1);
+        return nextId.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // empties the observer, letting go of anything it holds, and gives the slot up; called by its owner
+    static void Free(Slot& slot) {
+        slot.observer = Observer();
+        slot.owner.store(std::thread::id(), std::memory_order_release);
+    }
+
+    Slot* Find() {
+        CacheEntry& cached(Cache()[id % cacheEntries]);
+        if (cached.table == id) return &table->slots[cached.slot];
+
+        // we may still own a slot if another table evicted us from the cache
+        const std::thread::id self(std::this_thread::get_id());
+        for (std::size_t i = 0; i < Slots; i++) {
+            if (table->slots[i].owner.load(std::memory_order_relaxed) == self) {
+                cached.table = id;
+                cached.slot = i;
+                return &table->slots[i];
+            }
+        }
+        return nullptr;
+    }
+
+    Slot* Claim() {
+        const std::thread::id self(std::this_thread::get_id());
+        for (std::size_t i = 0; i < Slots; i++) {
+            std::thread::id unowned;
+            Slot& slot(table->slots[i]);
+            if (slot.owner.compare_exchange_strong(unowned, self, std::memory_order_acquire)) {
+                try {
+                    Held().Add(table, &slot);
+                } catch (...) {
+                    slot.owner.store(std::thread::id(), std::memory_order_release);
+                    throw;
+                }
+                CacheEntry& cached(Cache()[id % cacheEntries]);
+                cached.table = id;
+                cached.slot = i;
+                return &slot;
+            }
+        }
+        throw std::length_error("too many threads observing queue");
+    }
+
+    // unique for the life of the program so stale cache entries can never match a new table
+    const std::uint64_t id;
+    // shared with the exit hand-back of threads holding slots, so a table destroyed under it is not written to
+    const std::shared_ptr<Table> table;
+};
+
+// what Stats() reports, every count runs from when the queue was constructed
+struct QueueStats {
+    std::uint64_t pushes = 0;
+    std::uint64_t pops = 0;
+    std::uint64_t inserts = 0;
+    std::uint64_t erases = 0;
+    std::uint64_t reversals = 0;
+    // try_locks that failed, making the operation back off or take a slower route
+    std::uint64_t tryLockFailures = 0;
+    // extra trips round retry loops, after backing off or because the queue changed under the operation
+    std::uint64_t retries = 0;
+    std::size_t peakLength = 0;
+};
+
+// keeps the length of a queue along with its statistics
+// the length is a single counter so that it is exact, the statistics are relaxed counters spread over stripes
+// picked per thread, so threads bumping them rarely share a cache line
+// threads are dealt stripe numbers in turn as they first ask for one, for spreading shared counters over cache lines
+inline std::size_t ThreadStripe() {
+    static std::atomic<std::size_t> nextStripe(0);
+    thread_local const std::size_t stripe(nextStripe.fetch_add(1, std::memory_order_relaxed));
+    return stripe;
+}
+
+class QueueCounters {
+public:
+    enum Event { pushes, pops, inserts, erases, reversals, tryLockFailures, retries, eventCount };
+
+    QueueCounters() : length(0), peak(0) {}
+
+    QueueCounters(const QueueCounters&) = delete;
+    QueueCounters& operator=(const QueueCounters&) = delete;
+
+    void Count(Event event, std::uint64_t n = 1) {
+        stripes[StripeIndex()].counts[event].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    // called before new items become reachable, so the length never drops below the number actually linked
+    void Grow(std::size_t n) {
+        const std::size_t now(length.fetch_add(n, std::memory_order_relaxed) + n);
+        std::size_t highest(peak.load(std::memory_order_relaxed));
+        while (now > highest && !peak.compare_exchange_weak(highest, now, std::memory_order_relaxed)) {}
+    }
+
+    // called once items have been unlinked
+    void Shrink(std::size_t n) {
+        length.fetch_sub(n, std::memory_order_relaxed);
+    }
+
+    std::size_t Length() const {
+        return length.load(std::memory_order_relaxed);
+    }
+
+    QueueStats Snapshot() const {
+        std::uint64_t totals[eventCount] = {};
+        for (const Stripe& stripe : stripes) {
+            for (int event = 0; event < eventCount; event++) {
+                totals[event] += stripe.counts[event].load(std::memory_order_relaxed);
+            }
+        }
+        QueueStats stats;
+        stats.pushes = totals[pushes];
+        stats.pops = totals[pops];
+        stats.inserts = totals[inserts];
+        stats.erases = totals[erases];
+        stats.reversals = totals[reversals];
+        stats.tryLockFailures = totals[tryLockFailures];
+        stats.retries = totals[retries];
+        stats.peakLength = peak.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+private:
+    static const std::size_t stripeCount = 16;
+
+    struct alignas(64) Stripe {
+        std::atomic<std::uint64_t> counts[eventCount] = {};
+    };
+
+    static std::size_t StripeIndex() {
+        return ThreadStripe() % stripeCount;
+    }
+
+    // on a line of its own, every push and pop touches it
+    alignas(64) std::atomic<std::size_t> length;
+    std::atomic<std::size_t> peak;
+    Stripe stripes[stripeCount];
+};
+
+// parks consumers of an empty queue until a producer pushes or the queue is closed
+// producers only touch the wait lock when someone is actually waiting
+// besides blocking threads it keeps a list of asynchronous waiters, which are called back instead
+class PopWaiters {
+public:
+    // an asynchronous waiter, woken by calling wake with no lock held
+    struct Parked {
+        void (*wake)(Parked*);
+        Parked* next = nullptr;
+    };
+
+    PopWaiters() : waiting(0), ticket(0), closed(false) {}
+
+    PopWaiters(const PopWaiters&) = delete;
+    PopWaiters& operator=(const PopWaiters&) = delete;
+
+    // wakes waiters after items have been pushed, one or every one of them
+    void Notify(bool many) {
+        if (waiting.load() == 0) return;
+        Parked* woken;
+        {
+            std::lock_guard<std::mutex> waitLock(m);
+            ticket.fetch_add(1);
+            many ? cv.notify_all() : cv.notify_one();
+            woken = Unpark(many);
+        }
+        Wake(woken);
+    }
+
+    // wakes every waiter, from now on they give up as soon as the queue is empty
+    void Close() {
+        closed.store(true);
+        Parked* woken;
+        {
+            std::lock_guard<std::mutex> waitLock(m);
+            ticket.fetch_add(1);
+            cv.notify_all();
+            woken = Unpark(true);
+        }
+        Wake(woken);
+    }
+
+    bool Closed() const {
+        return closed.load();
+    }
+
+    // calls tryPop until it yields an item, the queue is closed or deadline (if any) passes
+    // tryPop runs without the wait lock, a pop that makes room may wake a waiting producer on this very thread
+    template<class TryPop>
+    auto Wait(TryPop tryPop, const std::chrono::steady_clock::time_point* deadline) -> decltype(tryPop()) {
+        // fast path, no waiting needed
+        auto item(tryPop());
+        if (item || closed.load()) return item;
+
+        // counted before looking again, so a producer pushing after our last look is sure to see us
+        waiting.fetch_add(1);
+        while(true) {
+            // a Notify after this ticket was read may be for an item our look missed
+            const std::uint64_t seen(ticket.load());
+            item = tryPop();
+            if (item || closed.load()) break;
+            std::unique_lock<std::mutex> waitLock(m);
+            auto notified = [this, seen] { return ticket.load() != seen; };
+            if (!deadline) {
+                cv.wait(waitLock, notified);
+            } else if (!cv.wait_until(waitLock, *deadline, notified)) {
+                waitLock.unlock();
+                // one last look, we may have been handed a wakeup meant for an item
+                item = tryPop();
+                break;
+            }
+        }
+        waiting.fetch_sub(1);
+        return item;
+    }
+
+    // an asynchronous waiter counts itself in with Enter before looking for an item with no lock held
+    // then either Leaves having found one, or Parks with the ticket Enter returned
+    std::uint64_t Enter() {
+        waiting.fetch_add(1);
+        return ticket.load();
+    }
+
+    void Leave() {
+        waiting.fetch_sub(1);
+    }
+
+    // queues waiter to be woken by a later Notify or Close, unless one came in since Enter handed out seen
+    // returns false without parking in that case, having left, and the waiter should look again
+    bool Park(Parked& waiter, std::uint64_t seen) {
+        {
+            std::lock_guard<std::mutex> waitLock(m);
+            if (ticket.load() == seen && !closed.load()) {
+                waiter.next = nullptr;
+                (last ? last->next : first) = &waiter;
+                last = &waiter;
+                return true;
+            }
+        }
+        waiting.fetch_sub(1);
+        return false;
+    }
+
+private:
+    // takes the first or every parked waiter off the list, the wait lock is held
+    Parked* Unpark(bool all) {
+        Parked* const woken(first);
+        if (!woken) return nullptr;
+        Parked* end(all ? last : woken);
+        std::size_t count(1);
+        for (Parked* waiter = woken; waiter != end; waiter = waiter->next) count++;
+        first = end->next;
+        if (!first) last = nullptr;
+        end->next = nullptr;
+        waiting.fetch_sub(int(count));
+        return woken;
+    }
+
+    static void Wake(Parked* waiter) {
+        while (waiter) {
+            // wake may resume the waiter and end its life
+            Parked* const next(waiter->next);
+            waiter->wake(waiter);
+            waiter = next;
+        }
+    }
+
+    std::mutex m;
+    std::condition_variable cv;
+    std::atomic<int> waiting;
+    // bumped by every Notify and Close, under the wait lock
+    std::atomic<std::uint64_t> ticket;
+    std::atomic<bool> closed;
+    Parked* first = nullptr;
+    Parked* last = nullptr;
+};
+
+// CONTENTION POLICIES
+// policies deciding how an operation backs off after failing to try_lock a lock to its right, each provides
+//     static const bool handoff                     wait on the contended lock itself once nothing to its left is held
+//     void Wait()                                   otherwise called between letting go and trying again
+// every operation starts with a fresh policy object, so it may escalate over repeated failures
+
+// tells the core the thread is spinning, letting a sibling hyperthread (often the lock holder) run
+inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    asm volatile("yield");
+#endif
+}
+
+// let go and immediately try again
+struct ImmediateRetry {
+    static const bool handoff = false;
+
+    void Wait() {}
+};
+
+// spin for twice as long after each failure, then start giving the rest of the time slice away
+class ExponentialBackoff {
+public:
+    static const bool handoff = false;
+
+    void Wait() {
+        for (unsigned i = 0; i < spins; i++) CpuRelax();
+        if (spins < maxSpins) spins *= 2;
+        else std::this_thread::yield();
+    }
+
+private:
+    static const unsigned maxSpins = 1024;
+    unsigned spins = 1;
+};
+
+// give the rest of the time slice away after every failure
+struct YieldBackoff {
+    static const bool handoff = false;
+
+    void Wait() {
+        std::this_thread::yield();
+    }
+};
+
+// queue up on the contended lock, so we go again only once its holder has finished with it
+// the mutex hands the lock over in whatever order it likes, but nobody spins
+struct HandoffBackoff {
+    static const bool handoff = true;
+
+    void Wait() {}
+};
+
+// EXECUTORS
+// what bulk operations run their tasks on, each provides
+//     std::size_t Concurrency() const               how many tasks it can usefully run at once
+//     template<class F> void Run(std::size_t tasks, F f)
+//                                                   calls f(i) for every i below tasks and returns once all have,
+//                                                   rethrowing the first exception any of them threw
+//     template<class F> void Post(F f)              calls f() once, later on one of its threads or right away on
+//                                                   this one, f must not throw
+
+// everything on the calling thread
+struct InlineExecutor {
+    std::size_t Concurrency() const {
+        return 1;
+    }
+
+    template<class F>
+    void Run(std::size_t tasks, F f) {
+        for (std::size_t i = 0; i < tasks; i++) f(i);
+    }
+
+    template<class F>
+    void Post(F f) {
+        f();
+    }
+};
+
+// a fixed set of worker threads, the thread calling Run joins in so a pool without workers runs everything inline
+// one Run at a time, calls from several threads take turns. Posted tasks are run by the workers between Runs, and
+// any left over when the pool is destroyed are run before the workers stop. A Run from inside the pool, by a
+// worker or by a task of another Run, runs all its tasks inline: the pool cannot wait on itself
+class ThreadPool {
+public:
+    explicit ThreadPool(std::size_t threads = std::thread::hardware_concurrency()) {
+        for (std::size_t i = 1; i < threads; i++) workers.emplace_back([this] { Work(); });
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stopping = true;
+        }
+        start.notify_all();
+        for (std::thread& worker : workers) worker.join();
+    }
+
+    std::size_t Concurrency() const {
+        return workers.size() + 1;
+    }
+
+    template<class F>
+    void Run(std::size_t tasks, F f) {
+        Job job;
+        job.tasks = tasks;
+        job.fn = [&f](std::size_t i) { f(i); };
+        if (Inside() == this) {
+            Take(job);
+            if (job.error) std::rethrow_exception(job.error);
+            return;
+        }
+        std::lock_guard<std::mutex> runLock(runMutex);
+        const Enter entered(this);
+        {
+            std::lock_guard<std::mutex> lock(m);
+            current = &job;
+            generation++;
+            busy = workers.size();
+        }
+        start.notify_all();
+        Take(job);
+        // the job lives on our stack, so every worker has to be done with it
+        std::unique_lock<std::mutex> lock(m);
+        finished.wait(lock, [this] { return busy == 0; });
+        current = nullptr;
+        if (job.error) std::rethrow_exception(job.error);
+    }
+
+    template<class F>
+    void Post(F f) {
+        if (workers.empty()) {
+            f();
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m);
+            posted.emplace_back(std::move(f));
+        }
+        start.notify_one();
+    }
+
+private:
+    struct Job {
+        std::function<void(std::size_t)> fn;
+        std::size_t tasks = 0;
+        std::atomic<std::size_t> next{0};
+        std::mutex errorMutex;
+        std::exception_ptr error;
+    };
+
+    // the pool the calling thread is working for, if any
+    static const ThreadPool*& Inside() {
+        thread_local const ThreadPool* pool(nullptr);
+        return pool;
+    }
+
+    // marks the calling thread as working for a pool while in scope
+    class Enter {
+    public:
+        explicit Enter(const ThreadPool* pool) : outer(Inside()) { Inside() = pool; }
+        ~Enter() { Inside() = outer; }
+
+        Enter(const Enter&) = delete;
+        Enter& operator=(const Enter&) = delete;
+
+    private:
+        const ThreadPool* const outer;
+    };
+
+    // runs tasks of job until there are none left
+    static void Take(Job& job) {
+        while (true) {
+            const std::size_t i(job.next.fetch_add(1, std::memory_order_relaxed));
+            if (i >= job.tasks) return;
+            try {
+                job.fn(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(job.errorMutex);
+                if (!job.error) job.error = std::current_exception();
+            }
+        }
+    }
+
+    void Work() {
+        const Enter entered(this);
+        std::uint64_t seen(0);
+        while (true) {
+            Job* job(nullptr);
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(m);
+                start.wait(lock, [this, seen] { return stopping || generation != seen || !posted.empty(); });
+                if (generation != seen) {
+                    seen = generation;
+                    job = current;
+                } else if (!posted.empty()) {
+                    task = std::move(posted.front());
+                    posted.pop_front();
+                } else {
+                    return;
+                }
+            }
+            if (!job) {
+                task();
+                continue;
+            }
+            Take(*job);
+            std::lock_guard<std::mutex> lock(m);
+            if (--busy == 0) finished.notify_one();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex runMutex;
+    std::mutex m;
+    std::condition_variable start;
+    std::condition_variable finished;
+    Job* current = nullptr;
+    std::deque<std::function<void()>> posted;
+    std::uint64_t generation = 0;
+    std::size_t busy = 0;
+    bool stopping = false;
+};
+
+#if defined(__cpp_impl_coroutine)
+// a coroutine handing out references with co_yield one at a time, iterated with a range for
+// each reference lasts until the generator is resumed for the next
+template<class T>
+class Generator {
+public:
+    struct promise_type {
+        const T* current = nullptr;
+        std::exception_ptr error;
+
+        Generator get_return_object() {
+            return Generator(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        std::suspend_always yield_value(const T& item) noexcept {
+            current = &item;
+            return {};
+        }
+        void return_void() {}
+        void unhandled_exception() { error = std::current_exception(); }
+    };
+
+    class Iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = const T&;
+
+        Iterator() = default;
+        explicit Iterator(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+        reference operator*() const { return *handle.promise().current; }
+        pointer operator->() const { return handle.promise().current; }
+
+        Iterator& operator++() {
+            Generator::Resume(handle);
+            return *this;
+        }
+
+        void operator++(int) { ++*this; }
+
+        bool operator==(const Iterator& other) const { return Done() == other.Done(); }
+        bool operator!=(const Iterator& other) const { return !(*this == other); }
+
+    private:
+        bool Done() const { return !handle || handle.done(); }
+
+        std::coroutine_handle<promise_type> handle;
+    };
+
+    Generator(Generator&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+
+    Generator& operator=(Generator&& other) noexcept {
+        if (this != &other) {
+            if (handle) handle.destroy();
+            handle = std::exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+
+    ~Generator() {
+        if (handle) handle.destroy();
+    }
+
+    // runs up to the first item, so only call once
+    Iterator begin() {
+        Resume(handle);
+        return Iterator(handle);
+    }
+
+    Iterator end() const { return Iterator(); }
+
+private:
+    explicit Generator(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+    static void Resume(std::coroutine_handle<promise_type> handle) {
+        handle.resume();
+        if (handle.promise().error) std::rethrow_exception(std::exchange(handle.promise().error, nullptr));
+    }
+
+    std::coroutine_handle<promise_type> handle;
+};
+#endif
+
+// POSITION INDEXES
+// policies letting a queue find the item at a given position, each provides
+//     struct Hook                                   carried by every node
+//     static const bool ordered                     whether At can answer at all
+//     void Insert(Hook* node, Hook* anchor, int side) node goes next to anchor on the physical side (0 left, 1 right)
+//     void InsertAtEnd(Hook* node, int side)        node goes at the physical end
+//     void Erase(Hook* node)
+//     void Join(Index& other, int side)             every node of other goes at the physical end, leaving it empty
+//     std::size_t Cut(Hook* anchor, int side, Index& into)
+//                                                   the nodes on the physical side of anchor move to the empty into,
+//                                                   returns how many when ordered
+//     void Mirror()                                 the nodes were turned round physically
+//     template<class Pin> Hook* At(std::size_t k, int fromSide, Pin pin)
+//                                                   the k-th node from the physical side, handed to pin while still
+//                                                   indexed, nullptr if there are not that many
+// the queue calls them while it holds the locks making the matching change, so the index follows the links exactly
+
+// no index, seeking walks the queue
+struct NoIndex {
+    struct Hook {};
+
+    static const bool ordered = false;
+
+    void Insert(Hook*, Hook*, int) {}
+    void InsertAtEnd(Hook*, int) {}
+    void Erase(Hook*) {}
+    void Join(NoIndex&, int) {}
+    void Mirror() {}
+
+    std::size_t Cut(Hook*, int, NoIndex&) {
+        return 0;
+    }
+
+    template<class Pin>
+    Hook* At(std::size_t, int, Pin) {
+        return nullptr;
+    }
+};
+
+// an order statistic treap over the nodes in physical order, keyed by position alone
+// every change to the queue also takes the index lock for an O(log n) update, which is what seeking costs
+class OrderIndex {
+public:
+    struct Hook {
+        Hook* up = nullptr;
+        Hook* child[2] = {nullptr, nullptr};
+        std::size_t size = 1;
+        std::uint32_t priority = 0;
+    };
+
+    static const bool ordered = true;
+
+    OrderIndex() : root(nullptr), seed(0x9e3779b9u) {}
+
+    OrderIndex(const OrderIndex&) = delete;
+    OrderIndex& operator=(const OrderIndex&) = delete;
+
+    void Insert(Hook* node, Hook* anchor, int side) {
+        std::lock_guard<std::mutex> indexLock(m);
+        Prepare(node);
+        const std::size_t position(Rank(anchor) + (side ? 1 : 0));
+        Hook* before;
+        Hook* after;
+        Split(root, position, before, after);
+        SetRoot(Merge(Merge(before, node), after));
+    }
+
+    void InsertAtEnd(Hook* node, int side) {
+        std::lock_guard<std::mutex> indexLock(m);
+        Prepare(node);
+        SetRoot(side ? Merge(root, node) : Merge(node, root));
+    }
+
+    void Erase(Hook* node) {
+        std::lock_guard<std::mutex> indexLock(m);
+        // the node's subtrees take its place
+        Hook* const replacement(Merge(node->child[0], node->child[1]));
+        Hook* const parent(node->up);
+        if (replacement) replacement->up = parent;
+        if (!parent) {
+            root = replacement;
+            return;
+        }
+        parent->child[parent->child[0] == node ? 0 : 1] = replacement;
+        for (Hook* above = parent; above; above = above->up) Resize(above);
+    }
+
+    // both whole trees, so a single merge
+    void Join(OrderIndex& other, int side) {
+        std::scoped_lock<std::mutex, std::mutex> indexLocks(m, other.m);
+        SetRoot(side ? Merge(root, other.root) : Merge(other.root, root));
+        other.root = nullptr;
+    }
+
+    // a single split at anchor's rank
+    std::size_t Cut(Hook* anchor, int side, OrderIndex& into) {
+        std::scoped_lock<std::mutex, std::mutex> indexLocks(m, into.m);
+        Hook* before;
+        Hook* after;
+        Split(root, Rank(anchor) + (side ? 1 : 0), before, after);
+        SetRoot(side ? before : after);
+        into.SetRoot(side ? after : before);
+        return Size(into.root);
+    }
+
+    void Mirror() {
+        std::lock_guard<std::mutex> indexLock(m);
+        Mirror(root);
+    }
+
+    template<class Pin>
+    Hook* At(std::size_t k, int fromSide, Pin pin) {
+        std::lock_guard<std::mutex> indexLock(m);
+        if (k >= Size(root)) return nullptr;
+        // walk down from the side we count from
+        const int near(fromSide ? 1 : 0);
+        Hook* node(root);
+        while (true) {
+            const std::size_t nearSize(Size(node->child[near]));
+            if (k < nearSize) {
+                node = node->child[near];
+            } else if (k == nearSize) {
+                pin(node);
+                return node;
+            } else {
+                k -= nearSize + 1;
+                node = node->child[!near];
+            }
+        }
+    }
+
+private:
+    static std::size_t Size(const Hook* node) {
+        return node ? node->size : 0;
+    }
+
+    static void Resize(Hook* node) {
+        node->size = 1 + Size(node->child[0]) + Size(node->child[1]);
+    }
+
+    void SetRoot(Hook* node) {
+        root = node;
+        if (root) root->up = nullptr;
+    }
+
+    // a lone node with a fresh random priority
+    void Prepare(Hook* node) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        node->up = nullptr;
+        node->child[0] = nullptr;
+        node->child[1] = nullptr;
+        node->size = 1;
+        node->priority = seed;
+    }
+
+    // the number of nodes to the left of node
+    static std::size_t Rank(const Hook* node) {
+        std::size_t rank(Size(node->child[0]));
+        for (; node->up; node = node->up) {
+            if (node->up->child[1] == node) rank += Size(node->up->child[0]) + 1;
+        }
+        return rank;
+    }
+
+    // swaps every node's children, so the tree reads right to left
+    static void Mirror(Hook* tree) {
+        if (!tree) return;
+        std::swap(tree->child[0], tree->child[1]);
+        Mirror(tree->child[0]);
+        Mirror(tree->child[1]);
+    }
+
+    // splits tree into its first count nodes and the rest
+    static void Split(Hook* tree, std::size_t count, Hook*& first, Hook*& rest) {
+        if (!tree) {
+            first = rest = nullptr;
+            return;
+        }
+        if (Size(tree->child[0]) < count) {
+            Split(tree->child[1], count - Size(tree->child[0]) - 1, tree->child[1], rest);
+            if (tree->child[1]) tree->child[1]->up = tree;
+            first = tree;
+        } else {
+            Split(tree->child[0], count, first, tree->child[0]);
+            if (tree->child[0]) tree->child[0]->up = tree;
+            rest = tree;
+        }
+        Resize(tree);
+    }
+
+    // joins two trees with every node of a before every node of b
+    static Hook* Merge(Hook* a, Hook* b) {
+        if (!a) return b;
+        if (!b) return a;
+        if (a->priority > b->priority) {
+            a->child[1] = Merge(a->child[1], b);
+            a->child[1]->up = a;
+            Resize(a);
+            return a;
+        }
+        b->child[0] = Merge(a, b->child[0]);
+        b->child[0]->up = b;
+        Resize(b);
+        return b;
+    }
+
+    std::mutex m;
+    Hook* root;
+    std::uint32_t seed;
+};
+
+// VERSIONING
+// policies letting a queue hand out point in time snapshots of itself, each provides
+//     static const bool versioned                   whether snapshots can be taken at all
+//     struct Hook                                   carried by every node, with History<Links> links when versioned
+//     template<class V> class History               the values one location has held, with
+//         void Save(const V& current, std::uint64_t generation, std::uint64_t oldest)
+//                                                   called holding the location's lock just before a change made in
+//                                                   generation overwrites current
+//         V At(V current, std::uint64_t generation) const
+//                                                   the value at the close of generation, from the current one loaded
+//                                                   just beforehand
+//     std::uint64_t BeginWrite(), void EndWrite(std::uint64_t generation)
+//                                                   around every change, once it holds all the locks it needs
+//     std::uint64_t Oldest() const                  the generation of the oldest open snapshot
+//     std::uint64_t Open(), void Close(std::uint64_t generation)
+//                                                   snapshots of everything written up to now
+//     void Follow(const Versioning& other)          moves on past every generation other has reached, so saves on
+//                                                   nodes taken over from it are never read
+
+// no snapshots, changes cost nothing extra
+struct Unversioned {
+    static const bool versioned = false;
+
+    struct Hook {};
+
+    template<class V>
+    struct History {
+        void Save(const V&, std::uint64_t, std::uint64_t) {}
+
+        V At(V current, std::uint64_t) const {
+            return current;
+        }
+    };
+
+    std::uint64_t BeginWrite() {
+        return 0;
+    }
+
+    void EndWrite(std::uint64_t) {}
+
+    std::uint64_t Oldest() const {
+        return 0;
+    }
+
+    void Follow(const Unversioned&) {}
+};
+
+// opening a snapshot closes the current generation: it waits for changes already under way in it to land, and
+// anything changed in a later generation first saves what it held. Readers of the snapshot undo those saves.
+// every change registers with its generation, which costs a read-modify-write on a per-thread stripe, and saving
+// only happens while a snapshot is open. A location keeps one save per generation it changed in, trimmed back to
+// what the oldest open snapshot still needs whenever it changes again
+class Versioned {
+public:
+    static const bool versioned = true;
+
+    // the oldest generation when no snapshot is open
+    static const std::uint64_t noSnapshot = ~std::uint64_t(0);
+
+    Versioned() : generation(1), oldest(noSnapshot) {}
+
+    Versioned(const Versioned&) = delete;
+    Versioned& operator=(const Versioned&) = delete;
+
+    template<class V>
+    class History {
+    public:
+        History() : newest(nullptr) {}
+
+        History(const History&) = delete;
+        History& operator=(const History&) = delete;
+
+        ~History() {
+            Free(newest.load(std::memory_order_relaxed));
+        }
+
+        void Save(const V& current, std::uint64_t generation, std::uint64_t oldest) {
+            Record* record(newest.load(std::memory_order_relaxed));
+            // no snapshot can need any of it
+            if (oldest == noSnapshot) {
+                if (record) {
+                    newest.store(nullptr, std::memory_order_relaxed);
+                    Free(record);
+                }
+                return;
+            }
+            // the first change in a generation keeps what was there before it
+            if (!record || record->generation != generation) {
+                record = new Record{generation, current, record};
+                newest.store(record, std::memory_order_release);
+            }
+            // readers stop at the first save from no later than their snapshot, so nothing beyond the first one
+            // from no later than the oldest snapshot is read again
+            for (; record; record = record->older) {
+                if (record->generation <= oldest) {
+                    Free(record->older);
+                    record->older = nullptr;
+                    return;
+                }
+            }
+        }
+
+        V At(V current, std::uint64_t generation) const {
+            for (const Record* record = newest.load(std::memory_order_acquire);
+                 record && record->generation > generation; record = record->older) {
+                current = record->value;
+            }
+            return current;
+        }
+
+    private:
+        struct Record {
+            std::uint64_t generation;
+            V value;
+            Record* older;
+        };
+
+        static void Free(Record* record) {
+            while (record) {
+                Record* const older(record->older);
+                delete record;
+                record = older;
+            }
+        }
+
+        // newest first
+        std::atomic<Record*> newest;
+    };
+
+    struct Hook;
+
+    // a node's neighbours on either physical side
+    struct Links {
+        const Hook* left;
+        const Hook* right;
+    };
+
+    struct Hook {
+        History<Links> links;
+    };
+
+    std::uint64_t BeginWrite() {
+        Stripe& stripe(stripes[ThreadStripe() % stripeCount]);
+        while (true) {
+            const std::uint64_t g(generation.load());
+            stripe.writers[g & 1].fetch_add(1);
+            // registered against the wrong generation if it closed meanwhile, go again
+            if (generation.load() == g) return g;
+            stripe.writers[g & 1].fetch_sub(1);
+        }
+    }
+
+    void EndWrite(std::uint64_t g) {
+        stripes[ThreadStripe() % stripeCount].writers[g & 1].fetch_sub(1, std::memory_order_release);
+    }
+
+    std::uint64_t Oldest() const {
+        return oldest.load();
+    }
+
+    std::uint64_t Open() {
+        std::lock_guard<std::mutex> lock(m);
+        const std::uint64_t g(generation.load(std::memory_order_relaxed));
+        open.push_back(g);
+        oldest.store(open.front());
+        generation.store(g + 1);
+        // changes still under way in the generation belong to the snapshot, so let them land
+        Drain(g);
+        return g;
+    }
+
+    void Close(std::uint64_t g) {
+        std::lock_guard<std::mutex> lock(m);
+        open.erase(std::find(open.begin(), open.end(), g));
+        oldest.store(open.empty() ? noSnapshot : open.front());
+    }
+
+    // skips ahead the way opening a snapshot moves on, so changes under way in the generations left land first
+    // a generation's writers share their counter with every other generation of the same parity, so a single jump
+    // onto that parity would count new writers in with the ones being waited for
+    void Follow(const Versioned& other) {
+        std::lock_guard<std::mutex> lock(m);
+        const std::uint64_t g(generation.load(std::memory_order_relaxed));
+        const std::uint64_t target(other.generation.load());
+        if (target <= g) return;
+        generation.store(g + 1);
+        Drain(g);
+        if (target == g + 1) return;
+        // the rest in one go, onto the parity just drained, possibly one past target
+        generation.store(target + ((target - g) & 1));
+        Drain(g + 1);
+    }
+
+private:
+    // waits for the writers registered in generation g to land, the generation has already moved past g but not on
+    // to another one of the same parity
+    void Drain(std::uint64_t g) {
+        for (Stripe& stripe : stripes) {
+            while (stripe.writers[g & 1].load() != 0) std::this_thread::yield();
+        }
+    }
+
+    static const std::size_t stripeCount = 16;
+
+    struct alignas(64) Stripe {
+        std::atomic<std::uint64_t> writers[2] = {};
+    };
+
+    std::atomic<std::uint64_t> generation;
+    std::atomic<std::uint64_t> oldest;
+    Stripe stripes[stripeCount];
+    // generations of the open snapshots, ascending as each one opens a later generation than the last
+    std::mutex m;
+    std::vector<std::uint64_t> open;
+};
+
+// SERIALIZERS
+// the queue's binary format is a 4 byte tag, the item count as 8 bytes, then each item from the back to the front,
+// all in the host's byte order. Serializer<T> writes and reads one item:
+//   static void Write(ByteWriter&, const T&)
+//   static T Read(ByteReader&)
+// it is provided for trivially copyable types whose every byte is part of the value (their bytes as they are),
+// std::string (8 byte length and the characters) and pairs and tuples of serializable types (each field in turn),
+// specialise it for anything else. A struct with padding would leak whatever the padding held, so it is left to
+// a specialisation too
+
+// appends bytes to a byte vector
+class ByteWriter {
+public:
+    explicit ByteWriter(std::vector<unsigned char>& bytes) : bytes(bytes) {}
+
+    ByteWriter(const ByteWriter&) = delete;
+    ByteWriter& operator=(const ByteWriter&) = delete;
+
+    void Put(const void* data, std::size_t size) {
+        const std::size_t at(bytes.size());
+        bytes.resize(at + size);
+        std::memcpy(bytes.data() + at, data, size);
+    }
+
+private:
+    std::vector<unsigned char>& bytes;
+};
+
+// reads bytes through a stream's buffer, taking no more than asked for, or straight out of memory
+class ByteReader {
+public:
+    explicit ByteReader(std::istream& in) : in(in.rdbuf()), next(nullptr), last(nullptr) {}
+    ByteReader(const unsigned char* data, std::size_t size) : in(nullptr), next(data), last(data + size) {}
+
+    void Get(void* data, std::size_t size) {
+        if (in) {
+            if (std::size_t(in->sgetn(static_cast<char*>(data), std::streamsize(size))) != size) Truncated();
+            return;
+        }
+        if (std::size_t(last - next) < size) Truncated();
+        std::memcpy(data, next, size);
+        next += size;
+    }
+
+private:
+    [[noreturn]] static void Truncated() {
+        throw std::runtime_error("serialized queue is truncated");
+    }
+
+    std::streambuf* in;
+    const unsigned char* next;
+    const unsigned char* last;
+};
+
+template<class T, class Enable = void>
+struct Serializer;
+
+// written as raw bytes: no padding, which floats and doubles have none of either, and nothing pointing into this
+// process
+template<class T>
+struct IsRawSerializable
+    : std::integral_constant<bool, std::is_trivially_copyable<T>::value && !std::is_pointer<T>::value &&
+                                       !std::is_member_pointer<T>::value &&
+                                       (std::has_unique_object_representations<T>::value ||
+                                        std::is_same<T, float>::value || std::is_same<T, double>::value)> {};
+
+template<class T>
+struct Serializer<T, typename std::enable_if<IsRawSerializable<T>::value>::type> {
+    static void Write(ByteWriter& out, const T& item) { out.Put(&item, sizeof(T)); }
+
+    // the bytes become the item, T needs no default constructor
+    static T Read(ByteReader& in) {
+        alignas(T) unsigned char bytes[sizeof(T)];
+        in.Get(bytes, sizeof(T));
+        return *std::launder(reinterpret_cast<const T*>(bytes));
+    }
+};
+
+template<>
+struct Serializer<std::string> {
+    static void Write(ByteWriter& out, const std::string& item) {
+        const std::uint64_t size(item.size());
+        out.Put(&size, sizeof(size));
+        out.Put(item.data(), item.size());
+    }
+
+    static std::string Read(ByteReader& in) {
+        std::uint64_t size;
+        in.Get(&size, sizeof(size));
+        std::string item;
+        // grown a block at a time so a damaged length cannot ask for everything at once
+        while (item.size() < size) {
+            const std::size_t at(item.size());
+            item.resize(at + std::size_t(std::min<std::uint64_t>(size - at, 1 << 16)));
+            in.Get(&item[at], item.size() - at);
+        }
+        return item;
+    }
+};
+
+template<class First, class Second>
+struct Serializer<std::pair<First, Second>,
+                  typename std::enable_if<!IsRawSerializable<std::pair<First, Second>>::value>::type> {
+    static void Write(ByteWriter& out, const std::pair<First, Second>& item) {
+        Serializer<First>::Write(out, item.first);
+        Serializer<Second>::Write(out, item.second);
+    }
+
+    static std::pair<First, Second> Read(ByteReader& in) {
+        First first(Serializer<First>::Read(in));
+        return std::pair<First, Second>(std::move(first), Serializer<Second>::Read(in));
+    }
+};
+
+template<class... Fields>
+struct Serializer<std::tuple<Fields...>,
+                  typename std::enable_if<!IsRawSerializable<std::tuple<Fields...>>::value>::type> {
+    static void Write(ByteWriter& out, const std::tuple<Fields...>& item) {
+        std::apply([&out](const Fields&... fields) { (Serializer<Fields>::Write(out, fields), ...); }, item);
+    }
+
+    // braced so the fields are read in order
+    static std::tuple<Fields...> Read(ByteReader& in) {
+        return std::tuple<Fields...>{Serializer<Fields>::Read(in)...};
+    }
+};
+
+template<class T, class NodePool = PooledNodes, class Index = NoIndex, class Contention = ExponentialBackoff,
+         class Versioning = Unversioned>
+class ReversibleQueue {
+    // everything the index and the versioning keep per node
+    struct NodeHook : Index::Hook, Versioning::Hook {};
+    using QueueNode = Node<T, NodeHook>;
+
+public:
+    ReversibleQueue() : direction(true), epoch(0), splits(0), pendingRetired(0) {
+        ends[left].store(nullptr, std::memory_order_relaxed);
+        ends[right].store(nullptr, std::memory_order_relaxed);
+        readers[0].store(0, std::memory_order_relaxed);
+        readers[1].store(0, std::memory_order_relaxed);
+        RQ_LOCK_ROLE(endLocks[left], "end");
+        RQ_LOCK_ROLE(endLocks[right], "end");
+    }
+
+    ReversibleQueue(const ReversibleQueue&) = delete;
+    ReversibleQueue& operator=(const ReversibleQueue&) = delete;
+
+    // no thread may still be observing the queue
+    ~ReversibleQueue() {
+        // walk physically from left to right
+        QueueNode* node(ends[left].load(std::memory_order_relaxed));
+        while (node) {
+            QueueNode* rightNode(node->GetInfront(true));
+            NodePool::Destroy(node);
+            node = (rightNode == node) ? nullptr : rightNode;
+        }
+        for (const Retired& dead : retired) NodePool::Destroy(dead.node);
+    }
+
+    // LOCK ORDERING
+    // the two ends of the queue are guarded separately so producers at one end never contend with consumers at the
+    // other. End mutexes are always taken before any node mutex, and when both are needed the left one goes first.
+    // Operations that can touch both ends at once (into or out of an empty queue) and reverse() take both.
+    // nodes no longer carry a direction, so "forward" can point either way physically depending on when an
+    // operation started. To stay deadlock free regardless of direction we order node locks physically:
+    // a thread may BLOCK on a node only if it is to the left of every node it already holds, anything to the
+    // right is try_lock'ed and on failure we back off and retry. Waits therefore only ever travel leftwards.
+    // how an operation backs off is up to the Contention policy.
+
+    // a position in the queue that owns the lock on the node it observes
+    // cursors are movable and release their node when destroyed, so any number of them can be held by a thread
+    // NOTE: a thread must not walk one of its cursors into a node held by another of its own cursors
+    class Cursor {
+    public:
+        Cursor() : queue(nullptr), node(nullptr), direction(true) {}
+
+        Cursor(Cursor&& other) noexcept
+            : queue(other.queue), node(other.node), lock(std::move(other.lock)), direction(other.direction) {
+            other.node = nullptr;
+        }
+
+        Cursor& operator=(Cursor&& other) noexcept {
+            if (this != &other) {
+                // drop our node before taking theirs so the lock never outlives its node
+                Release();
+                queue = other.queue;
+                node = other.node;
+                lock = std::move(other.lock);
+                other.node = nullptr;
+                direction = other.direction;
+            }
+            return *this;
+        }
+
+        ~Cursor() { Release(); }
+
+        // true while the cursor holds a node
+        explicit operator bool() const { return node != nullptr; }
+
+        // the data held by the observed node, valid for as long as the cursor stays on it
+        const T& Get() const {
+            if (!node) throw std::logic_error("cursor not currently observing the queue");
+            return node->data;
+        }
+
+        // unlocks and stops observing a node
+        void Release() {
+            if (lock.owns_lock()) lock.unlock();
+            if (node) queue->Unref(node);
+            node = nullptr;
+        }
+
+        // moves to the node in front, returns false and stays put if already at the front
+        bool Advance() {
+            RQ_LOCK_SITE();
+            return Step(true);
+        }
+
+        // moves to the node behind, returns false and stays put if already at the back
+        bool Retreat() {
+            RQ_LOCK_SITE();
+            return Step(false);
+        }
+
+        // adds a data node behind the observed node
+        // will throw an error if the cursor is looking at the rear node
+        void Insert(const T& item) {
+            RQ_LOCK_SITE();
+            Emplace(item);
+        }
+
+        void Insert(T&& item) {
+            RQ_LOCK_SITE();
+            Emplace(std::move(item));
+        }
+
+        // constructs a data node in place behind the observed node
+        // will throw an error if the cursor is looking at the rear node
+        // backing off from a busy neighbour lets go of the observed node, and if another thread erases or pops it
+        // meanwhile there is nowhere left to insert: the cursor is released and std::runtime_error thrown
+        template<class... Args>
+        void Emplace(Args&&... args) {
+            RQ_LOCK_SITE();
+            if (!node) throw std::logic_error("cursor not currently observing queue");
+
+            QueueNode* behindNode;
+            std::unique_lock<QueueMutex> behindLock;
+            Contention backoff;
+            while(true) {
+                // check if there is a node behind the observed node
+                behindNode = node->GetBehind(direction);
+                if (behindNode == node) throw std::domain_error("cannot insert at the back of the queue (use pushBack)");
+                // this should NEVER occur, node is dead if we see this error, we have some bad code.
+                else if (!behindNode) throw std::logic_error("locatorNode is erased");
+
+                // lock the behind neighbour, only allowed to wait on it when it is to our left
+                behindLock = std::unique_lock<QueueMutex>(behindNode->m, std::defer_lock);
+                if (direction) {
+                    behindLock.lock();
+                    break;
+                }
+                if (behindLock.try_lock()) break;
+                // give the blocking thread a chance to complete acquire of this/release that node
+                queue->BackOff(backoff, lock, behindNode);
+                if (!node->GetInfront(true)) {
+                    Release();
+                    throw std::runtime_error("observed node was erased while inserting, nothing inserted");
+                }
+            }
+            // generate a newNode and acquire it, nobody else can reach it yet so this never waits
+            QueueNode* const newNode(NewNode(std::forward<Args>(args)...));
+            std::lock_guard<QueueMutex> newLock(newNode->m);
+            queue->counters.Grow(1);
+            queue->counters.Count(QueueCounters::inserts);
+
+            // we now hold all relevant locks so modify data
+            // newNode is fully linked before anyone can reach it, optimistic readers may follow it straight away
+            newNode->SetBehind(behindNode, direction);
+            newNode->SetInfront(node, direction);
+            // back <--> newNode <--> front
+            Change change(*queue);
+            change.Save(behindNode);
+            change.Save(node);
+            behindNode->SetInfront(newNode, direction);
+            node->SetBehind(newNode, direction);
+            queue->index.Insert(newNode, node, direction ? left : right);
+        }
+
+        // erases the observed node and then releases the cursor
+        void Erase() {
+            RQ_LOCK_SITE();
+            if (!node) throw std::logic_error("cursor not currently observing queue");
+
+            // This function requires a locking attempt loop due to it requiring a lock and its right neighbour
+            // we are making the locking attempt on right neighbours weak in order to remove deadlock states
+            Contention backoff;
+            while(true) {
+                // check that there is a forward node
+                QueueNode* infrontNode(node->GetInfront(direction));
+                if (infrontNode == node) {
+                    // we are at the front of the queue so just use PopFront (this is a high-level operation)
+                    lock.unlock();
+                    if (queue->EraseEnd(node, direction)) {
+                        Release();
+                        return;
+                    }
+                    // someone has been pushed in front of us meanwhile, so take our node back and go again
+                    queue->counters.Count(QueueCounters::retries);
+                    lock.lock();
+                    // unless someone else erased it while we let go, which is what we were after anyway
+                    if (!node->GetInfront(true)) break;
+                    continue;
+                }
+                // this should not happen
+                else if (!infrontNode) throw std::logic_error("locatorNode is already erased");
+
+                // check that there is a node behind
+                QueueNode* behindNode(node->GetBehind(direction));
+                // we can catch this condition when we call erase and issue a PopBack
+                if (behindNode == node) throw std::domain_error("cannot erase node at the back of the queue (use PopBack)");
+                // this definitely should never happen as it should have been caught above, put here for completeness
+                if (!behindNode) throw std::logic_error("locatorNode is already erased");
+
+                // ATTEMPT to lock the node to our right, then wait for the one to our left
+                QueueNode* rightNode(direction ? infrontNode : behindNode);
+                QueueNode* leftNode(direction ? behindNode : infrontNode);
+                std::unique_lock<QueueMutex> rightLock(rightNode->m, std::defer_lock);
+                if (!rightLock.try_lock()) {
+                    // if we fail to lock the right lock, unlock everything and try again
+                    queue->BackOff(backoff, lock, rightNode);
+                    if (!node->GetInfront(true)) break;
+                    continue;
+                }
+                std::lock_guard<QueueMutex> leftLock(leftNode->m);
+
+                // we now have all the necessary locks in out possession, so modify data accordingly
+                Change change(*queue);
+                change.Save(infrontNode);
+                change.Save(behindNode);
+                change.Save(node);
+                infrontNode->SetBehind(behindNode, direction);
+                behindNode->SetInfront(infrontNode, direction);
+                // now kill both refs inside node to mark its death
+                node->SetBehind(nullptr, direction);
+                node->SetInfront(nullptr, direction);
+                queue->index.Erase(node);
+                queue->counters.Shrink(1);
+                queue->counters.Count(QueueCounters::erases);
+                // the queue's reference goes, ours keeps the node alive until released
+                queue->Unref(node);
+                break;
+            }
+            Release();
+            queue->room.Notify(false);
+        }
+
+    private:
+        friend class ReversibleQueue;
+
+        // takes ownership of an already locked and referenced node
+        Cursor(ReversibleQueue* _queue, QueueNode* _node, bool _direction)
+            : queue(_queue), node(_node), lock(node->m, std::adopt_lock), direction(_direction) {}
+
+        // hand-over-hand move to the neighbour in front (forwards) or behind
+        bool Step(bool forwards) {
+            if (!node) throw std::logic_error("cursor not currently observing the queue");
+
+            // the neighbour is to our left when walking forwards through a reversed queue or backwards otherwise
+            const bool towardsLeft(forwards != direction);
+            Contention backoff;
+            while(true) {
+                QueueNode* nextNode(forwards ? node->GetInfront(direction) : node->GetBehind(direction));
+                if(!nextNode) throw std::logic_error("observed node is erased");
+
+                // we are at the end
+                if(nextNode == node) return false;
+
+                std::unique_lock<QueueMutex> nextLock(nextNode->m, std::defer_lock);
+                // walking leftwards we may simply wait for the next node
+                if(towardsLeft) {
+                    nextLock.lock();
+                }
+                else if(!nextLock.try_lock()) {
+                    // unlock everything and try again, keeping hold of the next node in case ours goes meanwhile
+                    nextNode->refs.fetch_add(1, std::memory_order_relaxed);
+                    queue->BackOff(backoff, lock, nextNode);
+                    if (node->GetInfront(true)) {
+                        queue->Unref(nextNode);
+                        continue;
+                    }
+                    // ours was erased while we let go of it, so carry on from the node we were heading for
+                    lock.unlock();
+                    queue->Unref(node);
+                    node = nextNode;
+                    lock = std::unique_lock<QueueMutex>(node->m);
+                    if (node->GetInfront(true)) return true;
+                    // that one went too, so our place in the queue is lost
+                    throw std::logic_error("observed node is erased");
+                }
+
+                // the next node is linked behind a lock we hold, so it is safe to take a reference to it
+                nextNode->refs.fetch_add(1, std::memory_order_relaxed);
+                // release lock on this node and observe the next one
+                lock.unlock();
+                queue->Unref(node);
+                node = nextNode;
+                lock = std::move(nextLock);
+                return true;
+            }
+        }
+
+        ReversibleQueue* queue;
+        // referenced by the cursor so it outlives the lock, even if erased while we back off
+        QueueNode* node;
+        std::unique_lock<QueueMutex> lock;
+        // the cursor keeps walking in the direction the queue had when it entered, even if reversed under it
+        bool direction;
+    };
+
+    // returns a cursor observing the rear of the queue
+    Cursor Back() {
+        RQ_LOCK_SITE();
+        return End(false);
+    }
+
+    // returns a cursor observing the front of the queue
+    Cursor Front() {
+        RQ_LOCK_SITE();
+        return End(true);
+    }
+
+    // returns a cursor observing the item k places in front of the back, SeekFromBack(0) being the back
+    // O(log n) with an OrderIndex, otherwise it walks there from the back
+    Cursor SeekFromBack(std::size_t k) {
+        RQ_LOCK_SITE();
+        return Seek(false, k);
+    }
+
+    // returns a cursor observing the item k places behind the front
+    Cursor SeekFromFront(std::size_t k) {
+        RQ_LOCK_SITE();
+        return Seek(true, k);
+    }
+
+    // adds a data item to the front of the queue
+    void PushFront(const T& item) {
+        RQ_LOCK_SITE();
+        // TODO: is item valid?
+        PushNode(true, NewNode(item));
+    }
+
+    void PushFront(T&& item) {
+        RQ_LOCK_SITE();
+        PushNode(true, NewNode(std::move(item)));
+    }
+
+    // adds a data item behind the last item
+    void PushBack(const T& item) {
+        RQ_LOCK_SITE();
+        // TODO: is item valid?
+        PushNode(false, NewNode(item));
+    }
+
+    void PushBack(T&& item) {
+        RQ_LOCK_SITE();
+        PushNode(false, NewNode(std::move(item)));
+    }
+
+    // constructs a data item in place at the front of the queue
+    template<class... Args>
+    void EmplaceFront(Args&&... args) {
+        RQ_LOCK_SITE();
+        PushNode(true, NewNode(std::forward<Args>(args)...));
+    }
+
+    // constructs a data item in place behind the last item
+    template<class... Args>
+    void EmplaceBack(Args&&... args) {
+        RQ_LOCK_SITE();
+        PushNode(false, NewNode(std::forward<Args>(args)...));
+    }
+
+    // adds every item in [first, last) to the front in order, as repeated PushFront would
+    // the nodes are linked up privately and spliced in while holding the front once
+    template<class InputIt>
+    void PushFront(InputIt first, InputIt last) {
+        RQ_LOCK_SITE();
+        PushRange(true, first, last);
+    }
+
+    // adds every item in [first, last) behind the last item in order, as repeated PushBack would
+    template<class InputIt>
+    void PushBack(InputIt first, InputIt last) {
+        RQ_LOCK_SITE();
+        PushRange(false, first, last);
+    }
+
+    // moves every item of other to the front in order, as if each had been popped from its back and pushed here,
+    // leaving other empty. Nodes are relinked rather than copied, so this holds the front once whatever the length.
+    // If the queues face opposite ways and this one is not empty the moved nodes still have to be mirrored, one
+    // pass over them with no allocation
+    // nobody else may be using other meanwhile: no cursors, observers, snapshots or calls from other threads
+    void SpliceFront(ReversibleQueue&& other) {
+        RQ_LOCK_SITE();
+        Splice(true, other);
+    }
+
+    // moves every item of other behind the last item in order, leaving other empty
+    void SpliceBack(ReversibleQueue&& other) {
+        RQ_LOCK_SITE();
+        Splice(false, other);
+    }
+
+    // cuts the queue behind the cursor's node, returning a queue of everything that was behind it in the same order
+    // the node stays with the cursor and becomes the back. No other thread may be observing anything behind it,
+    // and this waits for lock-free readers and snapshots already open on this queue to finish before returning,
+    // letting go of the cursor's node meanwhile, so by the time it returns the node may have been erased.
+    // One open on the calling thread would never finish, so that throws std::logic_error before anything moves;
+    // a snapshot or ItemsFromBack generator finished on another thread than it was opened on still counts against
+    // the thread that opened it
+    // constant time with an OrderIndex, otherwise the moved items are counted by walking them
+    ReversibleQueue SplitAt(Cursor& cursor) {
+        RQ_LOCK_SITE();
+        return ReversibleQueue(SplitTag(), *this, cursor);
+    }
+
+    // removes the first data item
+    void PopFront() {
+        RQ_LOCK_SITE();
+        QueueNode* popped(PopEnd(true));
+        // empty list
+        if(!popped) throw std::logic_error("cannot pop from empty list");
+        Unref(popped);
+    }
+
+    // removes the last data item
+    void PopBack() {
+        RQ_LOCK_SITE();
+        QueueNode* popped(PopEnd(false));
+        // empty list
+        if(!popped) throw std::logic_error("cannot pop from empty list");
+        Unref(popped);
+    }
+
+    // removes the first data item, moving it into item, returns false if the queue is empty
+    bool TryPopFront(T& item) {
+        RQ_LOCK_SITE();
+        return PopInto(true, item);
+    }
+
+    // removes the last data item, moving it into item, returns false if the queue is empty
+    bool TryPopBack(T& item) {
+        RQ_LOCK_SITE();
+        return PopInto(false, item);
+    }
+
+    // removes up to n items from the front, moving them into out in the order they are popped
+    // returns how many were removed, fewer than n only if the queue ran empty
+    template<class OutputIt>
+    std::size_t PopFront(std::size_t n, OutputIt out) {
+        RQ_LOCK_SITE();
+        const std::size_t count(PopRun(true, n, out));
+        if (count) room.Notify(true);
+        return count;
+    }
+
+    // removes up to n items from the back, moving them into out in the order they are popped
+    template<class OutputIt>
+    std::size_t PopBack(std::size_t n, OutputIt out) {
+        RQ_LOCK_SITE();
+        const std::size_t count(PopRun(false, n, out));
+        if (count) room.Notify(true);
+        return count;
+    }
+
+    // removes the first data item if there is one, never throws for an empty queue
+    std::optional<T> TryPopFront() {
+        RQ_LOCK_SITE();
+        return PopOptional(true);
+    }
+
+    // removes the last data item if there is one
+    std::optional<T> TryPopBack() {
+        RQ_LOCK_SITE();
+        return PopOptional(false);
+    }
+
+    // removes the first data item, waiting for one to be pushed if the queue is empty
+    // returns nothing only once the queue has been closed and is empty
+    std::optional<T> WaitPopFront() {
+        RQ_LOCK_SITE();
+        return waiters.Wait([this] { return TryPopFront(); }, nullptr);
+    }
+
+    // removes the last data item, waiting for one to be pushed if the queue is empty
+    std::optional<T> WaitPopBack() {
+        RQ_LOCK_SITE();
+        return waiters.Wait([this] { return TryPopBack(); }, nullptr);
+    }
+
+    // removes the first data item, waiting at most timeout for one to be pushed
+    template<class Rep, class Period>
+    std::optional<T> TryPopFor(const std::chrono::duration<Rep, Period>& timeout) {
+        RQ_LOCK_SITE();
+        const std::chrono::steady_clock::time_point deadline(std::chrono::steady_clock::now() + timeout);
+        return waiters.Wait([this] { return TryPopFront(); }, &deadline);
+    }
+
+    // removes the last data item, waiting at most timeout for one to be pushed
+    template<class Rep, class Period>
+    std::optional<T> TryPopBackFor(const std::chrono::duration<Rep, Period>& timeout) {
+        RQ_LOCK_SITE();
+        const std::chrono::steady_clock::time_point deadline(std::chrono::steady_clock::now() + timeout);
+        return waiters.Wait([this] { return TryPopBack(); }, &deadline);
+    }
+
+    // wakes every waiting consumer, from now on waits return nothing instead of blocking on an empty queue
+    // pushing is still allowed, the items are there for anyone popping
+    void Close() {
+        waiters.Close();
+    }
+
+    bool Closed() const {
+        return waiters.Closed();
+    }
+
+#if defined(__cpp_impl_coroutine)
+    // awaitables for coroutines: instead of blocking its thread, a coroutine finding the queue empty (or at capacity)
+    // is parked and later resumed through executor.Post once an item (or room) may be there
+    // the queue's own locks are still taken for the pop or push itself, but only ever briefly
+    // a parked coroutine must not be destroyed, nor the queue, until it has been resumed
+
+    // removes the first data item, waiting without blocking for one to be pushed if the queue is empty
+    // gives nothing only once the queue has been closed and is empty
+    template<class Executor>
+    auto AsyncPopFront(Executor& executor) {
+        return PopAwaiter<Executor>(*this, true, executor);
+    }
+
+    template<class Executor>
+    auto AsyncPopBack(Executor& executor) {
+        return PopAwaiter<Executor>(*this, false, executor);
+    }
+
+    // adds item behind the last, first waiting without blocking while the queue holds capacity items or more
+    // the capacity is only checked, not reserved, so producers pushing together can overshoot it
+    template<class Executor>
+    auto AsyncPushBack(T item, Executor& executor, std::size_t capacity = std::size_t(-1)) {
+        return PushAwaiter<Executor>(*this, false, std::move(item), executor, capacity);
+    }
+
+    template<class Executor>
+    auto AsyncPushFront(T item, Executor& executor, std::size_t capacity = std::size_t(-1)) {
+        return PushAwaiter<Executor>(*this, true, std::move(item), executor, capacity);
+    }
+
+    // every item from the back to the front, seen the way TransformReduce sees the queue
+    // never waits, so it is a plain generator the coroutine can co_await anything between items of. Until it is
+    // destroyed it holds off freeing unlinked nodes, as a View does
+    Generator<T> ItemsFromBack() const {
+        ReadGuard guard(*this);
+        const std::vector<const QueueNode*> nodes(Gather());
+        for (const QueueNode* node : nodes) co_yield static_cast<const T&>(node->data);
+    }
+#endif
+
+    // calls fn on each data item from the back to the front without taking any locks, writers carry on meanwhile
+    // an item erased under the reader is skipped by resuming from the last item visited. If that one has gone too,
+    // or the queue was split under it, the walk restarts from the back, visiting some items again. Returns the
+    // number of restarts
+    template<class Fn>
+    std::size_t ForEachFromBack(Fn fn) const {
+        RQ_LOCK_SITE();
+        ReadGuard guard(*this);
+        return Walk([&fn](const QueueNode* node) { fn(static_cast<const T&>(node->data)); }, [] {});
+    }
+
+    // transforms every data item and folds the results together with reduce, from the back to the front
+    // reduce must be associative but need not commute. The queue is gathered without taking any locks, starting
+    // over if the walk has to restart, so every item there throughout is counted exactly once and items pushed or
+    // erased meanwhile may or may not be. The transforms and most of the reducing are shared out on executor
+    template<class U, class Reduce, class Transform, class Executor = InlineExecutor>
+    U TransformReduce(U init, Reduce reduce, Transform transform, Executor&& executor = Executor()) const {
+        ReadGuard guard(*this);
+        const std::vector<const QueueNode*> nodes(Gather());
+        const std::size_t chunks(Chunks(nodes.size(), executor.Concurrency()));
+        std::vector<std::optional<U>> partials(chunks);
+        executor.Run(chunks, [&](std::size_t chunk) {
+            const std::size_t last(ChunkStart(nodes.size(), chunks, chunk + 1));
+            std::size_t i(ChunkStart(nodes.size(), chunks, chunk));
+            U partial(transform(static_cast<const T&>(nodes[i]->data)));
+            for (i++; i < last; i++) {
+                partial = reduce(std::move(partial), transform(static_cast<const T&>(nodes[i]->data)));
+            }
+            partials[chunk].emplace(std::move(partial));
+        });
+        for (std::optional<U>& partial : partials) init = reduce(std::move(init), std::move(*partial));
+        return init;
+    }
+
+    // calls fn on every data item, with the calls shared out on executor in no particular order
+    // sees the queue the same way TransformReduce does
+    template<class Fn, class Executor = InlineExecutor>
+    void ParallelForEach(Fn fn, Executor&& executor = Executor()) const {
+        ReadGuard guard(*this);
+        const std::vector<const QueueNode*> nodes(Gather());
+        const std::size_t chunks(Chunks(nodes.size(), executor.Concurrency()));
+        executor.Run(chunks, [&](std::size_t chunk) {
+            const std::size_t last(ChunkStart(nodes.size(), chunks, chunk + 1));
+            for (std::size_t i = ChunkStart(nodes.size(), chunks, chunk); i < last; i++) {
+                fn(static_cast<const T&>(nodes[i]->data));
+            }
+        });
+    }
+
+    // writes the queue in the format described under SERIALIZERS, from the back to the front whichever way it is
+    // facing. Sees the queue the same way TransformReduce does
+    void Serialize(std::ostream& out) const {
+        RQ_LOCK_SITE();
+        std::vector<unsigned char> bytes;
+        Serialize(bytes);
+        out.write(reinterpret_cast<const char*>(bytes.data()), std::streamsize(bytes.size()));
+        if (!out) throw std::runtime_error("cannot write serialized queue");
+    }
+
+    // appends the serialized queue to bytes
+    void Serialize(std::vector<unsigned char>& bytes) const {
+        RQ_LOCK_SITE();
+        const std::size_t start(bytes.size());
+        std::uint64_t count(0);
+        ByteWriter writer(bytes);
+        writer.Put(serialTag, sizeof(serialTag));
+        writer.Put(&count, sizeof(count));
+        ReadGuard guard(*this);
+        // written as the walk goes, a restart starts the items over
+        Walk([&writer, &count](const QueueNode* node) {
+            Serializer<T>::Write(writer, node->data);
+            count++;
+        }, [&bytes, &count, start] {
+            bytes.resize(start + sizeof(serialTag) + sizeof(count));
+            count = 0;
+        });
+        std::memcpy(bytes.data() + start + sizeof(serialTag), &count, sizeof(count));
+    }
+
+    // adds the serialized items in front of any already queued, so into an empty queue it brings back the queue
+    // that was serialized. The nodes are linked up as they are read and spliced in at once, if the input is
+    // malformed nothing is added and std::runtime_error is thrown
+    void Deserialize(std::istream& in) {
+        RQ_LOCK_SITE();
+        ByteReader reader(in);
+        DeserializeFrom(reader);
+    }
+
+    void Deserialize(const std::vector<unsigned char>& bytes) {
+        RQ_LOCK_SITE();
+        ByteReader reader(bytes.data(), bytes.size());
+        DeserializeFrom(reader);
+    }
+
+    // an unchanging view of the queue as it was when taken, iterated from the back to the front
+    // writers carry on meanwhile, but anything unlinked while a view is open is kept until it closes
+    class View {
+    public:
+        class Iterator {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = T;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const T*;
+            using reference = const T&;
+
+            Iterator() : view(nullptr), node(nullptr) {}
+
+            const T& operator*() const {
+                return node->data;
+            }
+
+            const T* operator->() const {
+                return &node->data;
+            }
+
+            Iterator& operator++() {
+                node = view->Next(node);
+                return *this;
+            }
+
+            Iterator operator++(int) {
+                Iterator old(*this);
+                ++*this;
+                return old;
+            }
+
+            bool operator==(const Iterator& other) const {
+                return node == other.node;
+            }
+
+            bool operator!=(const Iterator& other) const {
+                return node != other.node;
+            }
+
+        private:
+            friend class View;
+
+            Iterator(const View* _view, const QueueNode* _node) : view(_view), node(_node) {}
+
+            const View* view;
+            const QueueNode* node;
+        };
+
+        View(View&& other) noexcept
+            : queue(other.queue), epoch(other.epoch), generation(other.generation), direction(other.direction) {
+            other.queue = nullptr;
+        }
+
+        View& operator=(View&& other) noexcept {
+            if (this != &other) {
+                Close();
+                queue = other.queue;
+                epoch = other.epoch;
+                generation = other.generation;
+                direction = other.direction;
+                other.queue = nullptr;
+            }
+            return *this;
+        }
+
+        View(const View&) = delete;
+        View& operator=(const View&) = delete;
+
+        ~View() {
+            Close();
+        }
+
+        Iterator begin() const {
+            const int side(EndSide(false, direction));
+            QueueNode* const back(queue->ends[side].load(std::memory_order_acquire));
+            return Iterator(this, queue->endHistory[side].At(back, generation));
+        }
+
+        Iterator end() const {
+            return Iterator(this, nullptr);
+        }
+
+        bool Empty() const {
+            return begin() == end();
+        }
+
+    private:
+        friend class ReversibleQueue;
+
+        // the epoch is entered first, so nothing unlinked after the snapshot opens can be reclaimed under it
+        explicit View(ReversibleQueue* q) : queue(q), epoch(q->BeginRead()), generation(q->versions.Open()) {
+            direction = q->directionHistory.At(q->direction.load(std::memory_order_acquire), generation);
+        }
+
+        void Close() {
+            if (!queue) return;
+            queue->versions.Close(generation);
+            queue->EndRead(epoch);
+            queue = nullptr;
+        }
+
+        // the node in front of node as the snapshot saw it, nullptr past the front
+        const QueueNode* Next(const QueueNode* node) const {
+            // the links are loaded before their history, so a change seen in them has its save seen too
+            typename Versioning::Links links{node->GetBehind(true), node->GetInfront(true)};
+            links = node->links.At(links, generation);
+            const QueueNode* const next(static_cast<const QueueNode*>(direction ? links.right : links.left));
+            return next == node ? nullptr : next;
+        }
+
+        ReversibleQueue* queue;
+        std::uint64_t epoch;
+        std::uint64_t generation;
+        bool direction;
+    };
+
+    // opens a view of the queue as it is now, in constant time and without holding anyone up
+    // only waits for changes that are already under way to land
+    View Snapshot() const {
+        RQ_LOCK_SITE();
+        static_assert(Versioning::versioned, "snapshots need a Versioned queue");
+        // popped data may be moved out, so views only work on types that can be copied out instead
+        static_assert(std::is_copy_constructible<T>::value, "snapshots need copy constructible data");
+        // opening one registers it with the versioning but leaves the queue's contents alone
+        return View(const_cast<ReversibleQueue*>(this));
+    }
+
+    // the number of data items in the queue, without taking any locks
+    // may run ahead of the items that can actually be reached while pushes and inserts are under way
+    std::size_t Size() const {
+        return counters.Length();
+    }
+
+    bool Empty() const {
+        return Size() == 0;
+    }
+
+    // counts of what the queue has been through, cheap enough to scrape while it is in use
+    QueueStats Stats() const {
+        return counters.Snapshot();
+    }
+
+    // THREAD OBSERVERS
+    // each thread can keep one implicit cursor inside the queue, these are thin wrappers around it
+
+    // adds a data node behind the given current thread observer location
+    // will throw an error if the observer is looking at the rear node, or std::runtime_error as Cursor::Emplace does
+    void Insert(const T& item) {
+        RQ_LOCK_SITE();
+        Emplace(item);
+    }
+
+    void Insert(T&& item) {
+        RQ_LOCK_SITE();
+        Emplace(std::move(item));
+    }
+
+    // constructs a data node in place behind the given current thread observer location
+    template<class... Args>
+    void Emplace(Args&&... args) {
+        RQ_LOCK_SITE();
+        Cursor& observer(threadLocator.Local());
+        if (!observer) throw std::logic_error("thread not currently observing queue");
+        observer.Emplace(std::forward<Args>(args)...);
+    }
+
+    // erases a data node at the thread locator position and then remove the thread locator
+    void Erase() {
+        RQ_LOCK_SITE();
+        Cursor& observer(threadLocator.Local());
+        if (!observer) throw std::logic_error("thread not currently observing queue");
+        observer.Erase();
+    }
+
+    // set the thread to observe the rear of the queue
+    void GoToBack() const {
+        RQ_LOCK_SITE();
+        Cursor& observer(threadLocator.Local());
+        observer.Release();
+        // the observer needs write access to the queue to erase at the front
+        observer = const_cast<ReversibleQueue*>(this)->Back();
+    }
+
+    // set the thread to observe the item k places in front of the back of the queue
+    void GoTo(std::size_t k) const {
+        RQ_LOCK_SITE();
+        Cursor& observer(threadLocator.Local());
+        observer.Release();
+        observer = const_cast<ReversibleQueue*>(this)->SeekFromBack(k);
+    }
+
+    // set the thread to observe the front of the queue
+    void GoToFront() const {
+        RQ_LOCK_SITE();
+        Cursor& observer(threadLocator.Local());
+        observer.Release();
+        observer = const_cast<ReversibleQueue*>(this)->Front();
+    }
+
+    // moves the observed node to the one in front of current, throws an exception if at the front already
+    void MoveForward() const {
+        RQ_LOCK_SITE();
+        Cursor& observer(threadLocator.Local());
+        if(!observer) throw std::logic_error("thread not currently observing the queue");
+        if(!observer.Advance()) {
+            // we are at the end so release observer
+            observer.Release();
+            throw std::domain_error("current observed node at front of queue");
+        }
+    }
+
+    // moves the observed node to the one behind current, throws an exception if at the back already
+    // walking either way is deadlock free as the cursor only ever waits on nodes physically to its left
+    void MoveBackward() const {
+        RQ_LOCK_SITE();
+        Cursor& observer(threadLocator.Local());
+        if(!observer) throw std::logic_error("thread not currently observing the queue");
+        if(!observer.Retreat()) {
+            // we are at the end so release observer
+            observer.Release();
+            throw std::domain_error("current observed node at back of queue");
+        }
+    }
+
+    // unlocks and stops observing a node
+    void ClearObserver() const {
+        RQ_LOCK_SITE();
+        threadLocator.Local().Release();
+    }
+
+    // changes the access and traverse direction of the queue
+    // nodes are resolved against the queue direction, so this is a constant time flip
+    void reverse() {
+        RQ_LOCK_SITE();
+        // acquire both ends, nobody else may be deciding which of them is the front
+        std::lock_guard<QueueMutex> leftLock(endLocks[left]);
+        std::lock_guard<QueueMutex> rightLock(endLocks[right]);
+
+        Change change(*this);
+        change.SaveDirection();
+        direction.store(!direction.load(std::memory_order_relaxed), std::memory_order_release);
+        counters.Count(QueueCounters::reversals);
+    }
+
+    // returns the data contained in the currently observed node
+    // the reference stays valid until the thread moves off the node
+    const T& GetData() const {
+        const Cursor& observer(threadLocator.Local());
+        if (!observer) throw std::logic_error("thread not currently observing the queue");
+        return observer.Get();
+    }
+
+    // initialises a queue observer for the given thread
+    void InitObserver() {
+        // no queue lock needed, every thread owns its own observer slot
+        threadLocator.Local().Release();
+    }
+
+    // stops observing and frees this thread's observer slot for reuse by other threads
+    void ReleaseObserver() {
+        ClearObserver();
+        threadLocator.Release();
+    }
+
+private:
+
+    struct SplitTag {};
+
+    // what SplitAt returns, built in place as the queue cannot be moved
+    ReversibleQueue(SplitTag, ReversibleQueue& from, Cursor& cursor) : ReversibleQueue() {
+        from.SplitBehind(cursor, *this);
+    }
+
+    template<class... Args>
+    static QueueNode* NewNode(Args&&... args) {
+        return NodePool::template Create<QueueNode>(std::in_place, std::forward<Args>(args)...);
+    }
+
+    // drops a reference to node, retiring it with the last one
+    void Unref(QueueNode* node) {
+        if (node->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) Retire(node);
+    }
+
+    // one change to the links of the queue, made while holding every lock it needs
+    // while a snapshot is open, each location saves what it held before the first change to it in a generation
+    class Change {
+    public:
+        explicit Change(ReversibleQueue& q)
+            : queue(q), generation(q.versions.BeginWrite()), oldest(q.versions.Oldest()) {}
+
+        Change(const Change&) = delete;
+        Change& operator=(const Change&) = delete;
+
+        ~Change() {
+            queue.versions.EndWrite(generation);
+        }
+
+        void Save(QueueNode* node) {
+            if constexpr (Versioning::versioned) {
+                node->links.Save({node->GetBehind(true), node->GetInfront(true)}, generation, oldest);
+            }
+        }
+
+        void SaveEnd(int side) {
+            queue.endHistory[side].Save(queue.ends[side].load(std::memory_order_relaxed), generation, oldest);
+        }
+
+        void SaveDirection() {
+            queue.directionHistory.Save(queue.direction.load(std::memory_order_relaxed), generation, oldest);
+        }
+
+    private:
+        ReversibleQueue& queue;
+        const std::uint64_t generation;
+        const std::uint64_t oldest;
+    };
+
+    // lets go of held after failing to try_lock contended, which is linked behind it, and takes it back once the
+    // contention policy has waited. Only end locks may be held besides, and those come before any node
+    void BackOff(Contention& backoff, std::unique_lock<QueueMutex>& held, QueueNode* contended) {
+        counters.Count(QueueCounters::tryLockFailures);
+        counters.Count(QueueCounters::retries);
+        if constexpr (Contention::handoff) {
+            // our reference keeps it alive once it is no longer linked behind a lock we hold
+            contended->refs.fetch_add(1, std::memory_order_relaxed);
+            held.unlock();
+            // holding no node we may wait on any of them
+            contended->m.lock();
+            contended->m.unlock();
+            Unref(contended);
+        } else {
+            held.unlock();
+            backoff.Wait();
+        }
+        held.lock();
+    }
+
+    // OPTIMISTIC READERS
+    // lock-free readers may still be looking at a node after it has been unlinked, so retired nodes are only handed
+    // back to the pool after a grace period. Each reader counts itself in one of two counters picked by the parity
+    // of the epoch. The epoch only advances once the counter of the epoch before it has drained, so a node retired
+    // in epoch e can no longer be seen by anyone once the epoch reaches e + 2.
+
+    // enters a read-side critical section, returns the epoch to leave it with
+    std::uint64_t BeginRead() const {
+        LocalReads().push_back(this);
+        while(true) {
+            const std::uint64_t e(epoch.load());
+            readers[e & 1].fetch_add(1);
+            // counted against the wrong epoch if it moved on meanwhile, go again
+            if (epoch.load() == e) return e;
+            Uncount(e);
+        }
+    }
+
+    void EndRead(std::uint64_t e) const {
+        Uncount(e);
+        std::vector<const ReversibleQueue*>& reads(LocalReads());
+        const auto found(std::find(reads.rbegin(), reads.rend(), this));
+        if (found != reads.rend()) reads.erase(std::next(found).base());
+    }
+
+    // the queues the calling thread has reads open on, once per read, so WaitForReaders can refuse to wait on itself
+    static std::vector<const ReversibleQueue*>& LocalReads() {
+        thread_local std::vector<const ReversibleQueue*> reads;
+        return reads;
+    }
+
+    bool ReadingHere() const {
+        const std::vector<const ReversibleQueue*>& reads(LocalReads());
+        return std::find(reads.begin(), reads.end(), this) != reads.end();
+    }
+
+    // visits each node from the back to the front without taking any locks, the caller holds a ReadGuard
+    // a node unlinked before we get to it is skipped by resuming from the last one visited, if that has gone too
+    // or SplitAt cut the queue meanwhile onRestart is called and the walk starts over from the back. Returns the
+    // number of restarts
+    template<class Visit, class OnRestart>
+    std::size_t Walk(Visit visit, OnRestart onRestart) const {
+        // popped data may be moved out, so readers only work on types that can be copied out instead
+        static_assert(std::is_copy_constructible<T>::value, "optimistic reads need copy constructible data");
+        const bool dir(direction.load());
+        std::size_t restarts(0);
+        std::uint64_t splitsSeen(splits.load(std::memory_order_acquire));
+        QueueNode* previous(nullptr);
+        QueueNode* node(ends[EndSide(false, dir)].load(std::memory_order_acquire));
+        while (node) {
+            QueueNode* const nextNode(node->GetInfront(dir));
+            bool atFront;
+            if (!nextNode) {
+                // node was unlinked before we got to it
+                QueueNode* const resume(previous ? previous->GetInfront(dir) : nullptr);
+                // the last item visited is the front by now
+                atFront = previous && resume == previous;
+                if (resume && !atFront) {
+                    node = resume;
+                    continue;
+                }
+            } else {
+                visit(static_cast<const QueueNode*>(node));
+                atFront = nextNode == node;
+                if (!atFront) {
+                    previous = node;
+                    node = nextNode;
+                    continue;
+                }
+            }
+            // a split under way when we started, or since, may have made the front of the part it cut off look like
+            // ours, leaving the items in front of it unseen
+            if (atFront && !(splitsSeen & 1) && splits.load(std::memory_order_acquire) == splitsSeen) break;
+            restarts++;
+            onRestart();
+            previous = nullptr;
+            splitsSeen = splits.load(std::memory_order_acquire);
+            node = ends[EndSide(false, dir)].load(std::memory_order_acquire);
+        }
+        return restarts;
+    }
+
+#if defined(__cpp_impl_coroutine)
+    // parks on one of the queue's waiter lists until Try succeeds, the awaiting coroutine resumes on executor
+    template<class Derived, class Executor>
+    class Awaiter : private PopWaiters::Parked {
+    public:
+        Awaiter(PopWaiters& waiters, Executor& executor) : Parked{&Wake}, waiters(waiters), executor(executor) {}
+
+        Awaiter(const Awaiter&) = delete;
+        Awaiter& operator=(const Awaiter&) = delete;
+
+        bool await_suspend(std::coroutine_handle<> awaiting) {
+            handle = awaiting;
+            return Attempt();
+        }
+
+    private:
+        // true once parked, false once done, after which the coroutine is to go on
+        bool Attempt() {
+            Derived& self(static_cast<Derived&>(*this));
+            while (true) {
+                const std::uint64_t seen(waiters.Enter());
+                if (self.Try()) {
+                    waiters.Leave();
+                    return false;
+                }
+                if (waiters.Park(*this, seen)) return true;
+                if (waiters.Closed()) {
+                    // one last look, there is nothing more to wait for
+                    self.Try();
+                    return false;
+                }
+            }
+        }
+
+        // parked is not touched after being woken, until the coroutine resumes it belongs to executor's task
+        static void Wake(Parked* parked) {
+            Awaiter* const awaiter(static_cast<Awaiter*>(parked));
+            awaiter->executor.Post([awaiter] {
+                if (!awaiter->Attempt()) awaiter->handle.resume();
+            });
+        }
+
+        PopWaiters& waiters;
+        Executor& executor;
+        std::coroutine_handle<> handle;
+    };
+
+    template<class Executor>
+    class PopAwaiter : public Awaiter<PopAwaiter<Executor>, Executor> {
+    public:
+        PopAwaiter(ReversibleQueue& queue, bool atFront, Executor& executor)
+            : Awaiter<PopAwaiter, Executor>(queue.waiters, executor), queue(queue), atFront(atFront) {}
+
+        bool await_ready() {
+            return Try() || queue.waiters.Closed();
+        }
+
+        std::optional<T> await_resume() {
+            return std::move(item);
+        }
+
+        bool Try() {
+            item = queue.PopOptional(atFront);
+            return item.has_value();
+        }
+
+    private:
+        ReversibleQueue& queue;
+        const bool atFront;
+        std::optional<T> item;
+    };
+
+    template<class Executor>
+    class PushAwaiter : public Awaiter<PushAwaiter<Executor>, Executor> {
+    public:
+        PushAwaiter(ReversibleQueue& queue, bool atFront, T&& item, Executor& executor, std::size_t capacity)
+            : Awaiter<PushAwaiter, Executor>(queue.room, executor), queue(queue), atFront(atFront),
+              item(std::move(item)), capacity(capacity) {}
+
+        bool await_ready() {
+            return Try();
+        }
+
+        void await_resume() {}
+
+        bool Try() {
+            if (queue.Size() >= capacity) return false;
+            atFront ? queue.PushFront(std::move(item)) : queue.PushBack(std::move(item));
+            return true;
+        }
+
+    private:
+        ReversibleQueue& queue;
+        const bool atFront;
+        T item;
+        const std::size_t capacity;
+    };
+#endif
+
+    // every node from the back to the front, each exactly once, the caller holds a ReadGuard
+    std::vector<const QueueNode*> Gather() const {
+        std::vector<const QueueNode*> nodes;
+        nodes.reserve(Size());
+        Walk([&nodes](const QueueNode* node) { nodes.push_back(node); }, [&nodes] { nodes.clear(); });
+        return nodes;
+    }
+
+    static constexpr char serialTag[4] = {'R', 'Q', 'S', '1'};
+
+    void DeserializeFrom(ByteReader& reader) {
+        char tag[sizeof(serialTag)];
+        std::uint64_t remaining;
+        reader.Get(tag, sizeof(tag));
+        if (!std::equal(tag, tag + sizeof(tag), serialTag)) throw std::runtime_error("not a serialized queue");
+        reader.Get(&remaining, sizeof(remaining));
+        // pushed at the front item by item, the first item read ends up innermost
+        const bool outwardIsRight(EndSide(true, direction.load(std::memory_order_relaxed)) == right);
+        std::size_t count(0);
+        const std::pair<QueueNode*, QueueNode*> chain(LinkChain([&reader, &remaining]() -> QueueNode* {
+            if (remaining == 0) return nullptr;
+            remaining--;
+            return NewNode(Serializer<T>::Read(reader));
+        }, outwardIsRight, count));
+        PushChain(true, chain, outwardIsRight, count);
+    }
+
+    // a few chunks per thread so one slow thread does not hold up the rest, never an empty chunk
+    static std::size_t Chunks(std::size_t items, std::size_t concurrency) {
+        return std::min(items, concurrency * 4);
+    }
+
+    static std::size_t ChunkStart(std::size_t items, std::size_t chunks, std::size_t chunk) {
+        return items * chunk / chunks;
+    }
+
+    struct ReadGuard {
+        explicit ReadGuard(const ReversibleQueue& q) : queue(q), e(q.BeginRead()) {}
+        ~ReadGuard() { queue.EndRead(e); }
+        const ReversibleQueue& queue;
+        const std::uint64_t e;
+    };
+
+    // whether a reader may have reached a node unlinked before this call
+    // read-modify-writes rather than loads: either they see the reader's count, or the reader comes after them
+    // and is then guaranteed to see the unlink
+    bool ReadersActive() const {
+        return readers[0].fetch_add(0) + readers[1].fetch_add(0) != 0;
+    }
+
+    // hands the data of an unlinked node to sink, moved out unless a reader could still be looking at it
+    template<class Sink>
+    void TakeData(QueueNode* node, Sink sink) const {
+        if constexpr (std::is_copy_constructible<T>::value) {
+            if (ReadersActive()) {
+                sink(static_cast<const T&>(node->data));
+                return;
+            }
+        }
+        sink(std::move(node->data));
+    }
+
+    // frees an unlinked node nobody references any more, as soon as no reader can still reach it
+    void Retire(QueueNode* node) {
+        if (!ReadersActive()) {
+            NodePool::Destroy(node);
+            return;
+        }
+        std::lock_guard<std::mutex> retiredLock(retiredMutex);
+        retired.push_back(Retired{node, epoch.load()});
+        // counted before looking at the readers, so a reader leaving after our look is sure to see it
+        pendingRetired.store(retired.size());
+        Reclaim();
+    }
+
+    // the last reader out frees what waited on it, otherwise retired nodes would linger until the next Retire
+    void Uncount(std::uint64_t e) const {
+        if (readers[e & 1].fetch_sub(1) == 1 && pendingRetired.load() != 0) {
+            std::lock_guard<std::mutex> retiredLock(retiredMutex);
+            Reclaim();
+        }
+    }
+
+    // advances the epoch as far as the readers let us and frees the retired nodes nobody can see any more
+    // the retired lock is held
+    void Reclaim() const {
+        std::uint64_t e(epoch.load());
+        // the counter of the epoch before is the next one's too
+        for (int i = 0; i < 2 && readers[(e + 1) & 1].load() == 0; i++) {
+            epoch.store(++e);
+        }
+        auto stillVisible = [e](const Retired& dead) {
+            return dead.epoch + 2 > e;
+        };
+        auto freeFrom = std::partition(retired.begin(), retired.end(), stillVisible);
+        for (auto dead = freeFrom; dead != retired.end(); ++dead) NodePool::Destroy(dead->node);
+        retired.erase(freeFrom, retired.end());
+        pendingRetired.store(retired.size());
+    }
+
+    // blocks until no reader can still reach a node unlinked before this call, open snapshots included
+    void WaitForReaders() {
+        if (!ReadersActive()) return;
+        std::uint64_t target;
+        {
+            std::lock_guard<std::mutex> retiredLock(retiredMutex);
+            target = epoch.load() + 2;
+        }
+        while (true) {
+            {
+                std::lock_guard<std::mutex> retiredLock(retiredMutex);
+                std::uint64_t e(epoch.load());
+                for (int i = 0; i < 2 && e < target && readers[(e + 1) & 1].load() == 0; i++) {
+                    epoch.store(++e);
+                }
+                if (e >= target) return;
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    // physical sides of the queue, used to index ends and endLocks
+    static const int left = 0;
+    static const int right = 1;
+
+    // the physical side holding the front (atFront) or back of the queue in the given direction
+    static int EndSide(bool atFront, bool dir) {
+        return (atFront == dir) ? right : left;
+    }
+
+    // locks the front (atFront) or back end of the queue, reporting which physical side that is
+    std::unique_lock<QueueMutex> LockEnd(bool atFront, int& side) const {
+        while(true) {
+            const bool dir(direction.load(std::memory_order_relaxed));
+            side = EndSide(atFront, dir);
+            std::unique_lock<QueueMutex> endLock(endLocks[side]);
+            // reverse() holds both ends, so the direction is settled once we hold either
+            if (direction.load(std::memory_order_relaxed) == dir) return endLock;
+            counters.Count(QueueCounters::retries);
+        }
+    }
+
+    // returns a cursor on the front (atFront) or back node
+    Cursor End(bool atFront) {
+        int side;
+        std::unique_lock<QueueMutex> endLock(LockEnd(atFront, side));
+        QueueNode* const endNode(ends[side].load(std::memory_order_relaxed));
+        if(!endNode) throw std::domain_error("queue empty");
+        endNode->refs.fetch_add(1, std::memory_order_relaxed);
+        endNode->m.lock();
+        // the observer walks in the direction the queue has right now, even if it is reversed under it
+        return Cursor(this, endNode, direction.load(std::memory_order_relaxed));
+    }
+
+    // links up new nodes for [first, last) into a private chain that runs outwards from the first item to the last
+    // in the chain's own terms infront is outwards, which is physically right when outwardIsRight
+    // returns the innermost and outermost nodes, both nullptr for an empty range, and counts them into count
+    template<class InputIt>
+    static std::pair<QueueNode*, QueueNode*> MakeChain(InputIt first, InputIt last, bool outwardIsRight,
+                                                   std::size_t& count) {
+        return LinkChain([&first, &last]() -> QueueNode* { return first == last ? nullptr : NewNode(*first++); },
+                         outwardIsRight, count);
+    }
+
+    // the same for whatever nodes make returns, until it returns nullptr
+    template<class Make>
+    static std::pair<QueueNode*, QueueNode*> LinkChain(Make make, bool outwardIsRight, std::size_t& count) {
+        QueueNode* inner(nullptr);
+        QueueNode* outer(nullptr);
+        try {
+            while (QueueNode* const newNode = make()) {
+                if (!outer) {
+                    inner = newNode;
+                    newNode->SetBehind(newNode, outwardIsRight);
+                } else {
+                    outer->SetInfront(newNode, outwardIsRight);
+                    newNode->SetBehind(outer, outwardIsRight);
+                }
+                newNode->SetInfront(newNode, outwardIsRight);
+                outer = newNode;
+                count++;
+            }
+        }
+        catch (...) {
+            DestroyChain(inner, outwardIsRight);
+            throw;
+        }
+        return std::make_pair(inner, outer);
+    }
+
+    // frees every node of a private chain from inner outwards
+    static void DestroyChain(QueueNode* node, bool outwardIsRight) {
+        while (node) {
+            QueueNode* const outerNode(node->GetInfront(outwardIsRight));
+            NodePool::Destroy(node);
+            node = (outerNode == node) ? nullptr : outerNode;
+        }
+    }
+
+    // mirrors a private chain so that it runs outwards the other way physically
+    static void MirrorChain(QueueNode* node, bool outwardIsRight) {
+        while (true) {
+            QueueNode* const outerNode(node->GetInfront(outwardIsRight));
+            node->SwapSides();
+            if (outerNode == node) return;
+            node = outerNode;
+        }
+    }
+
+    template<class InputIt>
+    void PushRange(bool atFront, InputIt first, InputIt last) {
+        // guess which way the end we are heading for faces, it is checked again once we hold it
+        const bool outwardIsRight(EndSide(atFront, direction.load(std::memory_order_relaxed)) == right);
+        std::size_t count(0);
+        const std::pair<QueueNode*, QueueNode*> chain(MakeChain(first, last, outwardIsRight, count));
+        PushChain(atFront, chain, outwardIsRight, count);
+    }
+
+    // splices in a chain of count nodes and wakes consumers, nothing to do for an empty chain
+    void PushChain(bool atFront, const std::pair<QueueNode*, QueueNode*>& chain, bool outwardIsRight,
+                   std::size_t count) {
+        if (!chain.first) return;
+        SpliceChain(atFront, chain.first, chain.second, outwardIsRight, count);
+        waiters.Notify(true);
+    }
+
+    // takes every node of other as a chain and links it in at the front (atFront) or back
+    void Splice(bool atFront, ReversibleQueue& other) {
+        if (&other == this) throw std::logic_error("cannot splice a queue into itself");
+        const bool otherDir(other.direction.load(std::memory_order_relaxed));
+        QueueNode* const otherFront(other.ends[EndSide(true, otherDir)].load(std::memory_order_relaxed));
+        QueueNode* const otherBack(other.ends[EndSide(false, otherDir)].load(std::memory_order_relaxed));
+        if (!otherFront) return;
+        const std::size_t count(other.counters.Length());
+        other.ends[left].store(nullptr, std::memory_order_relaxed);
+        other.ends[right].store(nullptr, std::memory_order_relaxed);
+        other.counters.Shrink(count);
+        other.counters.Count(QueueCounters::pops, count);
+        // saves the nodes kept from other's snapshots must be older than anything ours can read
+        versions.Follow(other.versions);
+        // the chain runs outwards from the end of other that meets ours, so from its back when going in at the front
+        if (atFront) {
+            SpliceChain(true, otherBack, otherFront, otherDir, count, &other.index);
+        } else {
+            SpliceChain(false, otherFront, otherBack, !otherDir, count, &other.index);
+        }
+        waiters.Notify(true);
+    }
+
+    // moves every node behind the cursor's node into the new and empty queue into, see SplitAt
+    void SplitBehind(Cursor& cursor, ReversibleQueue& into) {
+        if (!cursor || cursor.queue != this) throw std::logic_error("cursor not currently observing the queue");
+        if (ReadingHere()) throw std::logic_error("cannot split a queue this thread has a snapshot or reader open on");
+        QueueNode* const node(cursor.node);
+        std::size_t count(0);
+        {
+            // end locks come before node locks, so let go of the observed node while taking the back
+            cursor.lock.unlock();
+            int side;
+            std::unique_lock<QueueMutex> endLock(LockEnd(false, side));
+            cursor.lock.lock();
+            if (!node->GetInfront(true)) throw std::logic_error("observed node is erased");
+            // holding an end the direction is settled
+            const bool dir(direction.load(std::memory_order_relaxed));
+            into.direction.store(dir, std::memory_order_relaxed);
+
+            QueueNode* behindNode;
+            std::unique_lock<QueueMutex> behindLock;
+            Contention backoff;
+            while (true) {
+                behindNode = node->GetBehind(dir);
+                // already the back, nothing to move
+                if (behindNode == node) return;
+                // lock the behind neighbour, only allowed to wait on it when it is to our left
+                behindLock = std::unique_lock<QueueMutex>(behindNode->m, std::defer_lock);
+                if (side == left) {
+                    behindLock.lock();
+                    break;
+                }
+                if (behindLock.try_lock()) break;
+                BackOff(backoff, cursor.lock, behindNode);
+                if (!node->GetInfront(true)) throw std::logic_error("observed node is erased");
+            }
+
+            // nobody is behind us, so the rest of the part we cut off needs no locks
+            QueueNode* const backNode(ends[side].load(std::memory_order_relaxed));
+            splits.fetch_add(1);
+            {
+                Change change(*this);
+                change.Save(node);
+                change.Save(behindNode);
+                change.SaveEnd(side);
+                node->SetBehind(node, dir);
+                behindNode->SetInfront(behindNode, dir);
+                ends[side].store(node, std::memory_order_release);
+            }
+            splits.fetch_add(1, std::memory_order_release);
+            into.ends[side].store(backNode, std::memory_order_relaxed);
+            into.ends[side == left ? right : left].store(behindNode, std::memory_order_relaxed);
+            if constexpr (Index::ordered) count = index.Cut(node, side, into.index);
+        }
+        if constexpr (!Index::ordered) {
+            for (QueueNode* moved = into.ends[left].load(std::memory_order_relaxed); ; ) {
+                count++;
+                QueueNode* const rightNode(moved->GetInfront(true));
+                if (rightNode == moved) break;
+                moved = rightNode;
+            }
+        }
+        counters.Shrink(count);
+        counters.Count(QueueCounters::pops, count);
+        into.counters.Grow(count);
+        into.counters.Count(QueueCounters::pushes, count);
+        // the cut is made, so the node can be let go of while waiting: a reader may be blocked on it, and a producer
+        // woken below may run here and push next to it
+        cursor.lock.unlock();
+        room.Notify(true);
+        // our readers may still be among the moved nodes, which into would otherwise be free to retire under them
+        WaitForReaders();
+        // saves made while the nodes were ours are from generations into has not reached yet
+        into.versions.Follow(versions);
+        cursor.lock.lock();
+    }
+
+    // links a single new node in at the front (atFront) or back
+    void PushNode(bool atFront, QueueNode* newNode) {
+        // pointing to itself on both sides a lone node faces either way
+        newNode->SetInfront(newNode, true);
+        newNode->SetBehind(newNode, true);
+        SpliceChain(atFront, newNode, newNode, true, 1);
+        waiters.Notify(false);
+    }
+
+    // links a private chain of count nodes built by MakeChain in at the front (atFront) or back
+    // chainIndex holds the chain's nodes if they are indexed already, otherwise they are indexed one by one
+    void SpliceChain(bool atFront, QueueNode* inner, QueueNode* outer, bool outwardIsRight, std::size_t count,
+                     Index* chainIndex = nullptr) {
+        while(true) {
+            int side;
+            std::unique_lock<QueueMutex> endLock(LockEnd(atFront, side));
+            QueueNode* const endNode(ends[side].load(std::memory_order_relaxed));
+
+            // is list empty? then the chain spans both ends and we need to hold both
+            if(!endNode) {
+                endLock.unlock();
+                std::lock_guard<QueueMutex> leftLock(endLocks[left]);
+                std::lock_guard<QueueMutex> rightLock(endLocks[right]);
+                // someone filled it while we were swapping locks
+                if(ends[left].load(std::memory_order_relaxed)) {
+                    counters.Count(QueueCounters::retries);
+                    continue;
+                }
+                counters.Grow(count);
+                counters.Count(QueueCounters::pushes, count);
+                // the innermost node already points to itself to signify the other end of the list
+                Change change(*this);
+                change.SaveEnd(left);
+                change.SaveEnd(right);
+                // facing the wrong way? with nothing to line up with, turn the empty queue round instead of the chain
+                if ((side == right) != outwardIsRight) {
+                    change.SaveDirection();
+                    direction.store(!direction.load(std::memory_order_relaxed), std::memory_order_release);
+                    side = (side == left) ? right : left;
+                }
+                ends[side].store(outer, std::memory_order_release);
+                ends[side == left ? right : left].store(inner, std::memory_order_release);
+                IndexChain(inner, outwardIsRight, side, chainIndex);
+                return;
+            }
+
+            // reversed since we built the chain? very rare so just turn it around
+            if ((side == right) != outwardIsRight) {
+                MirrorChain(inner, outwardIsRight);
+                if (chainIndex) chainIndex->Mirror();
+                outwardIsRight = !outwardIsRight;
+            }
+
+            // acquire low level mutex for old end elem as is written
+            // the chain is only reachable through it, so its nodes need no locks of their own
+            std::lock_guard<QueueMutex> oldEndLock(endNode->m);
+            counters.Grow(count);
+            counters.Count(QueueCounters::pushes, count);
+            inner->SetBehind(endNode, outwardIsRight);
+            Change change(*this);
+            change.Save(endNode);
+            change.SaveEnd(side);
+            endNode->SetInfront(inner, outwardIsRight);
+            ends[side].store(outer, std::memory_order_release);
+            IndexChain(inner, outwardIsRight, side, chainIndex);
+            return;
+        }
+    }
+
+    // adds a newly linked chain to the index, from inner outwards so each node goes on the end after the last
+    // or all at once if the chain brings an index of its own
+    void IndexChain(QueueNode* node, bool outwardIsRight, int side, Index* chainIndex) {
+        if constexpr (Index::ordered) {
+            if (chainIndex) {
+                index.Join(*chainIndex, side);
+                return;
+            }
+            while (true) {
+                index.InsertAtEnd(node, side);
+                QueueNode* const outerNode(node->GetInfront(outwardIsRight));
+                if (outerNode == node) return;
+                node = outerNode;
+            }
+        }
+    }
+
+    // returns a cursor on the item k places in from the front (atFront) or back
+    Cursor Seek(bool atFront, std::size_t k) {
+        if constexpr (Index::ordered) {
+            while (true) {
+                const bool dir(direction.load(std::memory_order_relaxed));
+                // still indexed means still linked, so safe to take a reference to
+                auto pin = [](typename Index::Hook* hook) {
+                    static_cast<QueueNode*>(hook)->refs.fetch_add(1, std::memory_order_relaxed);
+                };
+                QueueNode* const node(static_cast<QueueNode*>(index.At(k, EndSide(atFront, dir), pin)));
+                if (!node) throw std::domain_error("cannot seek past the end of the queue");
+                node->m.lock();
+                if (node->GetInfront(true)) return Cursor(this, node, dir);
+                // erased between finding and locking it, look again
+                node->m.unlock();
+                Unref(node);
+                counters.Count(QueueCounters::retries);
+            }
+        } else {
+            // no index, so walk there
+            Cursor cursor(End(atFront));
+            for (std::size_t i = 0; i < k; i++) {
+                if (!(atFront ? cursor.Retreat() : cursor.Advance())) {
+                    throw std::domain_error("cannot seek past the end of the queue");
+                }
+            }
+            return cursor;
+        }
+    }
+
+    struct Popped {
+        // the unlinked node, still carrying the queue's reference, or nullptr if nothing was popped
+        QueueNode* node;
+        // the queue changed while we were swapping end locks, so the caller has to decide again
+        bool retry;
+    };
+
+    // unlinks the node at the given physical side, endLock holds that side's end mutex
+    // with expected set only that node is popped
+    Popped TryPopEnd(int side, std::unique_lock<QueueMutex>& endLock, const QueueNode* expected) {
+        // the direction cannot change while we hold an end
+        const bool dir(direction.load(std::memory_order_relaxed));
+        QueueNode* const endNode(ends[side].load(std::memory_order_relaxed));
+        // empty list
+        if (!endNode || (expected && endNode != expected)) return Popped{nullptr, false};
+
+        const bool atFront(side == EndSide(true, dir));
+        // heading inwards from the right end is moving left which we are always allowed to wait on
+        const bool inwardIsRight(side == left);
+
+        // This function may require a locking attempt loop if the inward neighbour is to the right,
+        // we are making the locking attempt on right neighbours weak in order to remove deadlock states
+        std::unique_lock<QueueMutex> eraseLock(endNode->m);
+        Contention backoff;
+        while(true) {
+            QueueNode* innerNode(atFront ? endNode->GetBehind(dir) : endNode->GetInfront(dir));
+
+            // single item in list? both ends change so we must hold both of them
+            if (innerNode == endNode) {
+                eraseLock.unlock();
+                endLock.unlock();
+                std::unique_lock<QueueMutex> leftLock(endLocks[left]);
+                std::unique_lock<QueueMutex> rightLock(endLocks[right]);
+                if (ends[side].load(std::memory_order_relaxed) != endNode ||
+                    ends[left].load(std::memory_order_relaxed) != ends[right].load(std::memory_order_relaxed)) {
+                    return Popped{nullptr, true};
+                }
+                // safe to burn the references
+                eraseLock.lock();
+                Change change(*this);
+                change.SaveEnd(left);
+                change.SaveEnd(right);
+                change.Save(endNode);
+                ends[left].store(nullptr, std::memory_order_release);
+                ends[right].store(nullptr, std::memory_order_release);
+                endNode->SetBehind(nullptr, dir);
+                endNode->SetInfront(nullptr, dir);
+                index.Erase(endNode);
+                counters.Shrink(1);
+                return Popped{endNode, false};
+            }
+
+            // otherwise, attempt to lock the inward neighbour
+            std::unique_lock<QueueMutex> innerLock(innerNode->m, std::defer_lock);
+            if (!inwardIsRight) {
+                innerLock.lock();
+            }
+            else if (!innerLock.try_lock()) {
+                // if we fail to lock the inward lock, unlock everything and try again
+                BackOff(backoff, eraseLock, innerNode);
+                continue;
+            }
+
+            // we have all the necessary locks, so modify data
+            // innerNode becomes the new end so points to itself, before endNode is marked dead so that a reader
+            // finding it dead and stepping back to innerNode cannot be sent to it again
+            Change change(*this);
+            change.Save(innerNode);
+            change.SaveEnd(side);
+            change.Save(endNode);
+            atFront ? innerNode->SetInfront(innerNode, dir) : innerNode->SetBehind(innerNode, dir);
+            ends[side].store(innerNode, std::memory_order_release);
+            endNode->SetInfront(nullptr, dir);
+            endNode->SetBehind(nullptr, dir);
+            index.Erase(endNode);
+            counters.Shrink(1);
+
+            // we done, so leave loop
+            return Popped{endNode, false};
+        }
+    }
+
+    // unlinks the front (atFront) or back node, returns nullptr if the queue is empty
+    QueueNode* PopEnd(bool atFront) {
+        while(true) {
+            int side;
+            std::unique_lock<QueueMutex> endLock(LockEnd(atFront, side));
+            const Popped popped(TryPopEnd(side, endLock, nullptr));
+            if (!popped.retry) {
+                if (!popped.node) return nullptr;
+                counters.Count(QueueCounters::pops);
+                if (endLock.owns_lock()) endLock.unlock();
+                room.Notify(false);
+                return popped.node;
+            }
+            counters.Count(QueueCounters::retries);
+        }
+    }
+
+    std::optional<T> PopOptional(bool atFront) {
+        QueueNode* popped(PopEnd(atFront));
+        if (!popped) return std::nullopt;
+        std::optional<T> item;
+        TakeData(popped, [&item](auto&& data) { item.emplace(std::forward<decltype(data)>(data)); });
+        Unref(popped);
+        return item;
+    }
+
+    bool PopInto(bool atFront, T& item) {
+        QueueNode* popped(PopEnd(atFront));
+        if (!popped) return false;
+        TakeData(popped, [&item](auto&& data) { item = std::forward<decltype(data)>(data); });
+        Unref(popped);
+        return true;
+    }
+
+    // pops up to n nodes from the front (atFront) or back while holding that end, moving their data into out
+    template<class OutputIt>
+    std::size_t PopRun(bool atFront, std::size_t n, OutputIt& out) {
+        std::size_t count(0);
+        while (count < n) {
+            int side;
+            std::unique_lock<QueueMutex> endLock(LockEnd(atFront, side));
+            while (count < n) {
+                const Popped popped(TryPopEnd(side, endLock, nullptr));
+                // lost our end swapping locks, take it again
+                if (popped.retry) {
+                    counters.Count(QueueCounters::retries);
+                    break;
+                }
+                // empty list
+                if (!popped.node) return count;
+                counters.Count(QueueCounters::pops);
+
+                TakeData(popped.node, [&out](auto&& data) { *out = std::forward<decltype(data)>(data); });
+                ++out;
+                Unref(popped.node);
+                count++;
+                // that was the last node, which hands our end back
+                if (!endLock.owns_lock()) break;
+            }
+        }
+        return count;
+    }
+
+    // pops node if it is still the end of the queue in front of it in the given observer direction
+    // returns false if the queue has grown past node in the meantime
+    bool EraseEnd(QueueNode* node, bool observerDirection) {
+        // the queue may have been reversed since the observer entered, but the physical side is the same
+        const int side(observerDirection ? right : left);
+        while(true) {
+            std::unique_lock<QueueMutex> endLock(endLocks[side]);
+            const Popped popped(TryPopEnd(side, endLock, node));
+            if (popped.retry) {
+                counters.Count(QueueCounters::retries);
+                continue;
+            }
+            if (popped.node) {
+                counters.Count(QueueCounters::erases);
+                Unref(popped.node);
+                if (endLock.owns_lock()) endLock.unlock();
+                room.Notify(false);
+                return true;
+            }
+            break;
+        }
+        // already popped by someone else? the erase has happened either way
+        std::lock_guard<QueueMutex> nodeLock(node->m);
+        return !node->GetInfront(true);
+    }
+
+    // pointers to the leftmost and rightmost nodes, written under the matching end lock
+    std::atomic<QueueNode*> ends[2];
+    mutable QueueMutex endLocks[2];
+
+    // stores the location in the queue each thread is currently holding
+    // this ensures that a thread will maintain ownership of a node while "inside" the queue
+    // this allows forward queue traversal of any number of threads.
+    mutable ObserverTable<Cursor> threadLocator;
+
+    // enforces the entry side and direction of list traversing
+    // true: front = right; false: front = left
+    // only changes while both end locks are held, so reading it under either end lock is stable
+    std::atomic<bool> direction;
+
+    // consumers waiting for the queue to fill
+    PopWaiters waiters;
+
+    // coroutines waiting to push into a queue at capacity, woken whenever an item leaves
+    PopWaiters room;
+
+    // length and statistics
+    mutable QueueCounters counters;
+
+    // positions of the nodes, for seeking
+    Index index;
+
+    // generations and what changed in them, for snapshots
+    Versioning versions;
+    typename Versioning::template History<QueueNode*> endHistory[2];
+    typename Versioning::template History<bool> directionHistory;
+
+    // grace periods for optimistic readers, see BeginRead
+    mutable std::atomic<std::uint64_t> epoch;
+    mutable std::atomic<long> readers[2];
+
+    // bumped before and after SplitAt cuts the queue, odd while it does, see Walk
+    std::atomic<std::uint64_t> splits;
+
+    struct Retired {
+        QueueNode* node;
+        std::uint64_t epoch;
+    };
+    // freed by whichever reader or writer finds their grace period over, readers being const
+    mutable std::mutex retiredMutex;
+    mutable std::vector<Retired> retired;
+    // retired.size(), for readers to skip the lock when there is nothing to free
+    mutable std::atomic<std::size_t> pendingRetired;
+};
+
+// SCAN KERNELS
+// reductions over a contiguous run of one arithmetic type, for column scans
+
+// the type column sums are accumulated in, wide enough that summing a block of narrow values cannot overflow
+template<class F>
+using ColumnSumType = std::conditional_t<std::is_floating_point<F>::value, double,
+                                         std::conditional_t<std::is_signed<F>::value, std::int64_t, std::uint64_t>>;
+
+// plain loops, which the compiler is free to vectorise for whatever it is targeting
+// Min and Max need at least one value
+template<class F>
+struct ScanKernels {
+    static ColumnSumType<F> Sum(const F* values, std::size_t n) {
+        ColumnSumType<F> sum(0);
+        for (std::size_t i = 0; i < n; i++) sum += values[i];
+        return sum;
+    }
+
+    static F Min(const F* values, std::size_t n) {
+        return *std::min_element(values, values + n);
+    }
+
+    static F Max(const F* values, std::size_t n) {
+        return *std::max_element(values, values + n);
+    }
+};
+
+#if defined(__GNUC__) && defined(__SSE2__)
+// checked once, AVX2 kernels are compiled in regardless of the target and only used where the CPU has it
+inline bool HasAvx2() {
+    static const bool avx2(__builtin_cpu_supports("avx2"));
+    return avx2;
+}
+
+// the common case of summing an int field
+template<>
+struct ScanKernels<std::int32_t> {
+    static std::int64_t Sum(const std::int32_t* values, std::size_t n) {
+        return HasAvx2() ? SumAvx2(values, n) : SumSse2(values, n);
+    }
+
+    static std::int32_t Min(const std::int32_t* values, std::size_t n) {
+        return HasAvx2() ? ExtremeAvx2<false>(values, n) : *std::min_element(values, values + n);
+    }
+
+    static std::int32_t Max(const std::int32_t* values, std::size_t n) {
+        return HasAvx2() ? ExtremeAvx2<true>(values, n) : *std::max_element(values, values + n);
+    }
+
+private:
+    // four values at a time, sign extended to 64 bits by pairing each with its sign
+    static std::int64_t SumSse2(const std::int32_t* values, std::size_t n) {
+        __m128i sum(_mm_setzero_si128());
+        std::size_t i(0);
+        for (; i + 4 <= n; i += 4) {
+            const __m128i v(_mm_loadu_si128(reinterpret_cast<const __m128i*>(values + i)));
+            const __m128i sign(_mm_srai_epi32(v, 31));
+            sum = _mm_add_epi64(sum, _mm_unpacklo_epi32(v, sign));
+            sum = _mm_add_epi64(sum, _mm_unpackhi_epi32(v, sign));
+        }
+        alignas(16) std::int64_t lanes[2];
+        _mm_store_si128(reinterpret_cast<__m128i*>(lanes), sum);
+        std::int64_t total(lanes[0] + lanes[1]);
+        for (; i < n; i++) total += values[i];
+        return total;
+    }
+
+    __attribute__((target("avx2")))
+    static std::int64_t SumAvx2(const std::int32_t* values, std::size_t n) {
+        __m256i sum(_mm256_setzero_si256());
+        std::size_t i(0);
+        for (; i + 8 <= n; i += 8) {
+            const __m256i v(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + i)));
+            sum = _mm256_add_epi64(sum, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v)));
+            sum = _mm256_add_epi64(sum, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1)));
+        }
+        alignas(32) std::int64_t lanes[4];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), sum);
+        std::int64_t total(lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+        for (; i < n; i++) total += values[i];
+        return total;
+    }
+
+    template<bool Max>
+    __attribute__((target("avx2")))
+    static std::int32_t ExtremeAvx2(const std::int32_t* values, std::size_t n) {
+        std::int32_t extreme(values[0]);
+        std::size_t i(0);
+        if (n >= 8) {
+            __m256i acc(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(values)));
+            for (i = 8; i + 8 <= n; i += 8) {
+                const __m256i v(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + i)));
+                acc = Max ? _mm256_max_epi32(acc, v) : _mm256_min_epi32(acc, v);
+            }
+            alignas(32) std::int32_t lanes[8];
+            _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), acc);
+            extreme = Max ? *std::max_element(lanes, lanes + 8) : *std::min_element(lanes, lanes + 8);
+        }
+        for (; i < n; i++) extreme = Max ? std::max(extreme, values[i]) : std::min(extreme, values[i]);
+        return extreme;
+    }
+};
+
+// the common case of summing a floating point field, the lanes add up in a different order to a plain loop
+template<>
+struct ScanKernels<double> {
+    static double Sum(const double* values, std::size_t n) {
+        __m128d sum(_mm_setzero_pd());
+        std::size_t i(0);
+        for (; i + 2 <= n; i += 2) sum = _mm_add_pd(sum, _mm_loadu_pd(values + i));
+        alignas(16) double lanes[2];
+        _mm_store_pd(lanes, sum);
+        double total(lanes[0] + lanes[1]);
+        for (; i < n; i++) total += values[i];
+        return total;
+    }
+
+    static double Min(const double* values, std::size_t n) {
+        return *std::min_element(values, values + n);
+    }
+
+    static double Max(const double* values, std::size_t n) {
+        return *std::max_element(values, values + n);
+    }
+};
+#endif
+
+// COLUMNS
+// policies keeping a copy of some fields of every item in per-block arrays, so scans over a field read contiguous
+// memory rather than stepping over whole items, each provides
+//     template<std::size_t Field> static constexpr bool has
+//     template<class T, std::size_t Capacity> class Store   held by every block, with
+//         void Set(std::size_t slot, const T& item)         item has just been placed in slot
+//         void Move(std::size_t slot, Store& to, std::size_t toSlot)
+//         template<std::size_t Field> const F* Column() const
+// items are never changed in place, so copies taken as they are placed stay right
+
+// no columns, blocks hold the items alone
+struct NoColumns {
+    template<std::size_t Field>
+    static constexpr bool has = false;
+
+    template<class T, std::size_t Capacity>
+    struct Store {
+        void Set(std::size_t, const T&) {}
+        void Move(std::size_t, Store&, std::size_t) {}
+    };
+};
+
+// a column for each of the given fields of a tuple-like item, which must be arithmetic
+template<std::size_t... Fields>
+struct ColumnsOf {
+    template<std::size_t Field>
+    static constexpr bool has = ((Field == Fields) || ...);
+
+    template<class T, std::size_t Capacity>
+    class Store {
+    public:
+        static_assert((std::is_arithmetic<std::tuple_element_t<Fields, T>>::value && ...),
+                      "columns are kept for arithmetic fields");
+
+        void Set(std::size_t slot, const T& item) {
+            ((Column<Fields>()[slot] = std::get<Fields>(item)), ...);
+        }
+
+        void Move(std::size_t slot, Store& to, std::size_t toSlot) {
+            ((to.Column<Fields>()[toSlot] = Column<Fields>()[slot]), ...);
+        }
+
+        template<std::size_t Field>
+        std::remove_cv_t<std::tuple_element_t<Field, T>>* Column() {
+            return std::get<Position<Field>()>(columns).data();
+        }
+
+        template<std::size_t Field>
+        const std::remove_cv_t<std::tuple_element_t<Field, T>>* Column() const {
+            return std::get<Position<Field>()>(columns).data();
+        }
+
+    private:
+        // where Field comes in the list of columns
+        template<std::size_t Field>
+        static constexpr std::size_t Position() {
+            std::size_t position(0);
+            bool found(false);
+            ((found = found || Field == Fields, position += found ? 0 : 1), ...);
+            return position;
+        }
+
+        // aligned for the widest vector loads
+        alignas(32) std::tuple<std::array<std::remove_cv_t<std::tuple_element_t<Fields, T>>, Capacity>...> columns;
+    };
+};
+
+// a run of up to Capacity data items stored contiguously, guarded by a single lock
+// the items occupy slots [begin, end) from physical left to right, leaving room to grow at either side
+// with columns, the chosen fields of each item are copied out alongside it
+template<class T, std::size_t Capacity, class Columns = NoColumns>
+class UnrolledBlock {
+public:
+    explicit UnrolledBlock(std::size_t start = 0) : refs(1), dead(false), begin(start), end(start) {
+        link[0] = nullptr;
+        link[1] = nullptr;
+        RQ_LOCK_ROLE(m, "block");
+    }
+
+    UnrolledBlock(const UnrolledBlock&) = delete;
+    UnrolledBlock& operator=(const UnrolledBlock&) = delete;
+
+    ~UnrolledBlock() {
+        for (std::size_t i = begin; i < end; i++) Item(i)->~T();
+    }
+
+    T* Item(std::size_t slot) {
+        return std::launder(reinterpret_cast<T*>(slots + slot * sizeof(T)));
+    }
+
+    bool Empty() const {
+        return begin == end;
+    }
+
+    bool Full() const {
+        return end - begin == Capacity;
+    }
+
+    // whether an item fits on the given physical side (0 left, 1 right) without moving the others
+    bool HasRoom(int side) const {
+        return side ? end < Capacity : begin > 0;
+    }
+
+    // to be called once an item has been constructed in slot
+    void Placed(std::size_t slot) {
+        columns.Set(slot, *Item(slot));
+    }
+
+    // moves the item in slot into toSlot of block, which may be this one
+    void Relocate(std::size_t slot, UnrolledBlock* block, std::size_t toSlot) {
+        T* const item(Item(slot));
+        new (block->Item(toSlot)) T(std::move(*item));
+        item->~T();
+        columns.Move(slot, block->columns, toSlot);
+    }
+
+    QueueMutex m;
+
+    // one reference for being linked into a queue plus one per cursor standing on or crossing into the block
+    // a dead block also holds one on each of its old neighbours
+    std::atomic<unsigned> refs;
+
+    // set once unlinked, the links then keep pointing at the old neighbours
+    bool dead;
+
+    // neighbours on the physical left [0] and right [1]
+    UnrolledBlock* link[2];
+
+    std::size_t begin;
+    std::size_t end;
+
+    typename Columns::template Store<T, Capacity> columns;
+
+private:
+    alignas(T) unsigned char slots[sizeof(T) * Capacity];
+};
+
+// the same queue stored as a list of blocks of BlockSize items with one lock per block instead of one per item
+// items next to each other are next to each other in memory, so walking the queue streams through it rather than
+// chasing a pointer per item. Blocks already amortise the allocator, so they come straight from the heap by default
+template<class T, std::size_t BlockSize = 64, class NodePool = HeapNodes, class Contention = ExponentialBackoff,
+         class Columns = NoColumns>
+class UnrolledReversibleQueue {
+    // items are shuffled along within blocks and split between them as the queue changes
+    static_assert(std::is_nothrow_move_constructible<T>::value, "unrolled blocks need nothrow movable data");
+    static_assert(BlockSize >= 2, "blocks must be able to split");
+
+    using Block = UnrolledBlock<T, BlockSize, Columns>;
+
+public:
+    UnrolledReversibleQueue() : direction(true) {
+        sentinels[left].link[right] = &sentinels[right];
+        sentinels[right].link[left] = &sentinels[left];
+        RQ_LOCK_ROLE(sentinels[left].m, "end");
+        RQ_LOCK_ROLE(sentinels[right].m, "end");
+    }
+
+    UnrolledReversibleQueue(const UnrolledReversibleQueue&) = delete;
+    UnrolledReversibleQueue& operator=(const UnrolledReversibleQueue&) = delete;
+
+    // no thread may still be observing the queue
+    ~UnrolledReversibleQueue() {
+        Block* block(sentinels[left].link[right]);
+        while (block != &sentinels[right]) {
+            Block* const rightBlock(block->link[right]);
+            NodePool::Destroy(block);
+            block = rightBlock;
+        }
+    }
+
+    // LOCK ORDERING
+    // the queue is bounded by two empty sentinel blocks that are never unlinked, their locks double up as the end
+    // locks. Every lock, sentinel or not, is ordered physically: a thread may BLOCK on a block only if it is to the
+    // left of every block it already holds, anything to the right is try_lock'ed and on failure we back off.
+    // cursors hold the lock of the block their item is in, so only one cursor can be inside a block at a time
+
+    // a position in the queue that owns the lock on the block holding its item
+    // cursors are movable and release their block when destroyed
+    // NOTE: a thread must not walk one of its cursors into a block held by another of its own cursors
+    class Cursor {
+    public:
+        Cursor() : queue(nullptr), block(nullptr), index(0), direction(true) {}
+
+        Cursor(Cursor&& other) noexcept
+            : queue(other.queue), block(other.block), lock(std::move(other.lock)), index(other.index),
+              direction(other.direction) {
+            other.block = nullptr;
+        }
+
+        Cursor& operator=(Cursor&& other) noexcept {
+            if (this != &other) {
+                // drop our block before taking theirs so the lock never outlives its block
+                Release();
+                queue = other.queue;
+                block = other.block;
+                lock = std::move(other.lock);
+                other.block = nullptr;
+                index = other.index;
+                direction = other.direction;
+            }
+            return *this;
+        }
+
+        ~Cursor() { Release(); }
+
+        // true while the cursor holds an item
+        explicit operator bool() const { return block != nullptr; }
+
+        // the observed data item, valid for as long as the cursor stays on it
+        const T& Get() const {
+            if (!block) throw std::logic_error("cursor not currently observing the queue");
+            return *block->Item(index);
+        }
+
+        // unlocks and stops observing an item
+        void Release() {
+            if (lock.owns_lock()) lock.unlock();
+            if (block) Unref(block);
+            block = nullptr;
+        }
+
+        // moves to the item in front, returns false and stays at the front if already there
+        bool Advance() {
+            RQ_LOCK_SITE();
+            return Step(true);
+        }
+
+        // moves to the item behind, returns false and stays at the back if already there
+        bool Retreat() {
+            RQ_LOCK_SITE();
+            return Step(false);
+        }
+
+        // adds a data item behind the observed item
+        void Insert(const T& item) {
+            RQ_LOCK_SITE();
+            Emplace(item);
+        }
+
+        void Insert(T&& item) {
+            RQ_LOCK_SITE();
+            Emplace(std::move(item));
+        }
+
+        // constructs a data item behind the observed item
+        // unlike the linked queue this works at the back too, the back block is only ever changed under its lock
+        template<class... Args>
+        void Emplace(Args&&... args) {
+            RQ_LOCK_SITE();
+            if (!block) throw std::logic_error("cursor not currently observing queue");
+
+            // built up front so a throwing constructor leaves the block untouched
+            T item(std::forward<Args>(args)...);
+
+            // the slot boundary the item goes in at, behind is physically left when the queue runs rightwards
+            std::size_t gap(direction ? index : index + 1);
+            Block* target(block);
+            if (block->Full()) {
+                // split the left half off into a new block, the only other block this touches is our left
+                // neighbour, which we are allowed to wait for
+                Block* const leftBlock(block->link[left]);
+                std::lock_guard<QueueMutex> leftLock(leftBlock->m);
+                Block* const split(NewBlock(BlockSize));
+                std::unique_lock<QueueMutex> splitLock(split->m);
+
+                const std::size_t half(BlockSize / 2);
+                const std::size_t offset(BlockSize - half);
+                for (std::size_t i = 0; i < half; i++) block->Relocate(i, split, offset + i);
+                split->begin = offset;
+                split->end = BlockSize;
+                block->begin = half;
+
+                split->link[left] = leftBlock;
+                split->link[right] = block;
+                leftBlock->link[right] = split;
+                block->link[left] = split;
+
+                if (gap < half) {
+                    target = split;
+                    gap += offset;
+                }
+                if (index < half) {
+                    // our item went with the left half, follow it
+                    split->refs.fetch_add(1, std::memory_order_relaxed);
+                    index += offset;
+                    lock.unlock();
+                    // still linked, so this is never the last reference
+                    Unref(block);
+                    block = split;
+                    lock = std::move(splitLock);
+                }
+            }
+            std::size_t untracked(0);
+            const std::size_t slot(OpenGap(target, gap, target == block ? index : untracked));
+            new (target->Item(slot)) T(std::move(item));
+            target->Placed(slot);
+            queue->counters.Grow(1);
+            queue->counters.Count(QueueCounters::inserts);
+        }
+
+        // erases the observed item and then releases the cursor
+        // unlike the linked queue this works at either end as well
+        void Erase() {
+            RQ_LOCK_SITE();
+            if (!block) throw std::logic_error("cursor not currently observing queue");
+
+            // close the gap from whichever side has fewer items to move
+            block->Item(index)->~T();
+            if (index - block->begin < block->end - index - 1) {
+                for (std::size_t i = index; i > block->begin; i--) block->Relocate(i - 1, block, i);
+                block->begin++;
+            } else {
+                for (std::size_t i = index + 1; i < block->end; i++) block->Relocate(i, block, i - 1);
+                block->end--;
+            }
+            queue->counters.Shrink(1);
+            queue->counters.Count(QueueCounters::erases);
+
+            Block* const erased(block);
+            const bool unlinked(erased->Empty() && queue->TryUnlink(erased));
+            Release();
+            // the queue's reference goes last, after our lock on it
+            if (unlinked) Unref(erased);
+        }
+
+    private:
+        friend class UnrolledReversibleQueue;
+
+        // takes ownership of an already locked and referenced block
+        Cursor(UnrolledReversibleQueue* _queue, Block* _block, std::unique_lock<QueueMutex>&& _lock,
+               std::size_t _index, bool _direction)
+            : queue(_queue), block(_block), lock(std::move(_lock)), index(_index), direction(_direction) {}
+
+        // moves to the neighbouring item in front (forwards) or behind
+        bool Step(bool forwards) {
+            if (!block) throw std::logic_error("cursor not currently observing the queue");
+
+            const int side((forwards == direction) ? right : left);
+            // most steps stay inside the block and need no further locking
+            if (side == right ? index + 1 < block->end : index > block->begin) {
+                side == right ? index++ : index--;
+                return true;
+            }
+            // we are at the end
+            if (queue->IsSentinel(block->link[side])) return false;
+
+            Block* next(queue->CrossToItems(block, lock, side));
+            if (queue->IsSentinel(next)) {
+                queue->counters.Count(QueueCounters::retries);
+                // everything past our item went while we waited for the next block, so settle on whatever is at
+                // that end of the queue now
+                next = queue->CrossToItems(next, lock, Opposite(side));
+                if (queue->IsSentinel(next)) {
+                    // and so did everything else
+                    block = next;
+                    Release();
+                    return false;
+                }
+                block = next;
+                index = side == right ? next->end - 1 : next->begin;
+                return false;
+            }
+            block = next;
+            index = side == right ? next->begin : next->end - 1;
+            return true;
+        }
+
+        UnrolledReversibleQueue* queue;
+        // referenced by the cursor so it outlives the lock
+        Block* block;
+        std::unique_lock<QueueMutex> lock;
+        // slot of the observed item in block
+        std::size_t index;
+        // the cursor keeps walking in the direction the queue had when it entered, even if reversed under it
+        bool direction;
+    };
+
+    // returns a cursor observing the rear of the queue
+    Cursor Back() {
+        RQ_LOCK_SITE();
+        return End(false);
+    }
+
+    // returns a cursor observing the front of the queue
+    Cursor Front() {
+        RQ_LOCK_SITE();
+        return End(true);
+    }
+
+    // returns a cursor observing the item k places in front of the back, SeekFromBack(0) being the back
+    // skips over whole blocks, so it takes O(n / BlockSize) locks to get there
+    Cursor SeekFromBack(std::size_t k) {
+        RQ_LOCK_SITE();
+        return Seek(false, k);
+    }
+
+    // returns a cursor observing the item k places behind the front
+    Cursor SeekFromFront(std::size_t k) {
+        RQ_LOCK_SITE();
+        return Seek(true, k);
+    }
+
+    // adds a data item to the front of the queue
+    void PushFront(const T& item) {
+        RQ_LOCK_SITE();
+        EmplaceFront(item);
+    }
+
+    void PushFront(T&& item) {
+        RQ_LOCK_SITE();
+        EmplaceFront(std::move(item));
+    }
+
+    // adds a data item behind the last item
+    void PushBack(const T& item) {
+        RQ_LOCK_SITE();
+        EmplaceBack(item);
+    }
+
+    void PushBack(T&& item) {
+        RQ_LOCK_SITE();
+        EmplaceBack(std::move(item));
+    }
+
+    // constructs a data item in place at the front of the queue
+    template<class... Args>
+    void EmplaceFront(Args&&... args) {
+        RQ_LOCK_SITE();
+        ArgsSource<Args...> source{std::forward_as_tuple(std::forward<Args>(args)...), false};
+        PushEnd(true, source);
+    }
+
+    // constructs a data item in place behind the last item
+    template<class... Args>
+    void EmplaceBack(Args&&... args) {
+        RQ_LOCK_SITE();
+        ArgsSource<Args...> source{std::forward_as_tuple(std::forward<Args>(args)...), false};
+        PushEnd(false, source);
+    }
+
+    // adds every item in [first, last) to the front in order, as repeated PushFront would
+    // the end is held for the whole range, though should an item throw those before it stay pushed
+    template<class InputIt>
+    void PushFront(InputIt first, InputIt last) {
+        RQ_LOCK_SITE();
+        RangeSource<InputIt> source{first, last};
+        PushEnd(true, source);
+    }
+
+    // adds every item in [first, last) behind the last item in order, as repeated PushBack would
+    template<class InputIt>
+    void PushBack(InputIt first, InputIt last) {
+        RQ_LOCK_SITE();
+        RangeSource<InputIt> source{first, last};
+        PushEnd(false, source);
+    }
+
+    // removes the first data item
+    void PopFront() {
+        RQ_LOCK_SITE();
+        if (!PopEnd(true, 1, [](T&&) {})) throw std::logic_error("cannot pop from empty list");
+    }
+
+    // removes the last data item
+    void PopBack() {
+        RQ_LOCK_SITE();
+        if (!PopEnd(false, 1, [](T&&) {})) throw std::logic_error("cannot pop from empty list");
+    }
+
+    // removes the first data item, moving it into item, returns false if the queue is empty
+    bool TryPopFront(T& item) {
+        RQ_LOCK_SITE();
+        return PopEnd(true, 1, [&item](T&& data) { item = std::move(data); }) != 0;
+    }
+
+    // removes the last data item, moving it into item, returns false if the queue is empty
+    bool TryPopBack(T& item) {
+        RQ_LOCK_SITE();
+        return PopEnd(false, 1, [&item](T&& data) { item = std::move(data); }) != 0;
+    }
+
+    // removes up to n items from the front, moving them into out in the order they are popped
+    // returns how many were removed, fewer than n only if the queue ran empty
+    template<class OutputIt>
+    std::size_t PopFront(std::size_t n, OutputIt out) {
+        RQ_LOCK_SITE();
+        return PopEnd(true, n, [&out](T&& data) { *out = std::move(data); ++out; });
+    }
+
+    // removes up to n items from the back, moving them into out in the order they are popped
+    template<class OutputIt>
+    std::size_t PopBack(std::size_t n, OutputIt out) {
+        RQ_LOCK_SITE();
+        return PopEnd(false, n, [&out](T&& data) { *out = std::move(data); ++out; });
+    }
+
+    // removes the first data item if there is one, never throws for an empty queue
+    std::optional<T> TryPopFront() {
+        RQ_LOCK_SITE();
+        return PopOptional(true);
+    }
+
+    // removes the last data item if there is one
+    std::optional<T> TryPopBack() {
+        RQ_LOCK_SITE();
+        return PopOptional(false);
+    }
+
+    // removes the first data item, waiting for one to be pushed if the queue is empty
+    // returns nothing only once the queue has been closed and is empty
+    std::optional<T> WaitPopFront() {
+        RQ_LOCK_SITE();
+        return waiters.Wait([this] { return TryPopFront(); }, nullptr);
+    }
+
+    // removes the last data item, waiting for one to be pushed if the queue is empty
+    std::optional<T> WaitPopBack() {
+        RQ_LOCK_SITE();
+        return waiters.Wait([this] { return TryPopBack(); }, nullptr);
+    }
+
+    // removes the first data item, waiting at most timeout for one to be pushed
+    template<class Rep, class Period>
+    std::optional<T> TryPopFor(const std::chrono::duration<Rep, Period>& timeout) {
+        RQ_LOCK_SITE();
+        const std::chrono::steady_clock::time_point deadline(std::chrono::steady_clock::now() + timeout);
+        return waiters.Wait([this] { return TryPopFront(); }, &deadline);
+    }
+
+    // removes the last data item, waiting at most timeout for one to be pushed
+    template<class Rep, class Period>
+    std::optional<T> TryPopBackFor(const std::chrono::duration<Rep, Period>& timeout) {
+        RQ_LOCK_SITE();
+        const std::chrono::steady_clock::time_point deadline(std::chrono::steady_clock::now() + timeout);
+        return waiters.Wait([this] { return TryPopBack(); }, &deadline);
+    }
+
+    // wakes every waiting consumer, from now on waits return nothing instead of blocking on an empty queue
+    // pushing is still allowed, the items are there for anyone popping
+    void Close() {
+        waiters.Close();
+    }
+
+    bool Closed() const {
+        return waiters.Closed();
+    }
+
+    // calls fn on each data item from the back to the front
+    // holds one block lock at a time, so writers carry on around the reader and it never has to start over,
+    // always returns 0 restarts
+    template<class Fn>
+    std::size_t ForEachFromBack(Fn fn) const {
+        RQ_LOCK_SITE();
+        ForEachBlock([&fn](Block& block, int towardsFront) {
+            if (towardsFront == right) {
+                for (std::size_t i = block.begin; i < block.end; i++) fn(static_cast<const T&>(*block.Item(i)));
+            } else {
+                for (std::size_t i = block.end; i > block.begin; i--) fn(static_cast<const T&>(*block.Item(i - 1)));
+            }
+        });
+        return 0;
+    }
+
+    // queries over one field of every item, run on the copy of it kept in a column of each block
+    // like ForEachFromBack they hold one block lock at a time, so each block is seen as it was when reached
+    template<std::size_t Field>
+    class ColumnScan {
+    public:
+        using Value = std::remove_cv_t<std::tuple_element_t<Field, T>>;
+
+        ColumnSumType<Value> Sum() const {
+            RQ_LOCK_SITE();
+            ColumnSumType<Value> sum(0);
+            queue->ForEachBlock([&sum](Block& block, int) {
+                sum += ScanKernels<Value>::Sum(Values(block), block.end - block.begin);
+            });
+            return sum;
+        }
+
+        // nothing if the queue is empty
+        std::optional<Value> Min() const {
+            RQ_LOCK_SITE();
+            std::optional<Value> lowest;
+            queue->ForEachBlock([&lowest](Block& block, int) {
+                if (block.Empty()) return;
+                const Value value(ScanKernels<Value>::Min(Values(block), block.end - block.begin));
+                if (!lowest || value < *lowest) lowest = value;
+            });
+            return lowest;
+        }
+
+        std::optional<Value> Max() const {
+            RQ_LOCK_SITE();
+            std::optional<Value> highest;
+            queue->ForEachBlock([&highest](Block& block, int) {
+                if (block.Empty()) return;
+                const Value value(ScanKernels<Value>::Max(Values(block), block.end - block.begin));
+                if (!highest || value > *highest) highest = value;
+            });
+            return highest;
+        }
+
+        // the number of items whose field satisfies pred
+        template<class Pred>
+        std::size_t CountIf(Pred pred) const {
+            RQ_LOCK_SITE();
+            std::size_t count(0);
+            queue->ForEachBlock([&count, &pred](Block& block, int) {
+                const Value* const values(Values(block));
+                for (std::size_t i = 0; i < block.end - block.begin; i++) count += pred(values[i]) ? 1 : 0;
+            });
+            return count;
+        }
+
+        // copies the items whose field satisfies pred to out, from the back to the front
+        // only the column is read until an item matches
+        template<class Pred, class OutputIt>
+        OutputIt Filter(Pred pred, OutputIt out) const {
+            RQ_LOCK_SITE();
+            queue->ForEachBlock([&out, &pred](Block& block, int towardsFront) {
+                const Value* const column(block.columns.template Column<Field>());
+                if (towardsFront == right) {
+                    for (std::size_t i = block.begin; i < block.end; i++) {
+                        if (pred(column[i])) *out++ = *block.Item(i);
+                    }
+                } else {
+                    for (std::size_t i = block.end; i > block.begin; i--) {
+                        if (pred(column[i - 1])) *out++ = *block.Item(i - 1);
+                    }
+                }
+            });
+            return out;
+        }
+
+    private:
+        friend class UnrolledReversibleQueue;
+
+        explicit ColumnScan(const UnrolledReversibleQueue* q) : queue(q) {}
+
+        static const Value* Values(const Block& block) {
+            return block.columns.template Column<Field>() + block.begin;
+        }
+
+        const UnrolledReversibleQueue* queue;
+    };
+
+    template<std::size_t Field>
+    ColumnScan<Field> Column() const {
+        static_assert(Columns::template has<Field>, "no column is kept for that field");
+        return ColumnScan<Field>(this);
+    }
+
+    // the number of data items in the queue, without taking any locks
+    // may run ahead of the items that can actually be reached while pushes and inserts are under way
+    std::size_t Size() const {
+        return counters.Length();
+    }
+
+    bool Empty() const {
+        return Size() == 0;
+    }
+
+    // counts of what the queue has been through, cheap enough to scrape while it is in use
+    QueueStats Stats() const {
+        return counters.Snapshot();
+    }
+
+    // THREAD OBSERVERS
+    // each thread can keep one implicit cursor inside the queue, these are thin wrappers around it
+
+    // adds a data item behind the given current thread observer location
+    void Insert(const T& item) {
+        RQ_LOCK_SITE();
+        Emplace(item);
+    }
+
+    void Insert(T&& item) {
+        RQ_LOCK_SITE();
+        Emplace(std::move(item));
+    }
+
+    // constructs a data item in place behind the given current thread observer location
+    template<class... Args>
+    void Emplace(Args&&... args) {
+        RQ_LOCK_SITE();
+        Cursor& observer(threadLocator.Local());
+        if (!observer) throw std::logic_error("thread not currently observing queue");
+        observer.Emplace(std::forward<Args>(args)...);
+    }
+
+    // erases the data item at the thread locator position and then remove the thread locator
+    void Erase() {
+        RQ_LOCK_SITE();
+        Cursor& observer(threadLocator.Local());
+        if (!observer) throw std::logic_error("thread not currently observing queue");
+        observer.Erase();
+    }
+
+    // set the thread to observe the rear of the queue
+    void GoToBack() const {
+        RQ_LOCK_SITE();
+        Cursor& observer(threadLocator.Local());
+        observer.Release();
+        // the observer needs write access to the queue to insert and erase
+        observer = const_cast<UnrolledReversibleQueue*>(this)->Back();
+    }
+
+    // set the thread to observe the item k places in front of the back of the queue
+    void GoTo(std::size_t k) const {
+        RQ_LOCK_SITE();
+        Cursor& observer(threadLocator.Local());
+        observer.Release();
+        observer = const_cast<UnrolledReversibleQueue*>(this)->SeekFromBack(k);
+    }
+
+    // set the thread to observe the front of the queue
+    void GoToFront() const {
+        RQ_LOCK_SITE();
+        Cursor& observer(threadLocator.Local());
+        observer.Release();
+        observer = const_cast<UnrolledReversibleQueue*>(this)->Front();
+    }
+
+    // moves the observed item to the one in front of current, throws an exception if at the front already
+    void MoveForward() const {
+        RQ_LOCK_SITE();
+        Cursor& observer(threadLocator.Local());
+        if(!observer) throw std::logic_error("thread not currently observing the queue");
+        if(!observer.Advance()) {
+            // we are at the end so release observer
+            observer.Release();
+            throw std::domain_error("current observed node at front of queue");
+        }
+    }
+
+    // moves the observed item to the one behind current, throws an exception if at the back already
+    // walking either way is deadlock free as the cursor only ever waits on blocks physically to its left
+    void MoveBackward() const {
+        RQ_LOCK_SITE();
+        Cursor& observer(threadLocator.Local());
+        if(!observer) throw std::logic_error("thread not currently observing the queue");
+        if(!observer.Retreat()) {
+            // we are at the end so release observer
+            observer.Release();
+            throw std::domain_error("current observed node at back of queue");
+        }
+    }
+
+    // unlocks and stops observing an item
+    void ClearObserver() const {
+        RQ_LOCK_SITE();
+        threadLocator.Local().Release();
+    }
+
+    // changes the access and traverse direction of the queue, a constant time flip
+    void reverse() {
+        RQ_LOCK_SITE();
+        // acquire both ends, right first as we may only wait leftwards
+        std::lock_guard<QueueMutex> rightLock(sentinels[right].m);
+        std::lock_guard<QueueMutex> leftLock(sentinels[left].m);
+
+        direction.store(!direction.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        counters.Count(QueueCounters::reversals);
+    }
+
+    // returns the data contained in the currently observed item
+    // the reference stays valid until the thread moves off the item
+    const T& GetData() const {
+        const Cursor& observer(threadLocator.Local());
+        if (!observer) throw std::logic_error("thread not currently observing the queue");
+        return observer.Get();
+    }
+
+    // initialises a queue observer for the given thread
+    void InitObserver() {
+        threadLocator.Local().Release();
+    }
+
+    // stops observing and frees this thread's observer slot for reuse by other threads
+    void ReleaseObserver() {
+        ClearObserver();
+        threadLocator.Release();
+    }
+
+private:
+    // physical sides of the queue, used to index sentinels and block links
+    static const int left = 0;
+    static const int right = 1;
+
+    static int Opposite(int side) {
+        return side == left ? right : left;
+    }
+
+    // the physical side holding the front (atFront) or back of the queue in the given direction
+    static int EndSide(bool atFront, bool dir) {
+        return (atFront == dir) ? right : left;
+    }
+
+    bool IsSentinel(const Block* block) const {
+        return block == &sentinels[left] || block == &sentinels[right];
+    }
+
+    // calls fn(block, towardsFront) on each block from the back to the front, holding its lock
+    template<class Fn>
+    void ForEachBlock(Fn fn) const {
+        auto* const self(const_cast<UnrolledReversibleQueue*>(this));
+        int side;
+        std::unique_lock<QueueMutex> lock(LockEnd(false, side));
+        const int towardsFront(Opposite(side));
+        Block* block(&self->sentinels[side]);
+        block->refs.fetch_add(1, std::memory_order_relaxed);
+        while (true) {
+            block = self->Cross(block, lock, towardsFront);
+            if (IsSentinel(block)) break;
+            fn(*block, towardsFront);
+        }
+        lock.unlock();
+        Unref(block);
+    }
+
+    // takes lock, waiting only if the block lies towards the left of the one we hold
+    static bool LockTowards(std::unique_lock<QueueMutex>& lock, int side) {
+        if (side == left) {
+            lock.lock();
+            return true;
+        }
+        return lock.try_lock();
+    }
+
+    static Block* NewBlock(std::size_t start) {
+        return NodePool::template Create<Block>(start);
+    }
+
+    // drops a reference to block, returning it to the pool with the last one
+    // only dead blocks can lose their last reference, and with it they let go of their old neighbours
+    static void Unref(Block* block) {
+        while (block->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            Block* const leftBlock(block->link[left]);
+            Block* const rightBlock(block->link[right]);
+            NodePool::Destroy(block);
+            Unref(leftBlock);
+            block = rightBlock;
+        }
+    }
+
+    // lets go of the end after failing to try_lock contended and drops the caller's reference on it once the
+    // contention policy has waited, the caller then takes the end again from scratch
+    void BackOff(Contention& backoff, std::unique_lock<QueueMutex>& endLock, Block* contended) {
+        counters.Count(QueueCounters::retries);
+        endLock.unlock();
+        if constexpr (Contention::handoff) {
+            // holding nothing we may wait on any block
+            contended->m.lock();
+            contended->m.unlock();
+        } else {
+            backoff.Wait();
+        }
+        Unref(contended);
+    }
+
+    // locks the front (atFront) or back sentinel of the queue, reporting which physical side that is
+    std::unique_lock<QueueMutex> LockEnd(bool atFront, int& side) const {
+        while(true) {
+            const bool dir(direction.load(std::memory_order_relaxed));
+            side = EndSide(atFront, dir);
+            std::unique_lock<QueueMutex> endLock(sentinels[side].m);
+            // reverse() holds both ends, so the direction is settled once we hold either
+            if (direction.load(std::memory_order_relaxed) == dir) return endLock;
+            counters.Count(QueueCounters::retries);
+        }
+    }
+
+    // moves from the locked and referenced block onto its neighbour on side, handing over the lock and reference
+    // the hold on block may be given up before the neighbour is reached, so it can be unlinked meanwhile and we
+    // carry on from wherever its old link points
+    Block* Cross(Block* block, std::unique_lock<QueueMutex>& lock, int side) {
+        Block* next(block->link[side]);
+        next->refs.fetch_add(1, std::memory_order_relaxed);
+        std::unique_lock<QueueMutex> nextLock(next->m, std::defer_lock);
+        if (!LockTowards(nextLock, side)) {
+            counters.Count(QueueCounters::tryLockFailures);
+            // may not wait on a block to our right while holding one, but our reference keeps it alive
+            lock.unlock();
+            nextLock.lock();
+        }
+        if (lock.owns_lock()) lock.unlock();
+        Unref(block);
+        while (next->dead) {
+            Block* const onward(next->link[side]);
+            onward->refs.fetch_add(1, std::memory_order_relaxed);
+            nextLock.unlock();
+            Unref(next);
+            next = onward;
+            // holding nothing, so free to wait either way
+            nextLock = std::unique_lock<QueueMutex>(next->m);
+        }
+        lock = std::move(nextLock);
+        return next;
+    }
+
+    // crosses towards side until reaching a block with items in it, or the sentinel at that end
+    Block* CrossToItems(Block* block, std::unique_lock<QueueMutex>& lock, int side) {
+        do {
+            block = Cross(block, lock, side);
+        } while (!IsSentinel(block) && block->Empty());
+        return block;
+    }
+
+    // returns a cursor on the front (atFront) or back item
+    Cursor End(bool atFront) {
+        int side;
+        std::unique_lock<QueueMutex> lock(LockEnd(atFront, side));
+        // the observer walks in the direction the queue has right now, even if it is reversed under it
+        const bool dir(direction.load(std::memory_order_relaxed));
+        Block* block(&sentinels[side]);
+        block->refs.fetch_add(1, std::memory_order_relaxed);
+        block = CrossToItems(block, lock, Opposite(side));
+        if (IsSentinel(block)) {
+            lock.unlock();
+            Unref(block);
+            throw std::domain_error("queue empty");
+        }
+        const std::size_t index(side == right ? block->end - 1 : block->begin);
+        return Cursor(this, block, std::move(lock), index, dir);
+    }
+
+    // returns a cursor on the item k places in from the front (atFront) or back, counting whole blocks at a time
+    Cursor Seek(bool atFront, std::size_t k) {
+        int side;
+        std::unique_lock<QueueMutex> lock(LockEnd(atFront, side));
+        const bool dir(direction.load(std::memory_order_relaxed));
+        Block* block(&sentinels[side]);
+        block->refs.fetch_add(1, std::memory_order_relaxed);
+        while (true) {
+            block = Cross(block, lock, Opposite(side));
+            if (IsSentinel(block)) {
+                lock.unlock();
+                Unref(block);
+                throw std::domain_error("cannot seek past the end of the queue");
+            }
+            const std::size_t count(block->end - block->begin);
+            if (k < count) {
+                const std::size_t index(side == right ? block->end - 1 - k : block->begin + k);
+                return Cursor(this, block, std::move(lock), index, dir);
+            }
+            k -= count;
+        }
+    }
+
+    // makes room for an item at the slot boundary gap of a block that is not full, moving whichever side has
+    // fewer items, and returns the free slot. Keeps tracked pointing at the same item
+    static std::size_t OpenGap(Block* block, std::size_t gap, std::size_t& tracked) {
+        const bool shiftLeft(block->HasRoom(left) &&
+                             (!block->HasRoom(right) || gap - block->begin <= block->end - gap));
+        if (shiftLeft) {
+            for (std::size_t i = block->begin; i < gap; i++) block->Relocate(i, block, i - 1);
+            block->begin--;
+            if (tracked < gap) tracked--;
+            return gap - 1;
+        }
+        for (std::size_t i = block->end; i > gap; i--) block->Relocate(i - 1, block, i);
+        block->end++;
+        if (tracked >= gap) tracked++;
+        return gap;
+    }
+
+    // takes a block that has just been emptied out of the chain if its neighbours can be had without backing off
+    // the caller holds the block and drops the queue's reference on it afterwards, returns whether that is due
+    bool TryUnlink(Block* block) {
+        std::lock_guard<QueueMutex> leftLock(block->link[left]->m);
+        std::unique_lock<QueueMutex> rightLock(block->link[right]->m, std::try_to_lock);
+        // otherwise it stays empty until an end reaches it
+        if (!rightLock.owns_lock()) {
+            counters.Count(QueueCounters::tryLockFailures);
+            return false;
+        }
+        Unlink(block);
+        return true;
+    }
+
+    // unlinks block, the caller holds it and both of its neighbours
+    static void Unlink(Block* block) {
+        Block* const leftBlock(block->link[left]);
+        Block* const rightBlock(block->link[right]);
+        leftBlock->link[right] = rightBlock;
+        rightBlock->link[left] = leftBlock;
+        // the dead block keeps pointing at its old neighbours so a cursor caught on it can carry on from there
+        leftBlock->refs.fetch_add(1, std::memory_order_relaxed);
+        rightBlock->refs.fetch_add(1, std::memory_order_relaxed);
+        block->dead = true;
+    }
+
+    // hands out items to PushEnd, one at a time
+    template<class InputIt>
+    struct RangeSource {
+        static const bool many = true;
+
+        InputIt first;
+        InputIt last;
+
+        bool Done() const {
+            return first == last;
+        }
+
+        void ConstructAt(T* slot) {
+            new (slot) T(*first);
+            ++first;
+        }
+    };
+
+    template<class... Args>
+    struct ArgsSource {
+        static const bool many = false;
+
+        std::tuple<Args&&...> args;
+        bool done;
+
+        bool Done() const {
+            return done;
+        }
+
+        void ConstructAt(T* slot) {
+            std::apply([slot](auto&&... a) { new (slot) T(std::forward<decltype(a)>(a)...); }, std::move(args));
+            done = true;
+        }
+    };
+
+    // adds the items from source at the front (atFront) or back, filling the end block before starting new ones
+    template<class Source>
+    void PushEnd(bool atFront, Source& source) {
+        if (source.Done()) return;
+        PushItems(atFront, source);
+        waiters.Notify(Source::many);
+    }
+
+    template<class Source>
+    void PushItems(bool atFront, Source& source) {
+        Contention backoff;
+        while(true) {
+            int side;
+            std::unique_lock<QueueMutex> endLock(LockEnd(atFront, side));
+            const int inward(Opposite(side));
+            Block* const sentinel(&sentinels[side]);
+            Block* endBlock(sentinel->link[inward]);
+
+            std::unique_lock<QueueMutex> blockLock(endBlock->m, std::defer_lock);
+            if (!LockTowards(blockLock, inward)) {
+                counters.Count(QueueCounters::tryLockFailures);
+                // give the blocking thread a chance to finish with it
+                endBlock->refs.fetch_add(1, std::memory_order_relaxed);
+                BackOff(backoff, endLock, endBlock);
+                continue;
+            }
+            // an emptied end block is reused from its outer edge
+            if (!IsSentinel(endBlock) && endBlock->Empty()) {
+                endBlock->begin = endBlock->end = (side == right) ? 0 : BlockSize;
+            }
+
+            while (!source.Done()) {
+                if (IsSentinel(endBlock) || !endBlock->HasRoom(side)) {
+                    // start a new block at this end, nobody can reach it before we let go of it
+                    Block* const fresh(NewBlock(side == right ? 0 : BlockSize));
+                    std::unique_lock<QueueMutex> freshLock(fresh->m);
+                    fresh->link[inward] = endBlock;
+                    fresh->link[side] = sentinel;
+                    endBlock->link[side] = fresh;
+                    sentinel->link[inward] = fresh;
+                    endBlock = fresh;
+                    blockLock = std::move(freshLock);
+                }
+                const std::size_t slot(side == right ? endBlock->end : endBlock->begin - 1);
+                source.ConstructAt(endBlock->Item(slot));
+                endBlock->Placed(slot);
+                side == right ? endBlock->end++ : endBlock->begin--;
+                // only reachable by others once we let go of the block
+                counters.Grow(1);
+                counters.Count(QueueCounters::pushes);
+            }
+            return;
+        }
+    }
+
+    std::optional<T> PopOptional(bool atFront) {
+        std::optional<T> item;
+        PopEnd(atFront, 1, [&item](T&& data) { item.emplace(std::move(data)); });
+        return item;
+    }
+
+    // removes up to n items from the front (atFront) or back, handing each to sink
+    // returns how many were removed, fewer than n only if the queue ran empty
+    template<class Sink>
+    std::size_t PopEnd(bool atFront, std::size_t n, Sink sink) {
+        std::size_t popped(0);
+        Contention backoff;
+        while (popped < n) {
+            int side;
+            std::unique_lock<QueueMutex> endLock(LockEnd(atFront, side));
+            const int inward(Opposite(side));
+            Block* const sentinel(&sentinels[side]);
+            // the block we failed to lock, referenced while it was still linked behind a lock we held
+            Block* contended(nullptr);
+            while (popped < n) {
+                Block* const endBlock(sentinel->link[inward]);
+                // empty list
+                if (endBlock == &sentinels[inward]) return popped;
+
+                std::unique_lock<QueueMutex> blockLock(endBlock->m, std::defer_lock);
+                if (!LockTowards(blockLock, inward)) {
+                    counters.Count(QueueCounters::tryLockFailures);
+                    contended = endBlock;
+                    contended->refs.fetch_add(1, std::memory_order_relaxed);
+                    break;
+                }
+
+                if (endBlock->Empty()) {
+                    // left over from earlier pops or erases, take it out on the way past
+                    std::unique_lock<QueueMutex> innerLock(endBlock->link[inward]->m, std::defer_lock);
+                    if (!LockTowards(innerLock, inward)) {
+                        counters.Count(QueueCounters::tryLockFailures);
+                        contended = endBlock->link[inward];
+                        contended->refs.fetch_add(1, std::memory_order_relaxed);
+                        break;
+                    }
+                    Unlink(endBlock);
+                    innerLock.unlock();
+                    blockLock.unlock();
+                    Unref(endBlock);
+                    continue;
+                }
+                while (popped < n && !endBlock->Empty()) {
+                    const std::size_t slot(side == right ? endBlock->end - 1 : endBlock->begin);
+                    T* const item(endBlock->Item(slot));
+                    sink(std::move(*item));
+                    item->~T();
+                    side == right ? endBlock->end-- : endBlock->begin++;
+                    counters.Shrink(1);
+                    counters.Count(QueueCounters::pops);
+                    popped++;
+                }
+            }
+            // backing off, give the blocking thread a chance to finish with the block
+            if (contended) BackOff(backoff, endLock, contended);
+        }
+        return popped;
+    }
+
+    // empty blocks bounding either physical end of the queue, their locks are the end locks
+    mutable Block sentinels[2];
+
+    // stores the location in the queue each thread is currently holding
+    mutable ObserverTable<Cursor> threadLocator;
+
+    // enforces the entry side and direction of list traversing
+    // true: front = right; false: front = left
+    // only changes while both sentinels are held
+    std::atomic<bool> direction;
+
+    // consumers waiting for the queue to fill
+    PopWaiters waiters;
+
+    // length and statistics
+    mutable QueueCounters counters;
+};
+
+// a queue of at most Capacity items kept in a ring of slots, for traffic that only ever touches the ends
+// no allocation or lock per item: one lock guards the whole ring, and reversing swaps which end of it is the front.
+// A full queue fails TryPush and makes Push wait for room until it is closed, an empty one fails TryPop and makes Pop throw
+// observers are positions rather than locks, so an observed item can be popped from under one and the observer
+// then throws logic_error. There is no insert or erase in the middle
+template<class T, std::size_t Capacity>
+class BoundedReversibleQueue {
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+
+public:
+    BoundedReversibleQueue() : slots(new Slot[Capacity]), ends{0, 0}, direction(true), pushes(0) {
+        RQ_LOCK_ROLE(m, "queue");
+    }
+
+    BoundedReversibleQueue(const BoundedReversibleQueue&) = delete;
+    BoundedReversibleQueue& operator=(const BoundedReversibleQueue&) = delete;
+
+    ~BoundedReversibleQueue() {
+        for (std::uint64_t i = ends[left]; i != ends[right]; i++) At(i).~T();
+    }
+
+    static constexpr std::size_t capacity = Capacity;
+
+    // adds an item at the front, waiting for room if the queue is full
+    // returns false only once the queue has been closed and is full, item is then left alone
+    bool PushFront(const T& item) {
+        RQ_LOCK_SITE();
+        return PushWaiting(true, item);
+    }
+
+    bool PushFront(T&& item) {
+        RQ_LOCK_SITE();
+        return PushWaiting(true, std::move(item));
+    }
+
+    // adds an item behind the last, waiting for room if the queue is full
+    // returns false only once the queue has been closed and is full, item is then left alone
+    bool PushBack(const T& item) {
+        RQ_LOCK_SITE();
+        return PushWaiting(false, item);
+    }
+
+    bool PushBack(T&& item) {
+        RQ_LOCK_SITE();
+        return PushWaiting(false, std::move(item));
+    }
+
+    // adds an item at the front unless the queue is full, item is left alone if it returns false
+    bool TryPushFront(const T& item) {
+        RQ_LOCK_SITE();
+        return PushNow(true, item);
+    }
+
+    bool TryPushFront(T&& item) {
+        RQ_LOCK_SITE();
+        return PushNow(true, std::move(item));
+    }
+
+    bool TryPushBack(const T& item) {
+        RQ_LOCK_SITE();
+        return PushNow(false, item);
+    }
+
+    bool TryPushBack(T&& item) {
+        RQ_LOCK_SITE();
+        return PushNow(false, std::move(item));
+    }
+
+    // removes the first data item
+    void PopFront() {
+        RQ_LOCK_SITE();
+        if (!TryPopFront()) throw std::logic_error("cannot pop from empty list");
+    }
+
+    // removes the last data item
+    void PopBack() {
+        RQ_LOCK_SITE();
+        if (!TryPopBack()) throw std::logic_error("cannot pop from empty list");
+    }
+
+    std::optional<T> TryPopFront() {
+        RQ_LOCK_SITE();
+        return PopNow(true);
+    }
+
+    std::optional<T> TryPopBack() {
+        RQ_LOCK_SITE();
+        return PopNow(false);
+    }
+
+    // removes the first data item, waiting for one to be pushed if the queue is empty
+    // returns nothing only once the queue has been closed and is empty
+    std::optional<T> WaitPopFront() {
+        RQ_LOCK_SITE();
+        return PopWaiting(true);
+    }
+
+    std::optional<T> WaitPopBack() {
+        RQ_LOCK_SITE();
+        return PopWaiting(false);
+    }
+
+    // wakes every waiting consumer and producer, from now on waits return nothing instead of blocking on an empty
+    // queue and pushes return false instead of blocking on a full one
+    void Close() {
+        waiters.Close();
+        room.Close();
+    }
+
+    bool Closed() const {
+        return waiters.Closed();
+    }
+
+    std::size_t Size() const {
+        RQ_LOCK_SITE();
+        std::lock_guard<QueueMutex> lock(m);
+        return std::size_t(ends[right] - ends[left]);
+    }
+
+    bool Empty() const {
+        return Size() == 0;
+    }
+
+    // swaps which end of the ring is the front
+    void reverse() {
+        RQ_LOCK_SITE();
+        std::lock_guard<QueueMutex> lock(m);
+        direction = !direction;
+    }
+
+    // calls fn on each data item from the back to the front under the queue lock, fn must not call back into the queue
+    template<class Fn>
+    void ForEachFromBack(Fn fn) const {
+        RQ_LOCK_SITE();
+        std::lock_guard<QueueMutex> lock(m);
+        const std::uint64_t count(ends[right] - ends[left]);
+        for (std::uint64_t i = 0; i < count; i++) {
+            fn(static_cast<const T&>(At(direction ? ends[left] + i : ends[right] - 1 - i)));
+        }
+    }
+
+    // set the thread to observe the rear of the queue
+    void GoToBack() const {
+        RQ_LOCK_SITE();
+        Observe(false);
+    }
+
+    // set the thread to observe the front of the queue
+    void GoToFront() const {
+        RQ_LOCK_SITE();
+        Observe(true);
+    }
+
+    // moves the observed item to the one in front of current, throws an exception if at the front already
+    void MoveForward() const {
+        RQ_LOCK_SITE();
+        Step(true);
+    }
+
+    // moves the observed item to the one behind current, throws an exception if at the back already
+    void MoveBackward() const {
+        RQ_LOCK_SITE();
+        Step(false);
+    }
+
+    // returns a copy of the currently observed item, the slot may be reused as soon as the lock is let go
+    T GetData() const {
+        RQ_LOCK_SITE();
+        std::lock_guard<QueueMutex> lock(m);
+        return At(Observed().index);
+    }
+
+    // stops observing
+    void ClearObserver() const {
+        RQ_LOCK_SITE();
+        threadLocator.Local() = Position();
+    }
+
+    // initialises a queue observer for the given thread
+    void InitObserver() {
+        ClearObserver();
+    }
+
+    // stops observing and frees this thread's observer slot for reuse by other threads
+    void ReleaseObserver() {
+        threadLocator.Release();
+    }
+
+private:
+    static const int left = 0, right = 1;
+
+    static constexpr std::uint64_t mask = Capacity - 1;
+
+    struct Slot {
+        alignas(T) unsigned char bytes[sizeof(T)];
+        // the push that filled the slot, so an observer can tell its item from a later one in the same place
+        std::uint64_t stamp;
+    };
+
+    // an observer's place in the ring
+    struct Position {
+        std::uint64_t index = 0;
+        std::uint64_t stamp = 0;
+        bool observing = false;
+    };
+
+    // the physical side of the queue's front or back end
+    static int EndSide(bool atFront, bool direction) {
+        return atFront == direction ? right : left;
+    }
+
+    T& At(std::uint64_t i) {
+        return *std::launder(reinterpret_cast<T*>(slots[i & mask].bytes));
+    }
+
+    const T& At(std::uint64_t i) const {
+        return *std::launder(reinterpret_cast<const T*>(slots[i & mask].bytes));
+    }
+
+    // ends are counters that run on past Capacity, left <= i < right holds an item at slot i % Capacity
+    // the index of the item at an end, the queue is not empty
+    std::uint64_t EndIndex(int side) const {
+        return side == left ? ends[left] : ends[right] - 1;
+    }
+
+    bool Holds(const Position& position) const {
+        return position.index - ends[left] < ends[right] - ends[left] &&
+               slots[position.index & mask].stamp == position.stamp;
+    }
+
+    // the push and pop proper, the queue lock is held
+    template<class U>
+    bool PushLocked(bool atFront, U&& item) {
+        if (ends[right] - ends[left] == Capacity) return false;
+        const int side(EndSide(atFront, direction));
+        const std::uint64_t i(side == left ? ends[left] - 1 : ends[right]);
+        new (slots[i & mask].bytes) T(std::forward<U>(item));
+        slots[i & mask].stamp = ++pushes;
+        side == left ? ends[left]-- : ends[right]++;
+        return true;
+    }
+
+    std::optional<T> PopLocked(bool atFront) {
+        if (ends[left] == ends[right]) return std::nullopt;
+        const int side(EndSide(atFront, direction));
+        const std::uint64_t i(EndIndex(side));
+        std::optional<T> item(std::move(At(i)));
+        At(i).~T();
+        side == left ? ends[left]++ : ends[right]--;
+        return item;
+    }
+
+    // waiters are only notified once their wait lock is free again, a waiting producer and consumer would otherwise
+    // each hold their own while taking the other's
+    template<class U>
+    bool PushNow(bool atFront, U&& item) {
+        bool pushed;
+        {
+            std::lock_guard<QueueMutex> lock(m);
+            pushed = PushLocked(atFront, std::forward<U>(item));
+        }
+        if (pushed) waiters.Notify(false);
+        return pushed;
+    }
+
+    template<class U>
+    bool PushWaiting(bool atFront, U&& item) {
+        const bool pushed(room.Wait([&] {
+            std::lock_guard<QueueMutex> lock(m);
+            return PushLocked(atFront, std::forward<U>(item));
+        }, nullptr));
+        if (pushed) waiters.Notify(false);
+        return pushed;
+    }
+
+    std::optional<T> PopNow(bool atFront) {
+        std::optional<T> item;
+        {
+            std::lock_guard<QueueMutex> lock(m);
+            item = PopLocked(atFront);
+        }
+        if (item) room.Notify(false);
+        return item;
+    }
+
+    std::optional<T> PopWaiting(bool atFront) {
+        std::optional<T> item(waiters.Wait([&] {
+            std::lock_guard<QueueMutex> lock(m);
+            return PopLocked(atFront);
+        }, nullptr));
+        if (item) room.Notify(false);
+        return item;
+    }
+
+    void Observe(bool atFront) const {
+        std::lock_guard<QueueMutex> lock(m);
+        Position& observer(threadLocator.Local());
+        observer = Position();
+        if (ends[left] == ends[right]) throw std::domain_error("queue empty");
+        const std::uint64_t i(EndIndex(EndSide(atFront, direction)));
+        observer = Position{i, slots[i & mask].stamp, true};
+    }
+
+    void Step(bool forward) const {
+        std::lock_guard<QueueMutex> lock(m);
+        Position& observer(Observed());
+        // heading for the physical right end, or the left
+        const bool rightwards(forward == direction);
+        if (observer.index == EndIndex(rightwards ? right : left)) {
+            observer = Position();
+            throw std::domain_error(forward ? "current observed node at front of queue"
+                                            : "current observed node at back of queue");
+        }
+        observer.index += rightwards ? 1 : -1;
+        observer.stamp = slots[observer.index & mask].stamp;
+    }
+
+    // the calling thread's observer, which must still be on its item, the queue lock is held
+    Position& Observed() const {
+        Position& observer(threadLocator.Local());
+        if (!observer.observing) throw std::logic_error("thread not currently observing the queue");
+        if (!Holds(observer)) {
+            observer = Position();
+            throw std::logic_error("observed item has been popped");
+        }
+        return observer;
+    }
+
+    std::unique_ptr<Slot[]> slots;
+    // where the items run from and to, on the physical left [0] and right [1]
+    std::uint64_t ends[2];
+    // true: front = right; false: front = left
+    bool direction;
+    std::uint64_t pushes;
+    mutable QueueMutex m;
+
+    mutable ObserverTable<Position> threadLocator;
+
+    // consumers waiting for the queue to fill
+    PopWaiters waiters;
+
+    // producers waiting for the queue to empty a slot
+    PopWaiters room;
+};
+
+// one queue per worker thread, for work that threads mostly feed themselves
+// a thread pushes to and pops from the front of its own shard, so busy workers never meet on a lock. A thread
+// whose shard is empty steals a batch from the back of another, where it only meets that shard's owner once the
+// shard is down to its last item. Threads are dealt shards in turn as they first use one, each its own until there
+// are more threads than shards, when the count wraps round and later threads share
+// order only holds within a shard. The queue as a whole is the shards one after another, which reverse() flips and
+// ForEachFromBack walks; neither is atomic across shards, each shard is reversed or walked whole in turn
+template<class T, class Shard = ReversibleQueue<T>>
+class ShardedReversibleQueue {
+public:
+    // one shard per hardware thread unless told otherwise
+    explicit ShardedReversibleQueue(std::size_t shardCount = std::max(1u, std::thread::hardware_concurrency()))
+        : id(NextId()), direction(true), steals(0) {
+        if (shardCount == 0) throw std::domain_error("a sharded queue needs at least one shard");
+        for (std::size_t i = 0; i < shardCount; i++) shards.push_back(std::make_unique<Padded>());
+    }
+
+    ShardedReversibleQueue(const ShardedReversibleQueue&) = delete;
+    ShardedReversibleQueue& operator=(const ShardedReversibleQueue&) = delete;
+
+    void PushFront(const T& item) {
+        RQ_LOCK_SITE();
+        Local().PushFront(item);
+        waiters.Notify(false);
+    }
+
+    void PushFront(T&& item) {
+        RQ_LOCK_SITE();
+        Local().PushFront(std::move(item));
+        waiters.Notify(false);
+    }
+
+    // pushes at the back of this thread's shard, first in line to be stolen
+    void PushBack(const T& item) {
+        RQ_LOCK_SITE();
+        Local().PushBack(item);
+        waiters.Notify(false);
+    }
+
+    void PushBack(T&& item) {
+        RQ_LOCK_SITE();
+        Local().PushBack(std::move(item));
+        waiters.Notify(false);
+    }
+
+    template<class InputIt>
+    void PushFront(InputIt first, InputIt last) {
+        RQ_LOCK_SITE();
+        Local().PushFront(first, last);
+        waiters.Notify(true);
+    }
+
+    template<class InputIt>
+    void PushBack(InputIt first, InputIt last) {
+        RQ_LOCK_SITE();
+        Local().PushBack(first, last);
+        waiters.Notify(true);
+    }
+
+    // pops from the front of this thread's shard, stealing if it is empty
+    // an empty optional means every shard looked empty
+    std::optional<T> TryPopFront() {
+        RQ_LOCK_SITE();
+        if (std::optional<T> item = Local().TryPopFront()) return item;
+        return Steal();
+    }
+
+    std::optional<T> TryPopBack() {
+        RQ_LOCK_SITE();
+        if (std::optional<T> item = Local().TryPopBack()) return item;
+        return Steal();
+    }
+
+    // blocks until an item turns up in any shard, an empty optional means the queue was closed and is empty
+    std::optional<T> WaitPopFront() {
+        RQ_LOCK_SITE();
+        return waiters.Wait([this] { return TryPopFront(); }, nullptr);
+    }
+
+    std::optional<T> WaitPopBack() {
+        RQ_LOCK_SITE();
+        return waiters.Wait([this] { return TryPopBack(); }, nullptr);
+    }
+
+    void Close() {
+        waiters.Close();
+    }
+
+    bool Closed() const {
+        return waiters.Closed();
+    }
+
+    // reverses the whole queue: every shard, and the order the shards come in
+    void reverse() {
+        RQ_LOCK_SITE();
+        std::lock_guard<std::mutex> reverseLock(reverseMutex);
+        for (const std::unique_ptr<Padded>& shard : shards) shard->queue.reverse();
+        direction.store(!direction.load());
+    }
+
+    // calls fn on every item from the back of the queue to the front, a shard at a time
+    template<class Fn>
+    std::size_t ForEachFromBack(Fn fn) const {
+        RQ_LOCK_SITE();
+        const bool dir(direction.load());
+        std::size_t count(0);
+        for (std::size_t i = 0; i < shards.size(); i++) {
+            count += shards[dir ? i : shards.size() - 1 - i]->queue.ForEachFromBack(fn);
+        }
+        return count;
+    }
+
+    // the shards' lengths added up, exact only while nobody is pushing or popping
+    std::size_t Size() const {
+        std::size_t size(0);
+        for (const std::unique_ptr<Padded>& shard : shards) size += shard->queue.Size();
+        return size;
+    }
+
+    bool Empty() const {
+        return Size() == 0;
+    }
+
+    // the shards' statistics added up, peakLength being the sum of each shard's peak
+    QueueStats Stats() const {
+        QueueStats total;
+        for (const std::unique_ptr<Padded>& shard : shards) {
+            const QueueStats stats(shard->queue.Stats());
+            total.pushes += stats.pushes;
+            total.pops += stats.pops;
+            total.inserts += stats.inserts;
+            total.erases += stats.erases;
+            total.reversals += stats.reversals;
+            total.tryLockFailures += stats.tryLockFailures;
+            total.retries += stats.retries;
+            total.peakLength += stats.peakLength;
+        }
+        return total;
+    }
+
+    // batches taken from another shard so far
+    std::uint64_t Steals() const {
+        return steals.load(std::memory_order_relaxed);
+    }
+
+    std::size_t ShardCount() const {
+        return shards.size();
+    }
+
+private:
+    // the most a thief takes at once, it never takes more than half of what it finds
+    static constexpr std::size_t stealBatch = 32;
+
+    // shards on cache lines of their own, so owners never share one
+    struct alignas(64) Padded {
+        Shard queue;
+    };
+
+    // the shard each thread was dealt per queue, direct-mapped by queue id
+    struct CacheEntry {
+        std::uint64_t queue = 0;
+        std::size_t shard = 0;
+    };
+    static const std::size_t cacheEntries = 8;
+
+    static CacheEntry* Cache() {
+        thread_local CacheEntry cache[cacheEntries];
+        return cache;
+    }
+
+    static std::uint64_t NextId() {
+        static std::atomic<std::uint64_t> nextId(1);
+        return nextId.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    std::size_t LocalIndex() {
+        CacheEntry& cached(Cache()[id % cacheEntries]);
+        if (cached.queue == id) return cached.shard;
+        cached.queue = id;
+        cached.shard = Deal();
+        return cached.shard;
+    }
+
+    // the calling thread's shard, the next in turn if this is its first time here
+    // threads are remembered by the queue too, so one that another queue evicted from the cache keeps its shard
+    std::size_t Deal() {
+        const std::thread::id self(std::this_thread::get_id());
+        std::lock_guard<std::mutex> dealLock(dealMutex);
+        const auto found(std::find(dealt.begin(), dealt.end(), self));
+        if (found == dealt.end()) {
+            dealt.push_back(self);
+            return (dealt.size() - 1) % shards.size();
+        }
+        return std::size_t(found - dealt.begin()) % shards.size();
+    }
+
+    Shard& Local() {
+        return shards[LocalIndex()]->queue;
+    }
+
+    // takes a batch from the back of the first other shard that has anything, returning one item of it and keeping
+    // the rest at the back of this thread's shard in the order they had
+    // the lengths only say where to look first. Before reporting every shard empty each one is tried under its end
+    // lock, so a waiter that counted itself in before this either sees a push or its producer sees the waiter
+    std::optional<T> Steal() {
+        const std::size_t self(LocalIndex());
+        for (std::size_t i = 1; i < shards.size(); i++) {
+            Shard& victim(shards[(self + i) % shards.size()]->queue);
+            const std::size_t available(victim.Size());
+            if (available == 0) continue;
+            if (std::optional<T> item = StealFrom(victim, available)) return item;
+        }
+        for (std::size_t i = 1; i < shards.size(); i++) {
+            if (std::optional<T> item = StealFrom(shards[(self + i) % shards.size()]->queue, 1)) return item;
+        }
+        return std::nullopt;
+    }
+
+    std::optional<T> StealFrom(Shard& victim, std::size_t available) {
+        const std::size_t want(std::min(stealBatch, (available + 1) / 2));
+        // gathered first, pushing into our shard while holding the victim's end could deadlock with its thief
+        std::vector<T> batch;
+        batch.reserve(want);
+        victim.PopBack(want, std::back_inserter(batch));
+        if (batch.empty()) return std::nullopt;
+        steals.fetch_add(1, std::memory_order_relaxed);
+
+        std::optional<T> item(std::move(batch.front()));
+        // the item that was nearest the victim's back goes in last, so it is nearest ours
+        if (batch.size() > 1) {
+            Local().PushBack(std::make_move_iterator(batch.rbegin()), std::make_move_iterator(batch.rend() - 1));
+        }
+        return item;
+    }
+
+    // unique for the life of the program so stale cache entries can never match a new queue
+    const std::uint64_t id;
+    std::vector<std::unique_ptr<Padded>> shards;
+
+    // every thread dealt a shard, in the order they came
+    std::mutex dealMutex;
+    std::vector<std::thread::id> dealt;
+
+    // which way round the shards come, true: in index order from the back
+    std::atomic<bool> direction;
+    std::mutex reverseMutex;
+
+    std::atomic<std::uint64_t> steals;
+
+    // consumers waiting for any shard to fill
+    PopWaiters waiters;
+};
+
+#if defined(__unix__) || defined(__APPLE__)
+// a queue of trivially copyable items kept in a memory mapped file, so it outlives the process that filled it
+// the file is a header followed by an arena of slots linked by slot number rather than by pointer, so it can be
+// mapped at any address. Every operation first appends the arena bytes it is about to write to a journal beside
+// the file (path + ".journal") and only then writes them, so reopening replays the journal over the arena to put
+// back whatever a crash interrupted. Restarting costs time in the length of the journal, not of the queue; once the
+// journal outgrows journalLimit the arena is flushed and the journal emptied
+// a killed process loses nothing it had finished. A power cut is another matter: the kernel may write arena pages
+// back before the journal records covering them reach the disk, leaving writes replay cannot undo. Only a durable
+// queue, which puts each record on disk before touching the arena, is consistent after one, as of the last
+// operation that returned
+// one lock guards the whole queue, every operation already waits on a journal write
+template<class T>
+class MappedReversibleQueue {
+    static_assert(std::is_trivially_copyable<T>::value, "mapped items are stored as raw bytes");
+
+public:
+    // durable costs a journal fsync per operation
+    explicit MappedReversibleQueue(const std::string& path, std::size_t journalLimit = std::size_t(64) << 20,
+                                   bool durable = false)
+        : path(path), journalLimit(journalLimit), durable(durable), file(-1), journal(-1), base(nullptr), mapped(0),
+          journalSize(0) {
+        RQ_LOCK_ROLE(m, "queue");
+        try {
+            Open();
+        } catch (...) {
+            Close();
+            throw;
+        }
+    }
+
+    MappedReversibleQueue(const MappedReversibleQueue&) = delete;
+    MappedReversibleQueue& operator=(const MappedReversibleQueue&) = delete;
+
+    // a clean close leaves an empty journal, so the next open has nothing to replay
+    ~MappedReversibleQueue() {
+        try {
+            Checkpoint();
+        } catch (...) {
+            // the journal is still there to replay
+        }
+        Close();
+    }
+
+    void PushFront(const T& item) {
+        RQ_LOCK_SITE();
+        PushEnd(true, item);
+    }
+
+    void PushBack(const T& item) {
+        RQ_LOCK_SITE();
+        PushEnd(false, item);
+    }
+
+    std::optional<T> TryPopFront() {
+        RQ_LOCK_SITE();
+        return PopEnd(true);
+    }
+
+    std::optional<T> TryPopBack() {
+        RQ_LOCK_SITE();
+        return PopEnd(false);
+    }
+
+    // the item becomes the k'th from the back, 0 <= k <= Size()
+    void InsertAt(std::size_t k, const T& item) {
+        RQ_LOCK_SITE();
+        std::lock_guard<QueueMutex> lock(m);
+        const std::uint64_t length(GetHeader().length);
+        if (k > length) throw std::domain_error("insert position is past the front");
+        if (k == 0 || k == length) {
+            PushLocked(k != 0, item);
+            return;
+        }
+        Reserve();
+        Header& header(GetHeader());
+        const int backSide(EndSide(false, header.direction)), frontSide(1 - backSide);
+        const std::uint64_t infront(SlotAt(k)), behind(At(infront).link[backSide]);
+
+        Transaction change(*this);
+        const std::uint64_t slot(Allocate(change));
+        change.Set(At(slot).data, item);
+        change.Set(At(slot).link[backSide], behind);
+        change.Set(At(slot).link[frontSide], infront);
+        change.Set(At(behind).link[frontSide], slot);
+        change.Set(At(infront).link[backSide], slot);
+        change.Set(header.length, length + 1);
+        Commit(change);
+    }
+
+    // removes the k'th item from the back, 0 <= k < Size()
+    void EraseAt(std::size_t k) {
+        RQ_LOCK_SITE();
+        std::lock_guard<QueueMutex> lock(m);
+        const std::uint64_t length(GetHeader().length);
+        if (k >= length) throw std::domain_error("erase position is past the front");
+        if (k == 0 || k == length - 1) {
+            PopLocked(k != 0);
+            return;
+        }
+        Header& header(GetHeader());
+        const int backSide(EndSide(false, header.direction)), frontSide(1 - backSide);
+        const std::uint64_t slot(SlotAt(k));
+        const std::uint64_t behind(At(slot).link[backSide]), infront(At(slot).link[frontSide]);
+
+        Transaction change(*this);
+        change.Set(At(behind).link[frontSide], infront);
+        change.Set(At(infront).link[backSide], behind);
+        change.Set(header.length, length - 1);
+        Free(change, slot);
+        Commit(change);
+    }
+
+    void reverse() {
+        RQ_LOCK_SITE();
+        std::lock_guard<QueueMutex> lock(m);
+        Header& header(GetHeader());
+        Transaction change(*this);
+        change.Set(header.direction, std::uint8_t(!header.direction));
+        Commit(change);
+    }
+
+    // visits each item from back to front under the queue lock, fn must not call back into the queue
+    template<class Fn>
+    void ForEachFromBack(Fn fn) const {
+        RQ_LOCK_SITE();
+        std::lock_guard<QueueMutex> lock(m);
+        const Header& header(GetHeader());
+        const int frontSide(EndSide(true, header.direction));
+        for (std::uint64_t slot(header.ends[1 - frontSide]); slot != nil; slot = At(slot).link[frontSide])
+            fn(static_cast<const T&>(At(slot).data));
+    }
+
+    std::size_t Size() const {
+        RQ_LOCK_SITE();
+        std::lock_guard<QueueMutex> lock(m);
+        return std::size_t(GetHeader().length);
+    }
+
+    bool Empty() const { return Size() == 0; }
+
+    // puts the journal on disk. That alone does not make the file safe from a power cut, see durable, but a durable
+    // queue's journal is on disk already
+    void Sync() {
+        RQ_LOCK_SITE();
+        std::lock_guard<QueueMutex> lock(m);
+        if (fsync(journal) != 0) Fail("cannot sync journal of");
+    }
+
+    // puts the arena on disk and empties the journal
+    void Checkpoint() {
+        RQ_LOCK_SITE();
+        std::lock_guard<QueueMutex> lock(m);
+        CheckpointLocked();
+    }
+
+private:
+    static const int left = 0, right = 1;
+
+    static constexpr std::uint64_t nil = ~std::uint64_t(0);
+
+    static constexpr std::uint64_t initialSlots = 1024;
+
+    // the physical side of the queue's front or back end
+    static int EndSide(bool atFront, bool direction) { return atFront == direction ? right : left; }
+
+    struct alignas(64) Header {
+        char magic[8];
+        // guards against reopening the file with a different item type
+        std::uint64_t slotSize;
+        // first and last slots on the physical left [0] and right [1], nil when empty
+        std::uint64_t ends[2];
+        std::uint64_t length;
+        // freed slots chained through their right link
+        std::uint64_t freeHead;
+        // slots handed out at least once, the rest of the arena has never been touched
+        std::uint64_t used;
+        // true: front = right; false: front = left
+        std::uint8_t direction;
+    };
+
+    struct Slot {
+        // neighbours on the physical left [0] and right [1], nil at the ends
+        std::uint64_t link[2];
+        T data;
+    };
+
+    static_assert(alignof(Slot) <= alignof(Header), "slots must stay aligned after the header");
+
+    static constexpr char magic[8] = {'R', 'Q', 'M', 'A', 'P', '0', '0', '1'};
+
+    // the arena writes of one operation, journalled as one record and applied in order once it is down
+    // record: payload size, payload checksum, then per write its arena offset, size and bytes. A write at offset
+    // nil is the file growing to the 8 byte size it carries
+    class Transaction {
+    public:
+        explicit Transaction(MappedReversibleQueue& queue) : queue(queue), payload(2 * sizeof(std::uint32_t)) {}
+
+        // field lives in the arena, value is read now so later writes may depend on the old state
+        template<class V>
+        void Set(V& field, const V& value) {
+            const std::uint64_t offset(reinterpret_cast<unsigned char*>(&field) - queue.base);
+            const std::uint32_t size(sizeof(V));
+            Append(&offset, sizeof(offset));
+            Append(&size, sizeof(size));
+            Append(&value, sizeof(V));
+        }
+
+        void Grow(std::uint64_t size) {
+            const std::uint32_t bytes(sizeof(size));
+            Append(&nil, sizeof(nil));
+            Append(&bytes, sizeof(bytes));
+            Append(&size, sizeof(size));
+        }
+
+        std::vector<unsigned char>& Record() {
+            const std::uint32_t size(std::uint32_t(payload.size() - 2 * sizeof(std::uint32_t)));
+            const std::uint32_t sum(Checksum(payload.data() + 2 * sizeof(std::uint32_t), size));
+            std::memcpy(payload.data(), &size, sizeof(size));
+            std::memcpy(payload.data() + sizeof(size), &sum, sizeof(sum));
+            return payload;
+        }
+
+    private:
+        void Append(const void* bytes, std::size_t size) {
+            const unsigned char* const first(static_cast<const unsigned char*>(bytes));
+            payload.insert(payload.end(), first, first + size);
+        }
+
+        MappedReversibleQueue& queue;
+        std::vector<unsigned char> payload;
+    };
+
+    // FNV-1a, enough to spot a record torn by a crash
+    static std::uint32_t Checksum(const unsigned char* bytes, std::size_t size) {
+        std::uint32_t hash(2166136261u);
+        for (std::size_t i(0); i < size; ++i) hash = (hash ^ bytes[i]) * 16777619u;
+        return hash;
+    }
+
+    [[noreturn]] void Fail(const char* what) const {
+        throw std::system_error(errno, std::generic_category(), std::string(what) + " " + path);
+    }
+
+    Header& GetHeader() { return *reinterpret_cast<Header*>(base); }
+    const Header& GetHeader() const { return *reinterpret_cast<const Header*>(base); }
+
+    Slot& At(std::uint64_t slot) { return reinterpret_cast<Slot*>(base + sizeof(Header))[slot]; }
+    const Slot& At(std::uint64_t slot) const { return reinterpret_cast<const Slot*>(base + sizeof(Header))[slot]; }
+
+    std::uint64_t Capacity() const { return (mapped - sizeof(Header)) / sizeof(Slot); }
+
+    // the k'th slot from the back, k < length
+    std::uint64_t SlotAt(std::size_t k) const {
+        const Header& header(GetHeader());
+        const int frontSide(EndSide(true, header.direction));
+        std::uint64_t slot(header.ends[1 - frontSide]);
+        while (k-- > 0) slot = At(slot).link[frontSide];
+        return slot;
+    }
+
+    void Open() {
+        file = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (file < 0) Fail("cannot open");
+        struct stat status;
+        if (fstat(file, &status) != 0) Fail("cannot stat");
+        std::size_t size(status.st_size);
+        if (size < sizeof(Header) + initialSlots * sizeof(Slot)) {
+            size = sizeof(Header) + initialSlots * sizeof(Slot);
+            if (ftruncate(file, size) != 0) Fail("cannot size");
+        }
+        Map(size);
+
+        // a header never written, the file is new or its creation was cut short
+        Header& header(GetHeader());
+        if (std::all_of(header.magic, header.magic + sizeof(magic), [](char c) { return c == 0; })) {
+            header.slotSize = sizeof(Slot);
+            header.ends[left] = header.ends[right] = nil;
+            header.length = 0;
+            header.freeHead = nil;
+            header.used = 0;
+            header.direction = true;
+            if (msync(base, sizeof(Header), MS_SYNC) != 0) Fail("cannot sync");
+            std::memcpy(header.magic, magic, sizeof(magic));
+            if (msync(base, sizeof(Header), MS_SYNC) != 0) Fail("cannot sync");
+        } else if (!std::equal(magic, magic + sizeof(magic), header.magic) || header.slotSize != sizeof(Slot)) {
+            throw std::runtime_error(path + " is not a queue of this item type");
+        }
+
+        journal = open((path + ".journal").c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (journal < 0) Fail("cannot open journal of");
+        Replay();
+    }
+
+    void Close() {
+        if (base != nullptr) munmap(base, mapped);
+        if (journal >= 0) close(journal);
+        if (file >= 0) close(file);
+        base = nullptr;
+        journal = file = -1;
+    }
+
+    void Map(std::size_t size) {
+        void* const address(mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0));
+        if (address == MAP_FAILED) Fail("cannot map");
+        base = static_cast<unsigned char*>(address);
+        mapped = size;
+    }
+
+    // makes sure a slot is free before a transaction starts holding references into the arena
+    // growing is journalled ahead of the records writing past the old end, which after a power cut may be all
+    // the file has kept
+    void Reserve() {
+        const Header& header(GetHeader());
+        if (header.freeHead != nil || header.used < Capacity()) return;
+        Transaction change(*this);
+        change.Grow(sizeof(Header) + 2 * Capacity() * sizeof(Slot));
+        Commit(change);
+    }
+
+    // a file already at least size long is left alone
+    void Grow(std::size_t size) {
+        if (size <= mapped) return;
+        if (ftruncate(file, size) != 0) Fail("cannot grow");
+        munmap(base, mapped);
+        base = nullptr;
+        Map(size);
+    }
+
+    std::uint64_t Allocate(Transaction& change) {
+        Header& header(GetHeader());
+        if (header.freeHead != nil) {
+            const std::uint64_t slot(header.freeHead);
+            change.Set(header.freeHead, At(slot).link[right]);
+            return slot;
+        }
+        change.Set(header.used, header.used + 1);
+        return header.used;
+    }
+
+    void Free(Transaction& change, std::uint64_t slot) {
+        Header& header(GetHeader());
+        change.Set(At(slot).link[right], header.freeHead);
+        change.Set(header.freeHead, slot);
+    }
+
+    // journal first, and with durable on disk first, so a crash between the two is put right by the next Replay
+    void Commit(Transaction& change) {
+        const std::vector<unsigned char>& record(change.Record());
+        for (std::size_t written(0); written < record.size();) {
+            const ssize_t n(write(journal, record.data() + written, record.size() - written));
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) Fail("cannot write journal of");
+            written += std::size_t(n);
+        }
+        journalSize += record.size();
+        if (durable && fsync(journal) != 0) Fail("cannot sync journal of");
+        Apply(record.data() + 2 * sizeof(std::uint32_t), record.size() - 2 * sizeof(std::uint32_t));
+        if (journalSize > journalLimit) CheckpointLocked();
+    }
+
+    // false if a write falls outside the arena, only possible in a damaged journal
+    bool Apply(const unsigned char* payload, std::size_t size) {
+        for (std::size_t at(0); at < size;) {
+            std::uint64_t offset;
+            std::uint32_t bytes;
+            if (size - at < sizeof(offset) + sizeof(bytes)) return false;
+            std::memcpy(&offset, payload + at, sizeof(offset));
+            std::memcpy(&bytes, payload + at + sizeof(offset), sizeof(bytes));
+            at += sizeof(offset) + sizeof(bytes);
+            if (size - at < bytes) return false;
+            if (offset == nil) {
+                std::uint64_t grown;
+                if (bytes != sizeof(grown)) return false;
+                std::memcpy(&grown, payload + at, sizeof(grown));
+                Grow(std::size_t(grown));
+            } else {
+                if (offset > mapped || mapped - offset < bytes) return false;
+                std::memcpy(base + offset, payload + at, bytes);
+            }
+            at += bytes;
+        }
+        return true;
+    }
+
+    // reapplies every whole record, the writes are absolute so records already in the arena do no harm
+    // stops at the first torn or damaged record and cuts the journal there
+    void Replay() {
+        std::vector<unsigned char> contents;
+        unsigned char buffer[1 << 16];
+        for (off_t at(0);;) {
+            const ssize_t n(pread(journal, buffer, sizeof(buffer), at));
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) Fail("cannot read journal of");
+            if (n == 0) break;
+            contents.insert(contents.end(), buffer, buffer + n);
+            at += n;
+        }
+
+        std::size_t at(0);
+        while (contents.size() - at >= 2 * sizeof(std::uint32_t)) {
+            std::uint32_t size, sum;
+            std::memcpy(&size, contents.data() + at, sizeof(size));
+            std::memcpy(&sum, contents.data() + at + sizeof(size), sizeof(sum));
+            const unsigned char* const payload(contents.data() + at + 2 * sizeof(std::uint32_t));
+            if (contents.size() - at - 2 * sizeof(std::uint32_t) < size || Checksum(payload, size) != sum) break;
+            if (!Apply(payload, size)) break;
+            at += 2 * sizeof(std::uint32_t) + size;
+        }
+        if (at != contents.size() && ftruncate(journal, at) != 0) Fail("cannot cut journal of");
+        journalSize = at;
+    }
+
+    void CheckpointLocked() {
+        if (base == nullptr) return;
+        // the file's length has to be down too before the journal that grew it goes
+        if (msync(base, mapped, MS_SYNC) != 0 || fsync(file) != 0) Fail("cannot sync");
+        if (ftruncate(journal, 0) != 0 || fsync(journal) != 0) Fail("cannot empty journal of");
+        journalSize = 0;
+    }
+
+    void PushEnd(bool atFront, const T& item) {
+        std::lock_guard<QueueMutex> lock(m);
+        PushLocked(atFront, item);
+    }
+
+    void PushLocked(bool atFront, const T& item) {
+        Reserve();
+        Header& header(GetHeader());
+        const int side(EndSide(atFront, header.direction)), inward(1 - side);
+        const std::uint64_t end(header.ends[side]);
+
+        Transaction change(*this);
+        const std::uint64_t slot(Allocate(change));
+        change.Set(At(slot).data, item);
+        change.Set(At(slot).link[side], nil);
+        change.Set(At(slot).link[inward], end);
+        if (end != nil) change.Set(At(end).link[side], slot);
+        else change.Set(header.ends[inward], slot);
+        change.Set(header.ends[side], slot);
+        change.Set(header.length, header.length + 1);
+        Commit(change);
+    }
+
+    std::optional<T> PopEnd(bool atFront) {
+        std::lock_guard<QueueMutex> lock(m);
+        return PopLocked(atFront);
+    }
+
+    std::optional<T> PopLocked(bool atFront) {
+        Header& header(GetHeader());
+        const int side(EndSide(atFront, header.direction)), inward(1 - side);
+        const std::uint64_t end(header.ends[side]);
+        if (end == nil) return std::nullopt;
+        std::optional<T> item(At(end).data);
+        const std::uint64_t next(At(end).link[inward]);
+
+        Transaction change(*this);
+        if (next != nil) change.Set(At(next).link[side], nil);
+        else change.Set(header.ends[inward], nil);
+        change.Set(header.ends[side], next);
+        change.Set(header.length, header.length - 1);
+        Free(change, end);
+        Commit(change);
+        return item;
+    }
+
+    const std::string path;
+    const std::size_t journalLimit;
+    // whether every record is on disk before the arena is written
+    const bool durable;
+
+    int file;
+    int journal;
+    unsigned char* base;
+    std::size_t mapped;
+    // bytes of journal since the last checkpoint
+    std::size_t journalSize;
+
+    mutable QueueMutex m;
+};
+#endif
+
+#endif
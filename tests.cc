@@ -0,0 +1,857 @@
+// tests for the queues in reversible_queue.h, each case checks its invariants and the run fails if any check does
+// build: g++ -std=c++17 -O2 -pthread tests.cc -o tests && ./tests          (-std=c++20 adds the coroutine cases)
+// run:   ./tests [--list] [--case name,...] [--seconds s] [--dir path]
+// exits 1 if any check failed. The concurrent cases run for --seconds each, worth repeating under
+// -fsanitize=thread and -fsanitize=address
+
+#include "reversible_queue.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#if defined(__unix__) || defined(__APPLE__)
+#include <csignal>
+#include <sys/wait.h>
+#endif
+
+struct Params {
+    double seconds = 2;
+    // where the mapped queue cases put their files
+    std::string dir = "/tmp";
+};
+
+static std::atomic<std::size_t> failures(0);
+
+// unlike assert this stays in -DNDEBUG builds
+#define CHECK(condition) Check((condition), #condition, __FILE__, __LINE__)
+
+static void Check(bool ok, const char* what, const char* file, int line) {
+    if (ok) return;
+    failures++;
+    std::cerr << file << ":" << line << ": check failed: " << what << "\n";
+}
+
+// runs body on n threads until seconds have passed
+template<class Body>
+static void RunFor(std::size_t n, double seconds, Body body) {
+    std::atomic<bool> stop(false);
+    std::vector<std::thread> threads;
+    for (std::size_t thread = 0; thread < n; thread++) {
+        threads.emplace_back([&body, &stop, thread] { body(thread, stop); });
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop = true;
+    for (std::thread& thread : threads) thread.join();
+}
+
+// runs body on a thread of its own, for cases whose bug is a hang. A hung thread cannot be joined, so if body has
+// not returned within seconds the run fails there and then
+template<class Body>
+static void Finishes(const char* name, double seconds, Body body) {
+    std::atomic<bool> done(false);
+    std::thread thread([&body, &done] {
+        body();
+        done = true;
+    });
+    const std::chrono::steady_clock::time_point until(
+        std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                               std::chrono::duration<double>(seconds)));
+    while (!done && std::chrono::steady_clock::now() < until) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    if (!done) {
+        std::cerr << name << ": still running after " << seconds << " seconds\n";
+        std::cout << "FAIL  " << name << std::endl;
+        std::_Exit(1);
+    }
+    thread.join();
+}
+
+// every item from the back to the front, on a queue nobody else is using
+template<class Queue>
+static std::vector<long> Items(const Queue& queue) {
+    std::vector<long> items;
+    queue.ForEachFromBack([&items](long item) { items.push_back(item); });
+    return items;
+}
+
+static bool Unique(std::vector<long> items) {
+    std::sort(items.begin(), items.end());
+    return std::adjacent_find(items.begin(), items.end()) == items.end();
+}
+
+// walkers both ways, erasers and a reverser over one queue, every erased item replaced by a fresh one
+// each walk sees an item at most once, and once everyone stops the length matches the items linked
+template<class Queue>
+static void MixedDirectionsRun(const Params& params) {
+    Queue queue;
+    const long initial(200);
+    for (long i = 0; i < initial; i++) queue.PushBack(i);
+    std::atomic<long> next(initial);
+    const std::size_t walkers(4), erasers(2);
+    RunFor(walkers + erasers + 1, params.seconds, [&](std::size_t thread, std::atomic<bool>& stop) {
+        std::mt19937 rng(static_cast<unsigned>(thread));
+        while (!stop.load(std::memory_order_relaxed)) {
+            if (thread < walkers) {
+                // half walk from the back forwards, half from the front backwards
+                const bool forwards(thread % 2 == 0);
+                std::vector<long> seen;
+                try {
+                    typename Queue::Cursor cursor(forwards ? queue.Back() : queue.Front());
+                    do seen.push_back(cursor.Get());
+                    while (forwards ? cursor.Advance() : cursor.Retreat());
+                }
+                catch (const std::logic_error&) {
+                    // emptied under us, or our place was lost to erasers
+                }
+                CHECK(Unique(seen));
+            } else if (thread < walkers + erasers) {
+                try {
+                    typename Queue::Cursor cursor(queue.SeekFromBack(rng() % initial));
+                    cursor.Erase();
+                }
+                catch (const std::logic_error&) {
+                    // past the end, or at an end the node queue wants popped
+                    continue;
+                }
+                queue.PushBack(next++);
+            } else {
+                queue.reverse();
+                std::this_thread::yield();
+            }
+        }
+    });
+    const std::vector<long> items(Items(queue));
+    CHECK(items.size() == queue.Size());
+    // an erase that finds its node already erased by someone else counts as done, so go by what was unlinked
+    const QueueStats stats(queue.Stats());
+    CHECK(stats.pushes + stats.inserts - stats.pops - stats.erases == queue.Size());
+    CHECK(Unique(items));
+}
+
+static void MixedDirections(const Params& params) {
+    MixedDirectionsRun<ReversibleQueue<long>>(params);
+    MixedDirectionsRun<ReversibleQueue<long, PooledNodes, OrderIndex, HandoffBackoff>>(params);
+    MixedDirectionsRun<UnrolledReversibleQueue<long, 8>>(params);
+}
+
+// each item from the back to the front exactly once even if writers are busy, ForEachFromBack may revisit some
+template<class Queue>
+static std::vector<long> Gathered(const Queue& queue) {
+    return queue.TransformReduce(
+        std::vector<long>(),
+        [](std::vector<long> left, const std::vector<long>& right) {
+            left.insert(left.end(), right.begin(), right.end());
+            return left;
+        },
+        [](const long& item) { return std::vector<long>{item}; });
+}
+
+// true if the items that are not negative come strictly downwards from the back
+static bool Descending(const std::vector<long>& items) {
+    long last(-1);
+    for (long item : items) {
+        if (item < 0) continue;
+        if (last >= 0 && item >= last) return false;
+        last = item;
+    }
+    return true;
+}
+
+template<class Queue>
+static std::vector<long> PushRange(Queue& queue, long first, long last) {
+    std::vector<long> items;
+    for (long i = first; i < last; i++) items.push_back(i);
+    queue.PushBack(items.begin(), items.end());
+    return Items(queue);
+}
+
+// splices in every combination of directions and splits at every 13th item, checking order and length each time
+template<class Queue>
+static void SpliceOrder() {
+    for (int turned = 0; turned < 4; turned++) {
+        Queue queue, behind;
+        if (turned & 1) queue.reverse();
+        if (turned & 2) behind.reverse();
+        const std::vector<long> ours(PushRange(queue, 0, 50)), theirs(PushRange(behind, 100, 140));
+        queue.SpliceBack(std::move(behind));
+        std::vector<long> expected(theirs);
+        expected.insert(expected.end(), ours.begin(), ours.end());
+        CHECK(Items(queue) == expected);
+        CHECK(queue.Size() == expected.size());
+        CHECK(behind.Empty());
+
+        Queue inFront;
+        PushRange(inFront, 200, 230);
+        if (turned & 1) inFront.reverse();
+        const std::vector<long> front(Items(inFront));
+        queue.SpliceFront(std::move(inFront));
+        expected.insert(expected.end(), front.begin(), front.end());
+        CHECK(Items(queue) == expected);
+        CHECK(queue.Size() == expected.size());
+
+        // into an empty queue facing the other way
+        Queue whole;
+        if (!(turned & 2)) whole.reverse();
+        whole.SpliceBack(std::move(queue));
+        CHECK(Items(whole) == expected);
+        CHECK(whole.Size() == expected.size());
+        CHECK(queue.Empty());
+
+        for (std::size_t k = 0; k < expected.size(); k += 13) {
+            typename Queue::Cursor cursor(whole.SeekFromBack(k));
+            Queue cut(whole.SplitAt(cursor));
+            cursor.Release();
+            CHECK(Items(cut) == std::vector<long>(expected.begin(), expected.begin() + long(k)));
+            CHECK(cut.Size() == k);
+            CHECK(Items(whole) == std::vector<long>(expected.begin() + long(k), expected.end()));
+            CHECK(whole.Size() == expected.size() - k);
+            whole.SpliceBack(std::move(cut));
+            CHECK(Items(whole) == expected);
+        }
+    }
+}
+
+// SplitAt waits for every read open on the queue, it must refuse one this thread holds rather than hang, and wait
+// for one another thread holds
+template<class Queue>
+static void SplitOwnRead() {
+    Queue queue;
+    PushRange(queue, 0, 30);
+    {
+        typename Queue::View view(queue.Snapshot());
+        typename Queue::Cursor cursor(queue.SeekFromBack(5));
+        bool refused(false);
+        try {
+            Queue cut(queue.SplitAt(cursor));
+        } catch (const std::logic_error&) {
+            refused = true;
+        }
+        CHECK(refused);
+        CHECK(queue.Size() == 30);
+    }
+    bool walked(false);
+    queue.ForEachFromBack([&](long) {
+        if (walked) return;
+        walked = true;
+        typename Queue::Cursor cursor(queue.SeekFromBack(5));
+        bool refused(false);
+        try {
+            Queue cut(queue.SplitAt(cursor));
+        } catch (const std::logic_error&) {
+            refused = true;
+        }
+        CHECK(refused);
+    });
+    CHECK(queue.Size() == 30);
+
+    // once this thread's reads are closed the split goes ahead, waiting for the other thread's snapshot
+    std::atomic<bool> open(false), closed(false);
+    std::thread reader([&] {
+        typename Queue::View view(queue.Snapshot());
+        open = true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        std::size_t count(0);
+        for (const long& item : view) count += item >= 0;
+        CHECK(count == 30);
+        closed = true;
+    });
+    while (!open) std::this_thread::yield();
+    typename Queue::Cursor cursor(queue.SeekFromBack(10));
+    Queue cut(queue.SplitAt(cursor));
+    CHECK(closed);
+    reader.join();
+    CHECK(cut.Size() == 10);
+    CHECK(queue.Size() == 20);
+}
+
+// a reader on another thread with a snapshot open goes for the node the splitting cursor is on, so it can only
+// close its snapshot once the split lets go of the node while it waits for readers
+template<class Queue>
+static void SplitBlockedReader() {
+    Queue queue;
+    PushRange(queue, 0, 30);
+    typename Queue::Cursor cursor(queue.SeekFromBack(5));
+    std::atomic<bool> open(false);
+    std::thread reader([&queue, &open] {
+        typename Queue::View view(queue.Snapshot());
+        open = true;
+        try {
+            typename Queue::Cursor blocked(queue.SeekFromBack(5));
+        } catch (const std::logic_error&) {
+            // the queue was cut shorter meanwhile
+        }
+    });
+    while (!open) std::this_thread::yield();
+    // give the reader time to block on the node
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    Queue cut(queue.SplitAt(cursor));
+    reader.join();
+    CHECK(cut.Size() == 5);
+    CHECK(queue.Size() == 25);
+    CHECK(cursor.Get() == 24);
+}
+
+// the main thread splits the queue and splices it back together while others push and pop at the front, walk it,
+// take snapshots and observe it. Walks must see the original items in order, and afterwards the originals left
+// have to be an unbroken run from the back
+template<class Queue, bool snapshots>
+static void SpliceConcurrentRun(const Params& params) {
+    Queue queue;
+    const long initial(2000);
+    PushRange(queue, 0, initial);
+    std::atomic<long> nextFront(-1);
+    std::atomic<bool> stop(false);
+    std::vector<std::thread> threads;
+    for (unsigned thread = 0; thread < 2; thread++) {
+        threads.emplace_back([&, thread] {
+            std::mt19937 rng(thread);
+            while (!stop) {
+                if (rng() & 1) queue.PushFront(nextFront--);
+                else queue.TryPopFront();
+            }
+        });
+    }
+    threads.emplace_back([&] {
+        while (!stop) {
+            const std::vector<long> items(Gathered(queue));
+            CHECK(Descending(items));
+            CHECK(Unique(items));
+        }
+    });
+    if constexpr (snapshots) {
+        threads.emplace_back([&] {
+            while (!stop) {
+                typename Queue::View view(queue.Snapshot());
+                CHECK(Descending(std::vector<long>(view.begin(), view.end())));
+            }
+        });
+    }
+    threads.emplace_back([&] {
+        while (!stop) {
+            try {
+                typename Queue::Cursor cursor(queue.Front());
+                for (int i = 0; i < 20 && cursor.Retreat(); i++) {}
+            } catch (const std::logic_error&) {
+                // emptied or our node popped under us
+            }
+        }
+    });
+
+    std::mt19937 rng(7);
+    const std::chrono::steady_clock::time_point until(
+        std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                               std::chrono::duration<double>(params.seconds)));
+    while (std::chrono::steady_clock::now() < until) {
+        try {
+            typename Queue::Cursor cursor(queue.SeekFromBack(rng() % 1000));
+            Queue cut(queue.SplitAt(cursor));
+            cursor.Release();
+            queue.SpliceBack(std::move(cut));
+        } catch (const std::logic_error&) {
+            // the front pops got there first
+        }
+    }
+    stop = true;
+    for (std::thread& thread : threads) thread.join();
+
+    const std::vector<long> items(Items(queue));
+    CHECK(items.size() == queue.Size());
+    CHECK(Unique(items));
+    // front pops take originals from the low end only, so what is left runs initial - 1 downwards without a gap
+    long expected(initial - 1);
+    for (long item : items) {
+        if (item < 0) continue;
+        CHECK(item == expected);
+        expected--;
+    }
+}
+
+static void SpliceSplit(const Params& params) {
+    using Ordered = ReversibleQueue<long, PooledNodes, OrderIndex, ExponentialBackoff, Versioned>;
+    using Plain = ReversibleQueue<long>;
+    using Unindexed = ReversibleQueue<long, PooledNodes, NoIndex, ExponentialBackoff, Versioned>;
+    SpliceOrder<Ordered>();
+    SpliceOrder<Plain>();
+    SpliceOrder<Unindexed>();
+    SplitOwnRead<Ordered>();
+    SplitOwnRead<Unindexed>();
+    Finishes("splice-split", 10, [] {
+        SplitBlockedReader<Ordered>();
+        SplitBlockedReader<Unindexed>();
+    });
+    SpliceConcurrentRun<Ordered, true>(params);
+    SpliceConcurrentRun<Plain, false>(params);
+    SpliceConcurrentRun<Unindexed, true>(params);
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+// one step of a writer whose every operation can be replayed on a model, k picks a position where there is one
+struct MappedStep {
+    enum Kind { pushBack, pushFront, popBack, popFront, insert, erase, reverse } kind;
+    std::size_t k;
+};
+
+static MappedStep NextStep(std::mt19937_64& rng, std::size_t size) {
+    static const MappedStep::Kind kinds[] = {
+        MappedStep::pushBack, MappedStep::pushBack, MappedStep::pushBack, MappedStep::pushBack, MappedStep::pushFront,
+        MappedStep::pushFront, MappedStep::popBack, MappedStep::popFront, MappedStep::popFront, MappedStep::insert,
+        MappedStep::erase, MappedStep::reverse};
+    const MappedStep::Kind kind(kinds[rng() % std::size(kinds)]);
+    return MappedStep{kind, std::size_t(rng() % (size + 1))};
+}
+
+// item i is the one step i adds, the model holds the items from the back to the front
+static void Apply(std::deque<long>& model, const MappedStep& step, long i) {
+    switch (step.kind) {
+    case MappedStep::pushBack: model.push_front(i); break;
+    case MappedStep::pushFront: model.push_back(i); break;
+    case MappedStep::popBack: if (!model.empty()) model.pop_front(); break;
+    case MappedStep::popFront: if (!model.empty()) model.pop_back(); break;
+    case MappedStep::insert: model.insert(model.begin() + long(step.k), i); break;
+    case MappedStep::erase: if (step.k < model.size()) model.erase(model.begin() + long(step.k)); break;
+    case MappedStep::reverse: std::reverse(model.begin(), model.end()); break;
+    }
+}
+
+static void Apply(MappedReversibleQueue<long>& queue, const MappedStep& step, long i) {
+    switch (step.kind) {
+    case MappedStep::pushBack: queue.PushBack(i); break;
+    case MappedStep::pushFront: queue.PushFront(i); break;
+    case MappedStep::popBack: queue.TryPopBack(); break;
+    case MappedStep::popFront: queue.TryPopFront(); break;
+    case MappedStep::insert: queue.InsertAt(step.k, i); break;
+    case MappedStep::erase: if (step.k < queue.Size()) queue.EraseAt(step.k); break;
+    case MappedStep::reverse: queue.reverse(); break;
+    }
+}
+
+template<class Queue>
+static std::vector<long> MappedItems(const Queue& queue) {
+    std::vector<long> items;
+    queue.ForEachFromBack([&items](const long& item) { items.push_back(item); });
+    return items;
+}
+
+static void RemoveMapped(const std::string& path) {
+    std::remove(path.c_str());
+    std::remove((path + ".journal").c_str());
+}
+
+static void CopyFile(const std::string& from, const std::string& to) {
+    std::ifstream in(from, std::ios::binary);
+    std::ofstream out(to, std::ios::binary | std::ios::trunc);
+    out << in.rdbuf();
+}
+
+// a writer killed at a random moment mid stream, growing the file and checkpointing as it goes. Reopened, the
+// queue has to hold exactly what the model does after the steps the writer finished, or one more for the step
+// it was in when killed
+static void MappedKilled(const Params& params) {
+    const std::string path(params.dir + "/tests-" + std::to_string(getpid()) + ".queue");
+    // how many steps the writer has finished, shared with it
+    void* const shared(mmap(nullptr, sizeof(std::atomic<long>), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                            -1, 0));
+    CHECK(shared != MAP_FAILED);
+    if (shared == MAP_FAILED) return;
+    std::atomic<long>* const done(new (shared) std::atomic<long>(0));
+    std::mt19937_64 delays(1);
+    for (int trial = 0; trial < 20; trial++) {
+        RemoveMapped(path);
+        done->store(0);
+        const pid_t child(fork());
+        if (child == 0) {
+            try {
+                MappedReversibleQueue<long> queue(path, std::size_t(1) << 16);
+                std::mt19937_64 rng(trial);
+                for (long i = 0;; i++) {
+                    Apply(queue, NextStep(rng, queue.Size()), i);
+                    done->store(i + 1, std::memory_order_release);
+                }
+            } catch (...) {
+                std::_Exit(1);
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10 + delays() % 150));
+        kill(child, SIGKILL);
+        int status;
+        waitpid(child, &status, 0);
+        CHECK(WIFSIGNALED(status));
+
+        const long finished(done->load(std::memory_order_acquire));
+        std::vector<long> items;
+        try {
+            MappedReversibleQueue<long> queue(path);
+            items = MappedItems(queue);
+            CHECK(items.size() == queue.Size());
+        } catch (const std::exception& e) {
+            std::cerr << "reopening after a kill: " << e.what() << "\n";
+            CHECK(false);
+            continue;
+        }
+        std::deque<long> model;
+        std::mt19937_64 rng(trial);
+        for (long i = 0; i < finished; i++) Apply(model, NextStep(rng, model.size()), i);
+        const bool asFinished(std::equal(items.begin(), items.end(), model.begin(), model.end()));
+        Apply(model, NextStep(rng, model.size()), finished);
+        const bool oneMore(std::equal(items.begin(), items.end(), model.begin(), model.end()));
+        CHECK(asFinished || oneMore);
+    }
+    munmap(shared, sizeof(std::atomic<long>));
+    RemoveMapped(path);
+}
+
+static std::string ReadFile(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+// a power cut leaves each 512 byte block of a file as some write left it, here either as it was at the checkpoint
+// or as it was at the end, and the file as long as either
+static void MixFile(const std::string& old, const std::string& now, const std::string& path, std::mt19937_64& rng) {
+    std::string mixed(rng() & 1 ? old : now);
+    for (std::size_t at = 0; at < mixed.size(); at += 512) {
+        const std::string& from(rng() & 1 ? old : now);
+        if (at < from.size()) mixed.replace(at, std::min<std::size_t>(512, from.size() - at), from, at, 512);
+    }
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out << mixed;
+}
+
+// a durable writer's journal is on disk before any arena write it covers, so whichever of the arena's blocks
+// reached the disk, growth included, replay has to bring back exactly what the finished steps left
+static void MappedPowerCut(const Params& params) {
+    const std::string path(params.dir + "/tests-" + std::to_string(getpid()) + ".queue");
+    RemoveMapped(path);
+    // enough to grow the arena past its first 1024 slots
+    const long steps(3000);
+    const pid_t child(fork());
+    if (child == 0) {
+        try {
+            MappedReversibleQueue<long> queue(path, std::size_t(64) << 20, true);
+            queue.Checkpoint();
+            CopyFile(path, path + ".checkpoint");
+            std::mt19937_64 rng(99);
+            for (long i = 0; i < steps; i++) Apply(queue, NextStep(rng, queue.Size()), i);
+            // gone without the closing checkpoint, as if the power went
+            std::_Exit(0);
+        } catch (...) {
+            std::_Exit(1);
+        }
+    }
+    int status;
+    waitpid(child, &status, 0);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    std::deque<long> model;
+    std::mt19937_64 replay(99);
+    for (long i = 0; i < steps; i++) Apply(model, NextStep(replay, model.size()), i);
+    const std::vector<long> expected(model.begin(), model.end());
+    const std::string old(ReadFile(path + ".checkpoint")), now(ReadFile(path)),
+        journal(ReadFile(path + ".journal"));
+    std::mt19937_64 rng(1);
+    for (int trial = 0; trial < 20; trial++) {
+        MixFile(old, now, path, rng);
+        {
+            std::ofstream out(path + ".journal", std::ios::binary | std::ios::trunc);
+            out << journal;
+        }
+        try {
+            MappedReversibleQueue<long> queue(path);
+            CHECK(MappedItems(queue) == expected);
+        } catch (const std::exception& e) {
+            std::cerr << "reopening after a power cut: " << e.what() << "\n";
+            CHECK(false);
+        }
+    }
+    std::remove((path + ".checkpoint").c_str());
+    RemoveMapped(path);
+}
+
+static void MappedCrash(const Params& params) {
+    MappedKilled(params);
+    MappedPowerCut(params);
+}
+#endif
+
+// threads that finish still observing, more of them than the table has slots. Each leaves its observer on the
+// back item, locked, so unless finishing hands the slot back neither can a later thread observe nor can the items go
+template<class Queue>
+static void ObserverSlotsRun() {
+    Queue queue;
+    for (long i = 0; i < 10; i++) queue.PushBack(i);
+    bool refused(false);
+    for (int thread = 0; thread < 300 && !refused; thread++) {
+        std::thread([&queue, &refused] {
+            try {
+                queue.GoToBack();
+                CHECK(queue.GetData() == 9);
+            } catch (const std::length_error&) {
+                refused = true;
+            }
+        }).join();
+    }
+    CHECK(!refused);
+    for (long i = 0; i < 10; i++) queue.PopBack();
+    CHECK(queue.Empty());
+}
+
+static void ObserverSlots(const Params&) {
+    Finishes("observer-slots", 10, [] {
+        ObserverSlotsRun<ReversibleQueue<long>>();
+        ObserverSlotsRun<UnrolledReversibleQueue<long, 8>>();
+    });
+}
+
+// bulk operations started from inside a pool on that same pool: from a posted task on a worker, and from a task
+// of a Run already going
+static void NestedPool(const Params&) {
+    Finishes("nested-pool", 10, [] {
+        ReversibleQueue<long> queue;
+        std::vector<long> items;
+        for (long i = 0; i < 1000; i++) items.push_back(i);
+        queue.PushBack(items.begin(), items.end());
+        const long sum(999 * 1000 / 2);
+        auto add = [](long left, long right) { return left + right; };
+        auto same = [](const long& item) { return item; };
+        ThreadPool pool(3);
+
+        std::mutex m;
+        std::condition_variable cv;
+        bool done(false);
+        long posted(0);
+        std::atomic<long> visited(0);
+        pool.Post([&] {
+            const long total(queue.TransformReduce(0L, add, same, pool));
+            queue.ParallelForEach([&visited](const long& item) { visited += item; }, pool);
+            std::lock_guard<std::mutex> lock(m);
+            posted = total;
+            done = true;
+            cv.notify_one();
+        });
+        {
+            std::unique_lock<std::mutex> lock(m);
+            cv.wait(lock, [&done] { return done; });
+        }
+        CHECK(posted == sum);
+        CHECK(visited == sum);
+
+        std::atomic<long> inner(0);
+        pool.Run(4, [&](std::size_t) { inner += queue.TransformReduce(0L, add, same, pool); });
+        CHECK(inner == 4 * sum);
+    });
+}
+
+// counts the items alive, moved from ones included, so an item is only uncounted once its node is freed
+struct Counted {
+    static std::atomic<long> live;
+    long value;
+    Counted(long v) : value(v) { live++; }
+    Counted(const Counted& other) : value(other.value) { live++; }
+    Counted(Counted&& other) : value(other.value) { live++; }
+    Counted& operator=(const Counted&) = default;
+    Counted& operator=(Counted&&) = default;
+    ~Counted() { live--; }
+};
+
+std::atomic<long> Counted::live(0);
+
+// a burst of pops while a lock-free reader is in the middle of a walk, then nothing: the nodes popped under the
+// reader have to be freed once it leaves, not whenever the queue next happens to be written to
+static void RetireDrain(const Params&) {
+    Finishes("retire-drain", 10, [] {
+        for (int round = 0; round < 20; round++) {
+            ReversibleQueue<Counted> queue;
+            for (long i = 0; i < 100; i++) queue.PushBack(Counted(i));
+            std::mutex m;
+            std::condition_variable cv;
+            bool inside(false);
+            bool popped(false);
+            std::thread reader([&] {
+                queue.ForEachFromBack([&](const Counted&) {
+                    std::unique_lock<std::mutex> lock(m);
+                    if (inside) return;
+                    inside = true;
+                    cv.notify_all();
+                    cv.wait(lock, [&popped] { return popped; });
+                });
+            });
+            {
+                std::unique_lock<std::mutex> lock(m);
+                cv.wait(lock, [&inside] { return inside; });
+            }
+            for (long i = 0; i < 100; i++) queue.PopBack();
+            CHECK(Counted::live > 0);
+            {
+                std::lock_guard<std::mutex> lock(m);
+                popped = true;
+                cv.notify_all();
+            }
+            reader.join();
+            CHECK(queue.Empty());
+            CHECK(Counted::live == 0);
+        }
+    });
+}
+
+// producers blocked on a full ring when it is closed give up instead of waiting for room that never comes
+static void CloseFull(const Params&) {
+    Finishes("close-full", 10, [] {
+        for (int round = 0; round < 20; round++) {
+            BoundedReversibleQueue<long, 4> queue;
+            for (long i = 0; i < 4; i++) CHECK(queue.TryPushBack(i));
+            std::atomic<int> refused(0);
+            std::vector<std::thread> producers;
+            for (long i = 0; i < 3; i++) {
+                producers.emplace_back([&queue, &refused, i] {
+                    if (!(i & 1 ? queue.PushFront(10 + i) : queue.PushBack(10 + i))) refused++;
+                });
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            queue.Close();
+            for (std::thread& producer : producers) producer.join();
+            CHECK(refused == 3);
+            CHECK(queue.Size() == 4);
+            CHECK(!queue.PushBack(20));
+            CHECK(queue.WaitPopFront() && queue.PushBack(20));
+        }
+    });
+}
+
+// a versioning following another one a whole number of parities ahead, while a writer never lets its counter drain:
+// each write starts before the last one ends, so only the writes of the generations left behind ever finish
+static void FollowWriting(const Params&) {
+    Finishes("follow-writing", 10, [] {
+        for (int round = 0; round < 20; round++) {
+            Versioned versions;
+            Versioned ahead;
+            for (int i = 0; i < 2 + round % 3; i++) ahead.Close(ahead.Open());
+            std::atomic<bool> stop(false);
+            std::atomic<bool> writing(false);
+            std::thread writer([&versions, &stop, &writing] {
+                std::uint64_t g(versions.BeginWrite());
+                writing = true;
+                while (!stop) {
+                    const std::uint64_t next(versions.BeginWrite());
+                    versions.EndWrite(g);
+                    g = next;
+                }
+                versions.EndWrite(g);
+            });
+            while (!writing) std::this_thread::yield();
+            versions.Follow(ahead);
+            stop = true;
+            writer.join();
+            CHECK(versions.Open() >= ahead.Open());
+        }
+    });
+}
+
+#if defined(__cpp_impl_coroutine)
+// fire and forget coroutine for the producers
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+static Detached PushWhenRoom(ReversibleQueue<long>& queue, long item, InlineExecutor& executor) {
+    co_await queue.AsyncPushBack(item, executor, 1);
+}
+
+// a waiting consumer's pop makes room for a producer parked on a full queue, which resumes inline on the consumer's
+// thread and pushes, notifying the very waiters the consumer is among
+static void WaitResumesPusher(const Params&) {
+    Finishes("wait-resumes-pusher", 10, [] {
+        for (int round = 0; round < 20; round++) {
+            ReversibleQueue<long> queue;
+            InlineExecutor executor;
+            std::vector<long> popped;
+            std::thread consumer([&queue, &popped] {
+                for (int i = 0; i < 2; i++) {
+                    if (std::optional<long> item = queue.WaitPopFront()) popped.push_back(*item);
+                }
+            });
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            queue.PushBack(1);
+            PushWhenRoom(queue, 7, executor);
+            consumer.join();
+            CHECK((popped == std::vector<long>{1, 7}));
+        }
+    });
+}
+#endif
+
+struct Case {
+    const char* name;
+    const char* description;
+    void (*run)(const Params&);
+};
+
+static const Case cases[] = {
+    {"mixed-directions", "walkers both ways with erasers and a reverser, on every engine with cursors", MixedDirections},
+    {"splice-split", "splices and splits checked for order and length, alone and among walkers, snapshots and cursors",
+     SpliceSplit},
+#if defined(__unix__) || defined(__APPLE__)
+    {"mapped-crash", "mapped queue reopened after killing its writer mid stream, and a durable one after a simulated power cut",
+     MappedCrash},
+#endif
+    {"observer-slots", "observer slots handed back by threads that finish without releasing them", ObserverSlots},
+    {"nested-pool", "TransformReduce and ParallelForEach called from inside the pool they run on", NestedPool},
+    {"close-full", "producers blocked on a full bounded queue let go by closing it", CloseFull},
+    {"follow-writing", "a versioning moving on past another one's generations while it is written to", FollowWriting},
+    {"retire-drain", "nodes popped under a lock-free reader freed once it leaves, with no writes after", RetireDrain},
+#if defined(__cpp_impl_coroutine)
+    {"wait-resumes-pusher", "a waiting pop resuming a parked push inline on its own thread", WaitResumesPusher},
+#endif
+};
+
+int main(int argc, char** argv) {
+    Params params;
+    std::vector<std::string> chosen;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg(argv[i]);
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) throw std::invalid_argument(arg + " needs a value");
+            return argv[++i];
+        };
+        if (arg == "--seconds") params.seconds = std::stod(value());
+        else if (arg == "--dir") params.dir = value();
+        else if (arg == "--case") {
+            std::stringstream names(value());
+            for (std::string name; std::getline(names, name, ',');) chosen.push_back(name);
+        } else if (arg == "--list") {
+            for (const Case& c : cases) std::cout << c.name << "  " << c.description << "\n";
+            return 0;
+        } else {
+            std::cerr << "unknown argument " << arg << "\n";
+            return 2;
+        }
+    }
+    for (const std::string& name : chosen) {
+        if (std::none_of(std::begin(cases), std::end(cases), [&name](const Case& c) { return name == c.name; })) {
+            std::cerr << "unknown case " << name << "\n";
+            return 2;
+        }
+    }
+    for (const Case& c : cases) {
+        if (!chosen.empty() && std::find(chosen.begin(), chosen.end(), c.name) == chosen.end()) continue;
+        const std::size_t before(failures);
+        c.run(params);
+        std::cout << (failures == before ? "ok    " : "FAIL  ") << c.name << "\n";
+    }
+    return failures ? 1 : 0;
+}